@@ -1,16 +1,43 @@
 #include"bvh.h"
 #include"core/memory/memory.h"
+#include"core/parallel/parallel.h"
+#include"core/parameter/parameter.h"
+#include"core/interaction/interaction.h"
+#include"shapes/triangle/triangle.h"
+#if defined(PBRT_HAVE_SSE) || defined(PBRT_HAVE_AVX)
+#include<immintrin.h>
+#endif
+#include"core/statistics/stats.h"
+#include<unordered_map>
+#include<unordered_set>
+#include<queue>
+#include<random>
+#include<cstdio>
+#include<cstring>
+#include<filesystem>
 
 namespace pbrt
 {
+    STAT_COUNTER("BVH/Interior nodes", interiorNodes);
+    STAT_COUNTER("BVH/Leaf nodes", leafNodes);
+    STAT_MEMORY_COUNTER("Memory/BVH tree", treeBytes);
+    STAT_FLOAT_DISTRIBUTION("BVH/SAH cost", sahCost);
+    STAT_INT_DISTRIBUTION("BVH/Tree depth", treeDepth);
+    STAT_INT_DISTRIBUTION("BVH/Primitives per leaf", primitivesPerLeaf);
+    STAT_INT_DISTRIBUTION("BVH/Nodes visited per ray", nodesVisited);
+    STAT_INT_DISTRIBUTION("BVH/Primitives tested per ray", primitivesTested);
+    STAT_INT_DISTRIBUTION("BVH/Nodes visited per shadow ray", shadowNodesVisited);
+    STAT_INT_DISTRIBUTION("BVH/Primitives tested per shadow ray", shadowPrimitivesTested);
+
     //record the information of the primitive
     struct BVHPrimitiveInfo
     {
+        BVHPrimitiveInfo() { }
         BVHPrimitiveInfo(size_t primitiveIndex, const Bounds3f& bounds)
         : primitiveIndex(primitiveIndex), bounds(bounds), centroid(0.5f * bounds.pMin + 0.5f * bounds.pMax) { }
         size_t primitiveIndex;
         Bounds3f bounds;
-        Point3f centroid;    
+        Point3f centroid;
     };
 
     struct BVHBuildNode
@@ -32,35 +59,3589 @@ namespace pbrt
             bounds = Union(left->bounds, right->bounds);
             nPrimitives = 0;
         }
+        //initialize interior node whose children are linked after they are built
+        void InitInterior(int splitAxis, const Bounds3f& bounds)
+        {
+            left = right = nullptr;
+            this->splitAxis = splitAxis;
+            this->bounds = bounds;
+            nPrimitives = 0;
+        }
         Bounds3f bounds;
         BVHBuildNode* left;
         BVHBuildNode* right;
         int splitAxis;
         int firstPrimOffset;
         int nPrimitives;
+        //count of levels below the node, 0 for leaves, only kept up to date by the treelet passes
+        int height;
     };
 
+    //node of the editable tree of Insert and Remove, a leaf holds a single primitive
+    struct BVHEditNode
+    {
+        Bounds3f bounds;
+        //nullptr for interior node
+        std::shared_ptr<Primitive> primitive;
+        int parent;
+        int children[2];
+        //count of primitives in the subtree
+        int nPrimitives;
+    };
 
-    BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>>& primitives, int maxPrimsInNode, SplitMethod splitMethod)
-    : maxPrimsInNode(std::min(255, maxPrimsInNode)), primitives(primitives), splitMethod(splitMethod)
+    //the node of the flattened BVH tree, 32 bytes to fit two nodes in a cache line
+    struct alignas(32) LinearBVHNode
     {
-        if(primitives.empty())
+        Bounds3f bounds;
+        union
+        {
+            //for leaf node
+            int primitivesOffset;
+            //for interior node
+            int secondChildOffset;
+        };
+        //0 for interior node
+        uint16_t nPrimitives;
+        //interior node: xyz
+        uint8_t axis;
+        //ensure 32 byte total size
+        uint8_t pad[1];
+    };
+#ifndef PBRT_FLOAT_AS_DOUBLE
+    static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should be 32 bytes");
+#endif
+
+    //the node of the wide BVH tree, child bounds are stored as structure of arrays to be tested at once
+    template<int N>
+    struct alignas(64) WideBVHNode
+    {
+        //[0: min, 1: max][axis][child], empty slots have inverted bounds that never be hit
+        Float bounds[2][3][N];
+        //interior child: index of the wide node, leaf child: offset of the first primitive
+        int32_t offset[N];
+        //0 for interior child or empty slot
+        uint16_t nPrimitives[N];
+    };
+
+    //binary node with the boxes of both children quantized to 8 bits in the box of the node,
+    //the box of the root is BVHAccel::bounds and the box of every other node is decoded from its parent
+    struct QuantizedBVHNode
+    {
+        //[child][0: min, 1: max][axis], min counts steps up from pMin of the node and max counts down from pMax
+        uint8_t childBounds[2][2][3];
+        //interior child: index of its node, leaf child: offset of the first primitive
+        int32_t offset[2];
+        //0 for interior child
+        uint8_t nPrimitives[2];
+        uint8_t axis;
+        uint8_t pad[1];
+    };
+
+    static_assert(sizeof(QuantizedBVHNode) == 24, "QuantizedBVHNode should be 24 bytes");
+
+    //copy of the vertices of a triangle primitive, so a leaf can be tested without touching the mesh or calling Primitive
+    struct LeafTriangle
+    {
+        TriangleVertices vertices;
+        //false for primitives that aren't triangles or have alpha masks, they are intersected through Primitive
+        bool isTriangle;
+    };
+
+    //the work of a single traversal, added to the per-ray distributions when it ends
+    struct TraversalStats
+    {
+        TraversalStats(StatIntDistribution& nodes, StatIntDistribution& primitives) : nodes(nodes), primitives(primitives) { }
+        ~TraversalStats()
+        {
+            nodes.Add(nNodes);
+            primitives.Add(nPrimitives);
+        }
+        StatIntDistribution& nodes;
+        StatIntDistribution& primitives;
+        int nNodes = 0;
+        int nPrimitives = 0;
+    };
+
+    //size of a quantization step on each axis of box
+    static inline Vector3f QuantizationStep(const Bounds3f& box)
+    {
+        return (box.pMax - box.pMin) * (1.f / 255);
+    }
+
+    //decode the box of a child of a quantized node whose box is box, the result is never smaller than the encoded box
+    static inline Bounds3f DequantizeBounds(const uint8_t quantized[2][3], const Bounds3f& box, const Vector3f& step)
+    {
+        Bounds3f child;
+        for(int axis = 0; axis < 3; axis++)
+        {
+            child.pMin[axis] = box.pMin[axis] + quantized[0][axis] * step[axis];
+            child.pMax[axis] = box.pMax[axis] - (255 - quantized[1][axis]) * step[axis];
+        }
+        return child;
+    }
+
+    //quantize bounds into box with conservative rounding, the steps are checked against the decoding
+    //so the decoded box always contains bounds, 0 and 255 decode to the box itself
+    static void QuantizeBounds(const Bounds3f& bounds, const Bounds3f& box, const Vector3f& step, uint8_t quantized[2][3])
+    {
+        for(int axis = 0; axis < 3; axis++)
+        {
+            int qMin = 0, qMax = 255;
+            if(step[axis] > 0)
+            {
+                qMin = Clamp((int)std::floor((bounds.pMin[axis] - box.pMin[axis]) / step[axis]), 0, 255);
+                qMax = Clamp(255 - (int)std::floor((box.pMax[axis] - bounds.pMax[axis]) / step[axis]), 0, 255);
+            }
+            while(qMin > 0 && box.pMin[axis] + qMin * step[axis] > bounds.pMin[axis])
+                qMin--;
+            while(qMax < 255 && box.pMax[axis] - (255 - qMax) * step[axis] < bounds.pMax[axis])
+                qMax++;
+            quantized[0][axis] = qMin;
+            quantized[1][axis] = qMax;
+        }
+    }
+
+    //test the ray against all child boxes of a wide node, return the bit mask of hit children
+    //and the entry distance of each child in tNear
+    template<int N>
+    static inline int IntersectChildren(const WideBVHNode<N>& node, const Point3f& origin, const Vector3f& invDir,
+                                        const uint32_t dirIsNeg[3], Float tMax, Float tNear[N])
+    {
+#if defined(PBRT_HAVE_AVX) && !defined(PBRT_FLOAT_AS_DOUBLE)
+        if constexpr (N == 8)
+        {
+            __m256 tMin8 = _mm256_setzero_ps(), tMax8 = _mm256_set1_ps(tMax);
+            for(int axis = 0; axis < 3; axis++)
+            {
+                __m256 o = _mm256_set1_ps(origin[axis]), inv = _mm256_set1_ps(invDir[axis]);
+                __m256 tEnter = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[dirIsNeg[axis]][axis]), o), inv);
+                __m256 tExit = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[1 - dirIsNeg[axis]][axis]), o), inv);
+                tMin8 = _mm256_max_ps(tMin8, tEnter);
+                tMax8 = _mm256_min_ps(tMax8, tExit);
+            }
+            _mm256_storeu_ps(tNear, tMin8);
+            return _mm256_movemask_ps(_mm256_cmp_ps(tMin8, tMax8, _CMP_LE_OQ));
+        }
+#endif
+#if defined(PBRT_HAVE_SSE) && !defined(PBRT_FLOAT_AS_DOUBLE)
+        if constexpr (N == 4)
+        {
+            __m128 tMin4 = _mm_setzero_ps(), tMax4 = _mm_set1_ps(tMax);
+            for(int axis = 0; axis < 3; axis++)
+            {
+                __m128 o = _mm_set1_ps(origin[axis]), inv = _mm_set1_ps(invDir[axis]);
+                __m128 tEnter = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[dirIsNeg[axis]][axis]), o), inv);
+                __m128 tExit = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1 - dirIsNeg[axis]][axis]), o), inv);
+                tMin4 = _mm_max_ps(tMin4, tEnter);
+                tMax4 = _mm_min_ps(tMax4, tExit);
+            }
+            _mm_storeu_ps(tNear, tMin4);
+            return _mm_movemask_ps(_mm_cmple_ps(tMin4, tMax4));
+        }
+#endif
+        //portable fallback, the loop over children is left to the auto-vectorizer
+        int mask = 0;
+        for(int i = 0; i < N; i++)
+        {
+            Float t0 = 0, t1 = tMax;
+            for(int axis = 0; axis < 3; axis++)
+            {
+                t0 = std::max(t0, (node.bounds[dirIsNeg[axis]][axis][i] - origin[axis]) * invDir[axis]);
+                t1 = std::min(t1, (node.bounds[1 - dirIsNeg[axis]][axis][i] - origin[axis]) * invDir[axis]);
+            }
+            tNear[i] = t0;
+            mask |= (t0 <= t1) << i;
+        }
+        return mask;
+    }
+
+
+    //rays of a packet as structure of arrays, padded to MaxRayPacketSize for SIMD loads
+    struct alignas(64) RayPacketSoA
+    {
+        Float origin[3][MaxRayPacketSize] = {};
+        Float invDir[3][MaxRayPacketSize] = {};
+        Float tMax[MaxRayPacketSize] = {};
+    };
+
+    //test the rays of a packet in activeMask against the box, return the bit mask of hit rays
+    static inline int IntersectPacketBounds(const Bounds3f& bounds, const RayPacketSoA& packet, int nRays, int activeMask)
+    {
+        int mask = 0;
+        int i = 0;
+#if defined(PBRT_HAVE_AVX) && !defined(PBRT_FLOAT_AS_DOUBLE)
+        for(; i + 8 <= nRays; i += 8)
+        {
+            __m256 t0 = _mm256_setzero_ps(), t1 = _mm256_load_ps(&packet.tMax[i]);
+            for(int axis = 0; axis < 3; axis++)
+            {
+                __m256 o = _mm256_load_ps(&packet.origin[axis][i]), inv = _mm256_load_ps(&packet.invDir[axis][i]);
+                __m256 tMin = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bounds.pMin[axis]), o), inv);
+                __m256 tMax = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bounds.pMax[axis]), o), inv);
+                t0 = _mm256_max_ps(t0, _mm256_min_ps(tMin, tMax));
+                t1 = _mm256_min_ps(t1, _mm256_max_ps(tMin, tMax));
+            }
+            mask |= _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) << i;
+        }
+#endif
+#if defined(PBRT_HAVE_SSE) && !defined(PBRT_FLOAT_AS_DOUBLE)
+        for(; i + 4 <= nRays; i += 4)
+        {
+            __m128 t0 = _mm_setzero_ps(), t1 = _mm_load_ps(&packet.tMax[i]);
+            for(int axis = 0; axis < 3; axis++)
+            {
+                __m128 o = _mm_load_ps(&packet.origin[axis][i]), inv = _mm_load_ps(&packet.invDir[axis][i]);
+                __m128 tMin = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds.pMin[axis]), o), inv);
+                __m128 tMax = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds.pMax[axis]), o), inv);
+                t0 = _mm_max_ps(t0, _mm_min_ps(tMin, tMax));
+                t1 = _mm_min_ps(t1, _mm_max_ps(tMin, tMax));
+            }
+            mask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << i;
+        }
+#endif
+        for(; i < nRays; i++)
+        {
+            Float t0 = 0, t1 = packet.tMax[i];
+            for(int axis = 0; axis < 3; axis++)
+            {
+                Float tMin = (bounds.pMin[axis] - packet.origin[axis][i]) * packet.invDir[axis][i];
+                Float tMax = (bounds.pMax[axis] - packet.origin[axis][i]) * packet.invDir[axis][i];
+                t0 = std::max(t0, std::min(tMin, tMax));
+                t1 = std::min(t1, std::max(tMin, tMax));
+            }
+            mask |= (t0 <= t1) << i;
+        }
+        return mask & activeMask;
+    }
+
+    static void InitRayPacket(RayPacketSoA* packet, const Ray* const rays[], int nRays)
+    {
+        for(int i = 0; i < nRays; i++)
+        {
+            for(int axis = 0; axis < 3; axis++)
+            {
+                packet->origin[axis][i] = rays[i]->o[axis];
+                packet->invDir[axis][i] = 1 / rays[i]->d[axis];
+            }
+            packet->tMax[i] = rays[i]->tMax;
+        }
+    }
+
+    //count of buckets for SAH partition is clamped to [2, MaxSAHBuckets]
+    constexpr int MaxSAHBuckets = 64;
+    //nodes with more primitives than this are binned and partitioned in parallel,
+    //and the subtrees below them are built as parallel tasks
+    constexpr int ParallelBuildThreshold = 16384;
+    //count of primitives processed by a single chunk of a parallel loop
+    constexpr int ParallelChunkSize = 4096;
+
+    //the primitives whose centroids lie in a bucket of the split axis
+    struct BucketInfo
+    {
+        int count = 0;
+        Bounds3f bounds;
+    };
+
+    //a subtree that is built by a parallel task and linked to an upper level node
+    struct BVHBuildTask
+    {
+        BVHBuildNode** node;
+        int start, end;
+    };
+
+    static int BucketIndex(const Point3f& centroid, const Bounds3f& centroidBounds, int dim, int nBuckets)
+    {
+        int b = nBuckets * centroidBounds.Offset(centroid)[dim];
+        return std::min(b, nBuckets - 1);
+    }
+
+    //sweep the buckets from both sides to compute the SAH cost of splitting after each bucket,
+    //return the bucket to split after with minimal cost
+    static int FindSAHSplit(const BucketInfo* buckets, int nBuckets, const Bounds3f& bounds, Float* minCost)
+    {
+        Float cost[MaxSAHBuckets - 1];
+        Bounds3f boundsBelow, boundsAbove;
+        int countBelow = 0, countAbove = 0;
+        for(int i = 0; i < nBuckets - 1; i++)
+        {
+            boundsBelow = Union(boundsBelow, buckets[i].bounds);
+            countBelow += buckets[i].count;
+            cost[i] = countBelow > 0 ? countBelow * boundsBelow.SurfaceArea() : 0;
+        }
+        for(int i = nBuckets - 1; i > 0; i--)
+        {
+            boundsAbove = Union(boundsAbove, buckets[i].bounds);
+            countAbove += buckets[i].count;
+            cost[i - 1] += countAbove > 0 ? countAbove * boundsAbove.SurfaceArea() : 0;
+        }
+        int minCostSplitBucket = 0;
+        for(int i = 1; i < nBuckets - 1; i++)
+        {
+            if(cost[i] < cost[minCostSplitBucket])
+                minCostSplitBucket = i;
+        }
+        //the cost of traversal is 1/8 of the cost of the intersection of a primitive
+        *minCost = 0.125f + cost[minCostSplitBucket] / bounds.SurfaceArea();
+        return minCostSplitBucket;
+    }
+
+    //subtrees below this depth are refitted as parallel tasks, 64 subtrees for binary nodes
+    constexpr int RefitTaskDepth = 6;
+    constexpr int WideRefitTaskDepth = 2;
+
+    //edited trees deeper than the traversal stacks are rebuilt
+    constexpr int MaxEditDepth = 64;
+
+    //deepest interior node the traversal stacks of every node format can hold, the root has depth 0
+    constexpr int MaxTraversalDepth = 62;
+
+    //primitives are spilled to 2^OutOfCoreBucketBits files by the next bits of their Morton codes
+    constexpr int OutOfCoreBucketBits = 9;
+    //spilled primitives are buffered and read in chunks of this count
+    constexpr int OutOfCoreChunkSize = 4096;
+
+    //the bounds of a primitive in a spill file
+    struct SpilledPrimitive
+    {
+        uint32_t primitiveIndex;
+        Bounds3f bounds;
+    };
+
+    //a spill file of the out of core build and the primitives in it
+    struct SpillBucket
+    {
+        std::string filename;
+        int nPrimitives = 0;
+        Bounds3f bounds;
+        //count of the leading Morton bits shared by its primitives
+        int mortonBits = 0;
+    };
+
+    //bump when the layout of the cache file or of any node format changes
+    constexpr uint32_t BVHCacheVersion = 1;
+
+    //header of a BVH cache file, followed by the original index of every primitive reference and the node array,
+    //both starting at multiples of BVHCacheAlignment so the nodes can be used in place from the mapping
+    struct BVHCacheHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t floatSize;
+        uint64_t key;
+        uint64_t nPrimitives;
+        uint64_t nReferences;
+        uint64_t nNodes;
+        //0: LinearBVHNode, 1: QuantizedBVHNode, 4 or 8: WideBVHNode<4 or 8>
+        uint32_t nodeFormat;
+        uint32_t nodeSize;
+        Float bounds[2][3];
+        Float builtSAHCost;
+    };
+
+    constexpr size_t BVHCacheAlignment = 64;
+    static const char BVHCacheMagic[8] = { 'P', 'B', 'R', 'T', 'B', 'V', 'H', '\0' };
+
+    static size_t AlignCacheOffset(size_t offset)
+    {
+        return (offset + BVHCacheAlignment - 1) & ~(BVHCacheAlignment - 1);
+    }
+
+    //check every child and primitive offset of the nodes of a cache file, so a corrupt or stale file is never
+    //traversed out of bounds, children always follow their parents so one pass in order knows the depth of every node
+    static bool ValidCacheNodes(const void* data, uint32_t nodeFormat, uint64_t nNodes, uint64_t nReferences)
+    {
+        std::vector<uint8_t> depth(nNodes, 0);
+        auto validChild = [&](uint64_t parent, int64_t child)
+        {
+            if(child <= (int64_t)parent || (uint64_t)child >= nNodes)
+                return false;
+            depth[child] = std::max<int>(depth[child], depth[parent] + 1);
+            return depth[child] <= MaxTraversalDepth;
+        };
+        auto validLeaf = [&](int64_t offset, int nPrimitives)
+        {
+            return offset >= 0 && (uint64_t)offset + nPrimitives <= nReferences;
+        };
+        auto validWide = [&](const auto* wide, auto nChildren)
+        {
+            constexpr int N = decltype(nChildren)::value;
+            for(uint64_t i = 0; i < nNodes; i++)
+            {
+                const WideBVHNode<N>& node = wide[i];
+                for(int c = 0; c < N; c++)
+                {
+                    //empty slots are never hit because their bounds are inverted
+                    if(node.offset[c] < 0)
+                    {
+                        for(int axis = 0; axis < 3; axis++)
+                        {
+                            if(node.nPrimitives[c] != 0 || !(node.bounds[0][axis][c] > node.bounds[1][axis][c]))
+                                return false;
+                        }
+                    }
+                    else if(node.nPrimitives[c] > 0 ? !validLeaf(node.offset[c], node.nPrimitives[c]) :
+                            !validChild(i, node.offset[c]))
+                        return false;
+                }
+            }
+            return true;
+        };
+        if(nodeFormat == 4)
+            return validWide(static_cast<const WideBVHNode<4>*>(data), std::integral_constant<int, 4>());
+        if(nodeFormat == 8)
+            return validWide(static_cast<const WideBVHNode<8>*>(data), std::integral_constant<int, 8>());
+        if(nodeFormat == 1)
+        {
+            const QuantizedBVHNode* quantized = static_cast<const QuantizedBVHNode*>(data);
+            for(uint64_t i = 0; i < nNodes; i++)
+            {
+                const QuantizedBVHNode& node = quantized[i];
+                if(node.axis > 2)
+                    return false;
+                for(int c = 0; c < 2; c++)
+                {
+                    if(node.nPrimitives[c] > 0 ? !validLeaf(node.offset[c], node.nPrimitives[c]) : !validChild(i, node.offset[c]))
+                        return false;
+                }
+            }
+            return true;
+        }
+        const LinearBVHNode* nodes = static_cast<const LinearBVHNode*>(data);
+        for(uint64_t i = 0; i < nNodes; i++)
+        {
+            const LinearBVHNode& node = nodes[i];
+            if(node.nPrimitives > 0 ? !validLeaf(node.primitivesOffset, node.nPrimitives) :
+               node.axis > 2 || !validChild(i, i + 1) || !validChild(i, node.secondChildOffset))
+                return false;
+        }
+        return true;
+    }
+
+    //rename the written file over the cache file in one step, so other renders always find either file complete,
+    //std::rename fails on Windows if the target exists, std::filesystem::rename replaces it there as well
+    static bool ReplaceCacheFile(const std::string& temporaryFilename, const std::string& filename)
+    {
+        std::error_code error;
+        std::filesystem::rename(temporaryFilename, filename, error);
+        return !error;
+    }
+
+    //a token for the names of temporary and spill files, so builds of several processes sharing a cache directory
+    //never write to the same files
+    static std::string UniqueFileToken()
+    {
+        static std::atomic<uint32_t> counter{0};
+        std::random_device random;
+        uint64_t token = ((uint64_t)random() << 32 | random()) ^ counter++;
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx", (unsigned long long)token);
+        return name;
+    }
+
+    //FNV-1a
+    static uint64_t HashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull)
+    {
+        const uint8_t* bytes = (const uint8_t*)data;
+        for(size_t i = 0; i < size; i++)
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        return hash;
+    }
+
+    //hash of the bounds of the primitives in order
+    static uint64_t HashPrimitiveBounds(const std::vector<std::shared_ptr<Primitive>>& primitives, uint64_t hash)
+    {
+        int nPrimitives = primitives.size();
+        int nChunks = (nPrimitives + ParallelChunkSize - 1) / ParallelChunkSize;
+        std::vector<uint64_t> chunkHashes(nChunks);
+        ParallelFor([&](int chunk)
+        {
+            int chunkStart = chunk * ParallelChunkSize;
+            int chunkEnd = std::min(chunkStart + ParallelChunkSize, nPrimitives);
+            uint64_t chunkHash = HashBytes(&chunk, sizeof(chunk));
+            for(int i = chunkStart; i < chunkEnd; i++)
+            {
+                Bounds3f primitiveBounds = primitives[i]->WorldBound();
+                chunkHash = HashBytes(&primitiveBounds, sizeof(primitiveBounds), chunkHash);
+            }
+            chunkHashes[chunk] = chunkHash;
+        }, nChunks);
+        //combine the chunks in order so the hash doesn't depend on the scheduling
+        return HashBytes(chunkHashes.data(), chunkHashes.size() * sizeof(uint64_t), hash);
+    }
+
+    //hash of the vertices of the triangle primitives in order, SpatialSplit builds clip triangles as polygons,
+    //so their trees depend on more than the bounds, the other shapes are clipped by their bounds
+    static uint64_t HashTriangleVertices(const std::vector<std::shared_ptr<Primitive>>& primitives, uint64_t hash)
+    {
+        int nPrimitives = primitives.size();
+        int nChunks = (nPrimitives + ParallelChunkSize - 1) / ParallelChunkSize;
+        std::vector<uint64_t> chunkHashes(nChunks);
+        ParallelFor([&](int chunk)
+        {
+            int chunkStart = chunk * ParallelChunkSize;
+            int chunkEnd = std::min(chunkStart + ParallelChunkSize, nPrimitives);
+            uint64_t chunkHash = HashBytes(&chunk, sizeof(chunk));
+            for(int i = chunkStart; i < chunkEnd; i++)
+            {
+                const Triangle* triangle = dynamic_cast<const Triangle*>(primitives[i]->GetShape());
+                if(!triangle)
+                    continue;
+                TriangleVertices vertices = triangle->GetVertices();
+                chunkHash = HashBytes(&i, sizeof(i), chunkHash);
+                chunkHash = HashBytes(&vertices, sizeof(vertices), chunkHash);
+            }
+            chunkHashes[chunk] = chunkHash;
+        }, nChunks);
+        return HashBytes(chunkHashes.data(), chunkHashes.size() * sizeof(uint64_t), hash);
+    }
+
+    //spatial splits are not tried below this depth, so the duplication of references stays bounded
+    constexpr int MaxSpatialSplitDepth = 48;
+
+    //the best split of a node found by SBVH build, dim is -1 if there is none
+    struct SBVHSplit
+    {
+        int dim = -1;
+        Float cost = std::numeric_limits<Float>::infinity();
+        //the bucket to split after for object splits, the position of the plane for spatial splits
+        int bucket = 0;
+        Float position = 0;
+        Bounds3f leftBounds, rightBounds;
+        int leftCount = 0, rightCount = 0;
+    };
+
+    //the references that enter, exit or cross a bin of a spatial split
+    struct SpatialBin
+    {
+        Bounds3f bounds;
+        int entries = 0;
+        int exits = 0;
+    };
+
+    static bool IsEmpty(const Bounds3f& bounds)
+    {
+        return bounds.pMin.x > bounds.pMax.x || bounds.pMin.y > bounds.pMax.y || bounds.pMin.z > bounds.pMax.z;
+    }
+
+    static Float OverlapSurfaceArea(const Bounds3f& b1, const Bounds3f& b2)
+    {
+        Bounds3f overlap;
+        for(int i = 0; i < 3; i++)
+        {
+            overlap.pMin[i] = std::max(b1.pMin[i], b2.pMin[i]);
+            overlap.pMax[i] = std::min(b1.pMax[i], b2.pMax[i]);
+        }
+        return IsEmpty(overlap) ? 0 : overlap.SurfaceArea();
+    }
+
+    //find the binned SAH object split of references over all three axes
+    static SBVHSplit FindObjectSplit(const std::vector<BVHPrimitiveInfo>& references, const Bounds3f& bounds,
+                                     const Bounds3f& centroidBounds, int nBuckets)
+    {
+        SBVHSplit best;
+        for(int dim = 0; dim < 3; dim++)
+        {
+            if(centroidBounds.pMax[dim] == centroidBounds.pMin[dim])
+                continue;
+            BucketInfo buckets[MaxSAHBuckets];
+            for(const BVHPrimitiveInfo& reference : references)
+            {
+                int b = BucketIndex(reference.centroid, centroidBounds, dim, nBuckets);
+                buckets[b].count++;
+                buckets[b].bounds = Union(buckets[b].bounds, reference.bounds);
+            }
+            Float cost;
+            int bucket = FindSAHSplit(buckets, nBuckets, bounds, &cost);
+            if(cost >= best.cost)
+                continue;
+            best = SBVHSplit();
+            best.dim = dim;
+            best.cost = cost;
+            best.bucket = bucket;
+            for(int b = 0; b < nBuckets; b++)
+            {
+                if(b <= bucket)
+                {
+                    best.leftBounds = Union(best.leftBounds, buckets[b].bounds);
+                    best.leftCount += buckets[b].count;
+                }
+                else
+                {
+                    best.rightBounds = Union(best.rightBounds, buckets[b].bounds);
+                    best.rightCount += buckets[b].count;
+                }
+            }
+        }
+        return best;
+    }
+
+    //find the spatial split of references with planes at the boundaries of nBuckets bins over bounds,
+    //references crossing several bins are clipped to each of them
+    static SBVHSplit FindSpatialSplit(const std::vector<BVHPrimitiveInfo>& references, const Bounds3f& bounds, int nBuckets,
+                                      const std::vector<std::shared_ptr<Primitive>>& primitives)
+    {
+        SBVHSplit best;
+        int nReferences = references.size();
+        for(int dim = 0; dim < 3; dim++)
+        {
+            Float extent = bounds.pMax[dim] - bounds.pMin[dim];
+            if(extent <= 0)
+                continue;
+            Float binWidth = extent / nBuckets;
+            auto binIndex = [&](Float p)
+            {
+                return Clamp((int)((p - bounds.pMin[dim]) / binWidth), 0, nBuckets - 1);
+            };
+            SpatialBin bins[MaxSAHBuckets];
+            for(const BVHPrimitiveInfo& reference : references)
+            {
+                int firstBin = binIndex(reference.bounds.pMin[dim]);
+                int lastBin = std::max(firstBin, binIndex(reference.bounds.pMax[dim]));
+                bins[firstBin].entries++;
+                bins[lastBin].exits++;
+                if(firstBin == lastBin)
+                {
+                    bins[firstBin].bounds = Union(bins[firstBin].bounds, reference.bounds);
+                    continue;
+                }
+                for(int b = firstBin; b <= lastBin; b++)
+                {
+                    Bounds3f slab = reference.bounds;
+                    slab.pMin[dim] = std::max(slab.pMin[dim], bounds.pMin[dim] + b * binWidth);
+                    slab.pMax[dim] = std::min(slab.pMax[dim], b == nBuckets - 1 ? bounds.pMax[dim] : bounds.pMin[dim] + (b + 1) * binWidth);
+                    bins[b].bounds = Union(bins[b].bounds, primitives[reference.primitiveIndex]->ClippedWorldBound(slab));
+                }
+            }
+            //sweep the bins from both sides like FindSAHSplit, left counts entries and right counts exits
+            Float cost[MaxSAHBuckets - 1];
+            Bounds3f boundsBelow[MaxSAHBuckets - 1];
+            int countBelow[MaxSAHBuckets - 1];
+            Bounds3f below;
+            int count = 0;
+            for(int i = 0; i < nBuckets - 1; i++)
+            {
+                below = Union(below, bins[i].bounds);
+                count += bins[i].entries;
+                boundsBelow[i] = below;
+                countBelow[i] = count;
+            }
+            Bounds3f above;
+            count = 0;
+            for(int i = nBuckets - 1; i > 0; i--)
+            {
+                above = Union(above, bins[i].bounds);
+                count += bins[i].exits;
+                int countAbove = count;
+                //a split that keeps every reference on one side makes no progress
+                if(countBelow[i - 1] == 0 || countAbove == 0 || countBelow[i - 1] == nReferences || countAbove == nReferences)
+                {
+                    cost[i - 1] = std::numeric_limits<Float>::infinity();
+                    continue;
+                }
+                cost[i - 1] = 0.125f + (countBelow[i - 1] * boundsBelow[i - 1].SurfaceArea() +
+                                        countAbove * above.SurfaceArea()) / bounds.SurfaceArea();
+                if(cost[i - 1] < best.cost)
+                {
+                    best.dim = dim;
+                    best.cost = cost[i - 1];
+                    best.bucket = i - 1;
+                    best.position = bounds.pMin[dim] + i * binWidth;
+                    best.leftBounds = boundsBelow[i - 1];
+                    best.rightBounds = above;
+                    best.leftCount = countBelow[i - 1];
+                    best.rightCount = countAbove;
+                }
+            }
+        }
+        return best;
+    }
+
+    //count of subtrees a treelet grows to, its optimal topology is searched over all their subsets
+    constexpr int TreeletSize = 7;
+    //the subtrees at this depth are restructured as parallel tasks
+    constexpr int TreeletTaskDepth = 6;
+
+    //index of the lowest set bit of a subset of treelet leaves
+    static inline int LowestLeaf(int subset)
+    {
+        int leaf = 0;
+        while(!(subset & (1 << leaf)))
+            leaf++;
+        return leaf;
+    }
+
+    //link the interior nodes of the treelet for subset by the partitions found, return the root of subset
+    static BVHBuildNode* EmitTreelet(int subset, BVHBuildNode* const leaves[], BVHBuildNode* const interior[], int* nInterior,
+                                     const int partition[], const Bounds3f subsetBounds[])
+    {
+        if((subset & (subset - 1)) == 0)
+            return leaves[LowestLeaf(subset)];
+        BVHBuildNode* node = interior[(*nInterior)++];
+        BVHBuildNode* left = EmitTreelet(partition[subset], leaves, interior, nInterior, partition, subsetBounds);
+        BVHBuildNode* right = EmitTreelet(subset ^ partition[subset], leaves, interior, nInterior, partition, subsetBounds);
+        //split along the axis that separates the children most, with the lower child first for traversal order
+        Vector3f delta = (0.5f * right->bounds.pMin + 0.5f * right->bounds.pMax) - (0.5f * left->bounds.pMin + 0.5f * left->bounds.pMax);
+        int axis = MaxDimension(Abs(delta));
+        if(delta[axis] < 0)
+            std::swap(left, right);
+        node->left = left;
+        node->right = right;
+        node->splitAxis = axis;
+        node->bounds = subsetBounds[subset];
+        node->height = 1 + std::max(left->height, right->height);
+        return node;
+    }
+
+    //reorganize the treelet rooted at root into the topology with the least SAH cost
+    //the costs of the subtrees hanging below the treelet don't depend on its topology,
+    //so only the total surface area of its interior nodes has to be minimized,
+    //root is at depth and the heights of the nodes below it are up to date
+    static void RestructureTreelet(BVHBuildNode* root, int depth)
+    {
+        root->height = 1 + std::max(root->left->height, root->right->height);
+        //grow the treelet by expanding the interior leaf with the largest surface area
+        BVHBuildNode* leaves[TreeletSize];
+        BVHBuildNode* interior[TreeletSize - 1];
+        int nLeaves = 2, nInterior = 1;
+        interior[0] = root;
+        leaves[0] = root->left;
+        leaves[1] = root->right;
+        Float treeletArea = root->bounds.SurfaceArea();
+        while(nLeaves < TreeletSize)
+        {
+            int expand = -1;
+            Float maxArea = -1;
+            for(int i = 0; i < nLeaves; i++)
+            {
+                if(leaves[i]->nPrimitives == 0 && leaves[i]->bounds.SurfaceArea() > maxArea)
+                {
+                    expand = i;
+                    maxArea = leaves[i]->bounds.SurfaceArea();
+                }
+            }
+            if(expand == -1)
+                break;
+            BVHBuildNode* node = leaves[expand];
+            interior[nInterior++] = node;
+            treeletArea += maxArea;
+            leaves[expand] = node->left;
+            leaves[nLeaves++] = node->right;
+        }
+        //two or three leaves have only one topology up to the order of children
+        if(nLeaves < 4)
             return;
-        //build BVH from primitives
-        //initialize primitiveInfo array for primitives
-        std::vector<BVHPrimitiveInfo> primitiveInfo(primitives.size());
-        for (size_t i = 0; i < primitives.size(); i++)
-            primitiveInfo[i] = { i, primitives[i]->WorldBound()};
-        //build BVH tree for primitives using primitiveInfo
-        MemoryArena arena(1024 * 1024);
-        int totalNodes = 0;
-        std::vector<std::shared_ptr<Primitive>> orderedPrimitives;
-        BVHBuildNode* root;
-        if(splitMethod == SplitMethod::HLBVH)
-            root = HLBVHBuild(arena, primitiveInfo, 0, primitives.size(), &totalNodes, orderedPrimitives);
-        else
-            root = recursiveBuild(arena, primitiveInfo, 0, primitives.size(), &totalNodes, orderedPrimitives);
-        primitives.swap(orderedPrimitives);
-        //compute representation of depth-first traversal of BVH tree
+        //find the optimal partition of every subset, the subsets of a subset always come before it
+        int nSubsets = 1 << nLeaves;
+        Bounds3f subsetBounds[1 << TreeletSize];
+        Float cost[1 << TreeletSize];
+        int partition[1 << TreeletSize];
+        int height[1 << TreeletSize];
+        for(int subset = 1; subset < nSubsets; subset++)
+        {
+            int leaf = LowestLeaf(subset);
+            int rest = subset & (subset - 1);
+            if(rest == 0)
+            {
+                subsetBounds[subset] = leaves[leaf]->bounds;
+                cost[subset] = 0;
+                height[subset] = leaves[leaf]->height;
+                continue;
+            }
+            subsetBounds[subset] = Union(subsetBounds[rest], leaves[leaf]->bounds);
+            //every partition is visited once, with the lowest leaf of subset on the left side
+            Float bestCost = std::numeric_limits<Float>::infinity();
+            int lowest = 1 << leaf;
+            for(int left = (subset - 1) & subset; left > 0; left = (left - 1) & subset)
+            {
+                if(!(left & lowest))
+                    continue;
+                Float partitionCost = cost[left] + cost[subset ^ left];
+                if(partitionCost < bestCost)
+                {
+                    bestCost = partitionCost;
+                    partition[subset] = left;
+                }
+            }
+            cost[subset] = subsetBounds[subset].SurfaceArea() + bestCost;
+            height[subset] = 1 + std::max(height[partition[subset]], height[subset ^ partition[subset]]);
+        }
+        if(cost[nSubsets - 1] >= treeletArea)
+            return;
+        //repeated passes can keep deepening the tree, a topology is only taken if the traversal stacks can hold it
+        //or it is no deeper than the current one
+        int maxHeight = MaxTraversalDepth + 1 - depth;
+        if(height[nSubsets - 1] > maxHeight && height[nSubsets - 1] > root->height)
+            return;
+        //reuse the interior nodes with the root first, so that its parent still points to it
+        nInterior = 0;
+        EmitTreelet(nSubsets - 1, leaves, interior, &nInterior, partition, subsetBounds);
+    }
+
+    //restructure the treelets rooted at the interior nodes of the subtree bottom-up,
+    //nodes at stopDepth were restructured by a task
+    static void RestructureSubtree(BVHBuildNode* node, int depth, int stopDepth)
+    {
+        if(node->nPrimitives > 0)
+        {
+            node->height = 0;
+            return;
+        }
+        if(depth == stopDepth)
+            return;
+        RestructureSubtree(node->left, depth + 1, stopDepth);
+        RestructureSubtree(node->right, depth + 1, stopDepth);
+        RestructureTreelet(node, depth);
+    }
+
+    static void CollectTreeletTasks(BVHBuildNode* node, int depth, std::vector<BVHBuildNode*>& tasks)
+    {
+        if(node->nPrimitives > 0)
+            return;
+        if(depth == TreeletTaskDepth)
+        {
+            tasks.push_back(node);
+            return;
+        }
+        CollectTreeletTasks(node->left, depth + 1, tasks);
+        CollectTreeletTasks(node->right, depth + 1, tasks);
+    }
+
+    //compute the bounds of primitives and of their centroids in primitiveInfo[start, end)
+    static void ComputeBounds(const std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+                              Bounds3f* bounds, Bounds3f* centroidBounds, bool parallel)
+    {
+        if(!parallel)
+        {
+            for(int i = start; i < end; i++)
+            {
+                *bounds = Union(*bounds, primitiveInfo[i].bounds);
+                *centroidBounds = Union(*centroidBounds, primitiveInfo[i].centroid);
+            }
+            return;
+        }
+        int nChunks = (end - start + ParallelChunkSize - 1) / ParallelChunkSize;
+        std::vector<Bounds3f> chunkBounds(nChunks), chunkCentroidBounds(nChunks);
+        ParallelFor([&](int chunk)
+        {
+            int chunkStart = start + chunk * ParallelChunkSize;
+            int chunkEnd = std::min(chunkStart + ParallelChunkSize, end);
+            for(int i = chunkStart; i < chunkEnd; i++)
+            {
+                chunkBounds[chunk] = Union(chunkBounds[chunk], primitiveInfo[i].bounds);
+                chunkCentroidBounds[chunk] = Union(chunkCentroidBounds[chunk], primitiveInfo[i].centroid);
+            }
+        }, nChunks);
+        for(int chunk = 0; chunk < nChunks; chunk++)
+        {
+            *bounds = Union(*bounds, chunkBounds[chunk]);
+            *centroidBounds = Union(*centroidBounds, chunkCentroidBounds[chunk]);
+        }
+    }
+
+    //stable partition of primitiveInfo[start, end) with chunks counted and scattered in parallel,
+    //return the position of the first element for which predicate is false
+    template<typename Predicate>
+    static int ParallelPartition(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, const Predicate& predicate)
+    {
+        int nChunks = (end - start + ParallelChunkSize - 1) / ParallelChunkSize;
+        //count the elements of each chunk that go to the lower side
+        std::vector<int> belowCount(nChunks, 0);
+        ParallelFor([&](int chunk)
+        {
+            int chunkStart = start + chunk * ParallelChunkSize;
+            int chunkEnd = std::min(chunkStart + ParallelChunkSize, end);
+            for(int i = chunkStart; i < chunkEnd; i++)
+            {
+                if(predicate(primitiveInfo[i]))
+                    belowCount[chunk]++;
+            }
+        }, nChunks);
+        //exclusive prefix sum gives the destination of every chunk on both sides
+        std::vector<int> belowOffset(nChunks), aboveOffset(nChunks);
+        int totalBelow = 0;
+        for(int chunk = 0; chunk < nChunks; chunk++)
+        {
+            belowOffset[chunk] = totalBelow;
+            totalBelow += belowCount[chunk];
+        }
+        int totalAbove = totalBelow;
+        for(int chunk = 0; chunk < nChunks; chunk++)
+        {
+            aboveOffset[chunk] = totalAbove;
+            int chunkSize = std::min(ParallelChunkSize, end - start - chunk * ParallelChunkSize);
+            totalAbove += chunkSize - belowCount[chunk];
+        }
+        //scatter into a temporary array and copy back
+        std::vector<BVHPrimitiveInfo> partitioned(end - start);
+        ParallelFor([&](int chunk)
+        {
+            int chunkStart = start + chunk * ParallelChunkSize;
+            int chunkEnd = std::min(chunkStart + ParallelChunkSize, end);
+            int below = belowOffset[chunk], above = aboveOffset[chunk];
+            for(int i = chunkStart; i < chunkEnd; i++)
+            {
+                if(predicate(primitiveInfo[i]))
+                    partitioned[below++] = primitiveInfo[i];
+                else
+                    partitioned[above++] = primitiveInfo[i];
+            }
+        }, nChunks);
+        ParallelFor([&](int chunk)
+        {
+            int chunkStart = chunk * ParallelChunkSize;
+            int chunkEnd = std::min(chunkStart + ParallelChunkSize, end - start);
+            std::copy(partitioned.begin() + chunkStart, partitioned.begin() + chunkEnd, primitiveInfo.begin() + start + chunkStart);
+        }, nChunks);
+        return start + totalBelow;
+    }
+
+
+    //primitive index with its Morton code of the centroid
+    struct MortonPrimitive
+    {
+        int primitiveIndex;
+        uint32_t mortonCode;
+    };
+
+    //a cluster of primitives whose Morton codes share the same high bits
+    struct LBVHTreelet
+    {
+        int startIndex, nPrimitives;
+        BVHBuildNode* buildNodes;
+    };
+
+    //spread the lowest 10 bits of value to every third bit
+    inline uint32_t LeftShift3(uint32_t x)
+    {
+        Assert(x <= (1 << 10));
+        if(x == (1 << 10))
+            x--;
+        x = (x | (x << 16)) & 0b00000011000000000000000011111111;
+        x = (x | (x <<  8)) & 0b00000011000000001111000000001111;
+        x = (x | (x <<  4)) & 0b00000011000011000011000011000011;
+        x = (x | (x <<  2)) & 0b00001001001001001001001001001001;
+        return x;
+    }
+
+    //interleave the bits of three 10-bit coordinates to a 30-bit Morton code
+    inline uint32_t EncodeMorton3(const Vector3f& v)
+    {
+        Assert(v.x >= 0 && v.y >= 0 && v.z >= 0);
+        return (LeftShift3(v.z) << 2) | (LeftShift3(v.y) << 1) | LeftShift3(v.x);
+    }
+
+    //least significant digit radix sort on Morton codes, each pass counts the digits of every chunk
+    //in parallel and scatters the chunks to their stable destinations in parallel
+    static void RadixSort(std::vector<MortonPrimitive>* v)
+    {
+        std::vector<MortonPrimitive> tempVector(v->size());
+        constexpr int bitsPerPass = 6;
+        constexpr int nBits = 30;
+        static_assert((nBits % bitsPerPass) == 0, "Radix sort bitsPerPass must evenly divide nBits");
+        constexpr int nPasses = nBits / bitsPerPass;
+        constexpr int nBuckets = 1 << bitsPerPass;
+        constexpr int bitMask = (1 << bitsPerPass) - 1;
+        int size = v->size();
+        int nChunks = (size + ParallelChunkSize - 1) / ParallelChunkSize;
+        std::vector<int> chunkOffsets(nChunks * nBuckets);
+        for(int pass = 0; pass < nPasses; pass++)
+        {
+            //perform one pass of radix sort, sorting bitsPerPass bits
+            int lowBit = pass * bitsPerPass;
+            //set in and out vector pointers for radix sort pass
+            std::vector<MortonPrimitive>& in = (pass & 1) ? tempVector : *v;
+            std::vector<MortonPrimitive>& out = (pass & 1) ? *v : tempVector;
+            //count number of zero bits in array for current radix sort bit
+            ParallelFor([&](int chunk)
+            {
+                int* counts = &chunkOffsets[chunk * nBuckets];
+                std::fill(counts, counts + nBuckets, 0);
+                int chunkEnd = std::min((chunk + 1) * ParallelChunkSize, size);
+                for(int i = chunk * ParallelChunkSize; i < chunkEnd; i++)
+                    counts[(in[i].mortonCode >> lowBit) & bitMask]++;
+            }, nChunks);
+            //compute starting index in output array for each bucket of each chunk
+            int offset = 0;
+            for(int bucket = 0; bucket < nBuckets; bucket++)
+            {
+                for(int chunk = 0; chunk < nChunks; chunk++)
+                {
+                    int count = chunkOffsets[chunk * nBuckets + bucket];
+                    chunkOffsets[chunk * nBuckets + bucket] = offset;
+                    offset += count;
+                }
+            }
+            //store sorted values in output array
+            ParallelFor([&](int chunk)
+            {
+                int* offsets = &chunkOffsets[chunk * nBuckets];
+                int chunkEnd = std::min((chunk + 1) * ParallelChunkSize, size);
+                for(int i = chunk * ParallelChunkSize; i < chunkEnd; i++)
+                    out[offsets[(in[i].mortonCode >> lowBit) & bitMask]++] = in[i];
+            }, nChunks);
+        }
+        //copy final result from tempVector, if needed
+        if(nPasses & 1)
+            std::swap(*v, tempVector);
+    }
+
+    //motion segments are only used if the motion interval isn't empty
+    static int MotionSegmentCount(int motionSegments, Float motionStartTime, Float motionEndTime)
+    {
+        return motionEndTime > motionStartTime ? std::max(1, motionSegments) : 1;
+    }
+
+    //motion segments are only stored for binary full precision nodes, so they override width and compressNodes
+    static int MotionNodeWidth(int width, bool compressNodes, int motionSegments)
+    {
+        if(motionSegments > 1 && (width != 2 || compressNodes))
+        {
+            Warn("BVH motion segments need binary full precision nodes. Using width 2 without compression.");
+            return 2;
+        }
+        return width;
+    }
+
+    BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>>& primitives)
+    : BVHAccel(primitives, Options())
+    {
+    }
+
+    BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>>& primitives, const Options& options)
+    : maxPrimsInNode(std::min(255, options.maxPrimsInNode)), splitMethod(options.splitMethod),
+      nBuckets(Clamp(options.nBuckets, 2, MaxSAHBuckets)),
+      width(MotionNodeWidth(options.width, options.compressNodes,
+                            MotionSegmentCount(options.motionSegments, options.motionStartTime, options.motionEndTime))),
+      splitAlpha(options.splitAlpha), rebuildThreshold(options.rebuildThreshold),
+      compressNodes(options.compressNodes &&
+                    MotionSegmentCount(options.motionSegments, options.motionStartTime, options.motionEndTime) == 1),
+      treeletPasses(std::max(0, options.treeletPasses)),
+      motionSegments(MotionSegmentCount(options.motionSegments, options.motionStartTime, options.motionEndTime)),
+      motionStartTime(options.motionStartTime), motionEndTime(options.motionEndTime),
+      outOfCorePrimitives(options.outOfCorePrimitives), primitives(primitives)
+    {
+        if(options.cacheDirectory.empty() || this->primitives.empty())
+        {
+            build();
+            return;
+        }
+        //the cache file is named by the key, so scenes with different geometry or settings never share a file
+        uint64_t key = cacheKey(primitives);
+        char keyName[32];
+        snprintf(keyName, sizeof(keyName), "%016llx", (unsigned long long)key);
+        std::string cacheFilename = options.cacheDirectory + "/bvh_" + keyName + ".cache";
+        if(loadCache(cacheFilename, key, primitives))
+            return;
+        //the out of core build writes the cache file, which is then used like a cached tree
+        if(outOfCorePrimitives > 0 && (int)primitives.size() > outOfCorePrimitives)
+        {
+            if(buildOutOfCore(cacheFilename, key) && loadCache(cacheFilename, key, primitives))
+                return;
+            Warn("Out of core BVH build failed. Building in memory.");
+        }
+        build();
+        writeCache(cacheFilename, key, primitives);
+    }
+
+    void BVHAccel::releaseNodes()
+    {
+        //nodes loaded from a cache file live in its mapping
+        if(cacheFile)
+            cacheFile.reset();
+        else
+        {
+            FreeAligned(nodes);
+            FreeAligned(wideNodes);
+            FreeAligned(quantizedNodes);
+        }
+        FreeAligned(leafTriangles);
+        FreeAligned(motionBounds);
+        nodes = nullptr;
+        wideNodes = nullptr;
+        quantizedNodes = nullptr;
+        leafTriangles = nullptr;
+        motionBounds = nullptr;
+        nTreeNodes = 0;
+    }
+
+    void BVHAccel::gatherTriangles()
+    {
+        int nPrimitives = primitives.size();
+        std::vector<const Triangle*> triangles(nPrimitives);
+        std::atomic<int> nTriangles{0};
+        ParallelFor([&](int chunk)
+        {
+            int chunkStart = chunk * ParallelChunkSize;
+            int chunkEnd = std::min(chunkStart + ParallelChunkSize, nPrimitives);
+            int count = 0;
+            for(int i = chunkStart; i < chunkEnd; i++)
+            {
+                const Triangle* triangle = dynamic_cast<const Triangle*>(primitives[i]->GetShape());
+                if(triangle && !triangle->HasAlphaMask())
+                {
+                    triangles[i] = triangle;
+                    count++;
+                }
+            }
+            nTriangles += count;
+        }, (nPrimitives + ParallelChunkSize - 1) / ParallelChunkSize);
+        if(nTriangles == 0)
+        {
+            FreeAligned(leafTriangles);
+            leafTriangles = nullptr;
+            return;
+        }
+        //refits gather again into the same array
+        if(!leafTriangles)
+            leafTriangles = AllocAligned<LeafTriangle>(nPrimitives);
+        ParallelFor([&](int i)
+        {
+            leafTriangles[i].isTriangle = triangles[i] != nullptr;
+            if(triangles[i])
+                leafTriangles[i].vertices = triangles[i]->GetVertices();
+        }, nPrimitives, ParallelChunkSize);
+    }
+
+    void BVHAccel::computeMotionBounds()
+    {
+        if(motionSegments == 1 || !nodes)
+            return;
+        if(!motionBounds)
+            motionBounds = AllocAligned<Bounds3f>(nTreeNodes * motionSegments);
+        //leaves bound their primitives in every segment
+        ParallelFor([&](int i)
+        {
+            const LinearBVHNode& node = nodes[i];
+            if(node.nPrimitives == 0)
+                return;
+            for(int segment = 0; segment < motionSegments; segment++)
+            {
+                Float time0 = Lerp(Float(segment) / motionSegments, motionStartTime, motionEndTime);
+                Float time1 = Lerp(Float(segment + 1) / motionSegments, motionStartTime, motionEndTime);
+                Bounds3f segmentBounds;
+                for(int j = 0; j < node.nPrimitives; j++)
+                    segmentBounds = Union(segmentBounds, primitives[node.primitivesOffset + j]->MotionBound(time0, time1));
+                motionBounds[i * motionSegments + segment] = segmentBounds;
+            }
+        }, nTreeNodes, 1024);
+        //children come after their parents, so interior nodes are done in reverse order
+        for(int i = nTreeNodes - 1; i >= 0; i--)
+        {
+            const LinearBVHNode& node = nodes[i];
+            if(node.nPrimitives > 0)
+                continue;
+            for(int segment = 0; segment < motionSegments; segment++)
+                motionBounds[i * motionSegments + segment] = Union(motionBounds[(i + 1) * motionSegments + segment],
+                                                                   motionBounds[node.secondChildOffset * motionSegments + segment]);
+        }
+    }
+
+    bool BVHAccel::intersectLeaf(int offset, int nPrimitives, const Ray& ray, SurfaceInteraction* surfaceInteraction) const
+    {
+        bool hit = false;
+        if(!leafTriangles)
+        {
+            for(int i = offset; i < offset + nPrimitives; i++)
+            {
+                if(primitives[i]->Intersect(ray, surfaceInteraction))
+                    hit = true;
+            }
+            return hit;
+        }
+        int closest = -1;
+        Float tClosest = ray.tMax;
+        for(int i = offset; i < offset + nPrimitives; i++)
+        {
+            const LeafTriangle& triangle = leafTriangles[i];
+            if(triangle.isTriangle)
+            {
+                Float tHit;
+                if(IntersectTriangle(ray, std::min(tClosest, ray.tMax), triangle.vertices.p0, triangle.vertices.p1,
+                                     triangle.vertices.p2, &tHit))
+                {
+                    closest = i;
+                    tClosest = tHit;
+                }
+            }
+            else if(primitives[i]->Intersect(ray, surfaceInteraction))
+                hit = true;
+        }
+        //a primitive tested after the closest triangle may have been hit in front of it
+        if(closest >= 0 && tClosest <= ray.tMax && primitives[closest]->Intersect(ray, surfaceInteraction))
+            hit = true;
+        return hit;
+    }
+
+    bool BVHAccel::intersectLeafP(int offset, int nPrimitives, const Ray& ray, const Primitive** occluder) const
+    {
+        for(int i = offset; i < offset + nPrimitives; i++)
+        {
+            if(leafTriangles && leafTriangles[i].isTriangle)
+            {
+                const TriangleVertices& vertices = leafTriangles[i].vertices;
+                Float tHit;
+                if(IntersectTriangle(ray, ray.tMax, vertices.p0, vertices.p1, vertices.p2, &tHit))
+                {
+                    *occluder = primitives[i].get();
+                    return true;
+                }
+            }
+            else if(primitives[i]->IntersectOccluder(ray, occluder))
+                return true;
+        }
+        return false;
+    }
+
+    void BVHAccel::build()
+    {
+        ProfilePhase _(Profiler::AccelConstruction);
+        releaseNodes();
+        releaseEditTree();
+        if(primitives.empty())
+            return;
+        //build BVH from primitives
+        //initialize primitiveInfo array for primitives
+        std::vector<BVHPrimitiveInfo> primitiveInfo(primitives.size());
+        ParallelFor([&](int i)
+        {
+            primitiveInfo[i] = { (size_t)i, primitives[i]->WorldBound() };
+        }, primitives.size(), ParallelChunkSize);
+        //build BVH tree for primitives using primitiveInfo
+        //the build nodes are only needed until flattening, so they are released with the arenas
+        MemoryArena arena(1024 * 1024);
+        std::vector<std::unique_ptr<MemoryArena>> subtreeArenas;
+        int totalNodes = 0;
+        //leaves store the primitives of their range in place, so orderedPrimitives can be filled concurrently
+        std::vector<std::shared_ptr<Primitive>> orderedPrimitives;
+        BVHBuildNode* root;
+        if(splitMethod != SplitMethod::SpatialSplit)
+            orderedPrimitives.resize(primitives.size());
+        if(splitMethod == SplitMethod::HLBVH)
+            root = HLBVHBuild(arena, primitiveInfo, &totalNodes, orderedPrimitives);
+        else if(splitMethod == SplitMethod::SpatialSplit)
+        {
+            Bounds3f rootBounds;
+            for(const BVHPrimitiveInfo& info : primitiveInfo)
+                rootBounds = Union(rootBounds, info.bounds);
+            root = spatialSplitBuild(arena, primitiveInfo, rootBounds.SurfaceArea(), 0, &totalNodes, orderedPrimitives);
+        }
+        else
+            root = parallelBuild(arena, subtreeArenas, primitiveInfo, &totalNodes, orderedPrimitives);
+        primitives.swap(orderedPrimitives);
+        primitiveInfo.resize(0);
+        //reorganize treelets into their SAH-optimal topologies, the subtrees deep enough in parallel first
+        for(int pass = 0; pass < treeletPasses; pass++)
+        {
+            std::vector<BVHBuildNode*> tasks;
+            CollectTreeletTasks(root, 0, tasks);
+            ParallelFor([&](int i) { RestructureSubtree(tasks[i], TreeletTaskDepth, -1); }, tasks.size());
+            RestructureSubtree(root, 0, TreeletTaskDepth);
+        }
+        //compute representation of depth-first traversal of BVH tree
+        nodes = AllocAligned<LinearBVHNode>(totalNodes);
+        int offset = 0;
+        flattenBVHTree(root, &offset);
+        Assert(totalNodes == offset);
+        nTreeNodes = totalNodes;
+        bounds = nodes[0].bounds;
+        finishBuild();
+    }
+
+    void BVHAccel::finishBuild()
+    {
+        //collapse into wide nodes or quantize if required
+        if(width == 4)
+            buildWideBVH<4>();
+        else if(width == 8)
+            buildWideBVH<8>();
+        else if(compressNodes)
+            buildQuantizedBVH();
+        gatherTriangles();
+        computeMotionBounds();
+        builtSAHCost = computeSAHCost();
+        reportStatistics();
+    }
+
+    bool BVHAccel::Refit()
+    {
+        ProfilePhase _(Profiler::AccelConstruction);
+        //the editable tree has the old bounds, it is created again by the next edit
+        releaseEditTree();
+        if(!nodes && !wideNodes && !quantizedNodes)
+            return false;
+        //quantized boxes are relative to the boxes of their parents, so they can't be refitted in place
+        if(quantizedNodes)
+        {
+            build();
+            return true;
+        }
+        //refit the subtrees below RefitTaskDepth in parallel, then the levels above them
+        std::vector<int> tasks;
+        if(width == 4 && wideNodes)
+        {
+            collectWideRefitTasks<4>(0, 0, tasks);
+            ParallelFor([&](int i) { refitWide<4>(tasks[i], 0, -1); }, tasks.size());
+            bounds = refitWide<4>(0, 0, WideRefitTaskDepth);
+        }
+        else if(width == 8 && wideNodes)
+        {
+            collectWideRefitTasks<8>(0, 0, tasks);
+            ParallelFor([&](int i) { refitWide<8>(tasks[i], 0, -1); }, tasks.size());
+            bounds = refitWide<8>(0, 0, WideRefitTaskDepth);
+        }
+        else
+        {
+            collectRefitTasks(0, 0, tasks);
+            ParallelFor([&](int i) { refitBVH(tasks[i], 0, -1); }, tasks.size());
+            bounds = refitBVH(0, 0, RefitTaskDepth);
+        }
+        //the topology built for the old positions may be poor for the new ones, rebuild if it costs too much more
+        if(computeSAHCost() <= rebuildThreshold * builtSAHCost)
+        {
+            //the copied vertices and the motion bounds moved with the primitives
+            gatherTriangles();
+            computeMotionBounds();
+            return false;
+        }
+        //spatial splits reference a primitive from several leaves, keep one reference of each for the rebuild
+        if(splitMethod == SplitMethod::SpatialSplit)
+        {
+            std::unordered_set<const Primitive*> seen;
+            std::vector<std::shared_ptr<Primitive>> unique;
+            for(const std::shared_ptr<Primitive>& primitive : primitives)
+            {
+                if(seen.insert(primitive.get()).second)
+                    unique.push_back(primitive);
+            }
+            primitives.swap(unique);
+        }
+        build();
+        return true;
+    }
+
+    void BVHAccel::collectRefitTasks(int nodeIndex, int depth, std::vector<int>& tasks) const
+    {
+        const LinearBVHNode& node = nodes[nodeIndex];
+        if(node.nPrimitives > 0)
+            return;
+        if(depth == RefitTaskDepth)
+        {
+            tasks.push_back(nodeIndex);
+            return;
+        }
+        collectRefitTasks(nodeIndex + 1, depth + 1, tasks);
+        collectRefitTasks(node.secondChildOffset, depth + 1, tasks);
+    }
+
+    Bounds3f BVHAccel::refitBVH(int nodeIndex, int depth, int stopDepth)
+    {
+        LinearBVHNode& node = nodes[nodeIndex];
+        //interior nodes at stopDepth were refitted by a task
+        if(node.nPrimitives == 0 && depth == stopDepth)
+            return node.bounds;
+        Bounds3f nodeBounds;
+        if(node.nPrimitives > 0)
+        {
+            for(int i = 0; i < node.nPrimitives; i++)
+                nodeBounds = Union(nodeBounds, primitives[node.primitivesOffset + i]->WorldBound());
+        }
+        else
+            nodeBounds = Union(refitBVH(nodeIndex + 1, depth + 1, stopDepth), refitBVH(node.secondChildOffset, depth + 1, stopDepth));
+        node.bounds = nodeBounds;
+        return nodeBounds;
+    }
+
+    template<int N>
+    void BVHAccel::collectWideRefitTasks(int wideIndex, int depth, std::vector<int>& tasks) const
+    {
+        if(depth == WideRefitTaskDepth)
+        {
+            tasks.push_back(wideIndex);
+            return;
+        }
+        const WideBVHNode<N>& node = static_cast<const WideBVHNode<N>*>(wideNodes)[wideIndex];
+        for(int i = 0; i < N; i++)
+        {
+            if(node.offset[i] >= 0 && node.nPrimitives[i] == 0)
+                collectWideRefitTasks<N>(node.offset[i], depth + 1, tasks);
+        }
+    }
+
+    template<int N>
+    Bounds3f BVHAccel::refitWide(int wideIndex, int depth, int stopDepth)
+    {
+        WideBVHNode<N>& node = static_cast<WideBVHNode<N>*>(wideNodes)[wideIndex];
+        Bounds3f nodeBounds;
+        for(int i = 0; i < N; i++)
+        {
+            //empty slots keep their inverted bounds
+            if(node.offset[i] < 0)
+                continue;
+            Bounds3f childBounds;
+            if(depth == stopDepth)
+            {
+                //the children of nodes at stopDepth were refitted by a task
+                childBounds = Bounds3f(Point3f(node.bounds[0][0][i], node.bounds[0][1][i], node.bounds[0][2][i]),
+                                       Point3f(node.bounds[1][0][i], node.bounds[1][1][i], node.bounds[1][2][i]));
+            }
+            else if(node.nPrimitives[i] > 0)
+            {
+                for(int j = 0; j < node.nPrimitives[i]; j++)
+                    childBounds = Union(childBounds, primitives[node.offset[i] + j]->WorldBound());
+            }
+            else
+                childBounds = refitWide<N>(node.offset[i], depth + 1, stopDepth);
+            for(int axis = 0; axis < 3; axis++)
+            {
+                node.bounds[0][axis][i] = childBounds.pMin[axis];
+                node.bounds[1][axis][i] = childBounds.pMax[axis];
+            }
+            nodeBounds = Union(nodeBounds, childBounds);
+        }
+        return nodeBounds;
+    }
+
+    void BVHAccel::Insert(const std::vector<std::shared_ptr<Primitive>>& added)
+    {
+        ProfilePhase _(Profiler::AccelConstruction);
+        if(added.empty())
+            return;
+        beginEdit();
+        for(const std::shared_ptr<Primitive>& primitive : added)
+        {
+            if(editLeaves.count(primitive.get()))
+            {
+                Warn("Primitive is already in the BVH. Ignoring the insertion.");
+                continue;
+            }
+            insertEditLeaf(createEditLeaf(primitive));
+        }
+        flattenEditTree();
+    }
+
+    int BVHAccel::Remove(const std::vector<std::shared_ptr<Primitive>>& removed)
+    {
+        ProfilePhase _(Profiler::AccelConstruction);
+        beginEdit();
+        int nRemoved = 0;
+        for(const std::shared_ptr<Primitive>& primitive : removed)
+        {
+            auto leaf = editLeaves.find(primitive.get());
+            if(leaf == editLeaves.end())
+                continue;
+            removeEditLeaf(leaf->second);
+            editLeaves.erase(leaf);
+            nRemoved++;
+        }
+        if(nRemoved > 0)
+            flattenEditTree();
+        return nRemoved;
+    }
+
+    void BVHAccel::beginEdit()
+    {
+        if(editRoot >= 0 || (!nodes && !wideNodes && !quantizedNodes))
+            return;
+        //the leaves of a node become a subtree with a primitive per leaf,
+        //primitives referenced by several leaves of spatial split trees are only kept once
+        auto makeLeaves = [&](int offset, int nPrimitives, std::vector<int>& children)
+        {
+            for(int i = 0; i < nPrimitives; i++)
+            {
+                if(!editLeaves.count(primitives[offset + i].get()))
+                    children.push_back(createEditLeaf(primitives[offset + i]));
+            }
+        };
+        //pair up the subtrees of a node level by level, -1 if all of them are empty
+        auto combine = [&](std::vector<int>& children)
+        {
+            children.erase(std::remove(children.begin(), children.end(), -1), children.end());
+            while(children.size() > 1)
+            {
+                std::vector<int> paired;
+                for(size_t i = 0; i + 1 < children.size(); i += 2)
+                {
+                    int parent = allocateEditNode();
+                    BVHEditNode& node = editNodes[parent];
+                    node.children[0] = children[i];
+                    node.children[1] = children[i + 1];
+                    node.bounds = Union(editNodes[children[i]].bounds, editNodes[children[i + 1]].bounds);
+                    node.nPrimitives = editNodes[children[i]].nPrimitives + editNodes[children[i + 1]].nPrimitives;
+                    editNodes[children[i]].parent = parent;
+                    editNodes[children[i + 1]].parent = parent;
+                    paired.push_back(parent);
+                }
+                if(children.size() % 2 == 1)
+                    paired.push_back(children.back());
+                children.swap(paired);
+            }
+            return children.empty() ? -1 : children[0];
+        };
+        if(nodes)
+        {
+            auto convert = [&](auto& self, int nodeIndex) -> int
+            {
+                const LinearBVHNode& node = nodes[nodeIndex];
+                std::vector<int> children;
+                if(node.nPrimitives > 0)
+                    makeLeaves(node.primitivesOffset, node.nPrimitives, children);
+                else
+                    children = { self(self, nodeIndex + 1), self(self, node.secondChildOffset) };
+                return combine(children);
+            };
+            editRoot = convert(convert, 0);
+        }
+        else if(wideNodes)
+        {
+            auto convertWide = [&](const auto* wide, auto nChildren)
+            {
+                constexpr int N = decltype(nChildren)::value;
+                auto convert = [&](auto& self, int wideIndex) -> int
+                {
+                    const WideBVHNode<N>& node = wide[wideIndex];
+                    std::vector<int> children;
+                    for(int i = 0; i < N; i++)
+                    {
+                        if(node.nPrimitives[i] > 0)
+                            makeLeaves(node.offset[i], node.nPrimitives[i], children);
+                        else if(node.offset[i] >= 0)
+                            children.push_back(self(self, node.offset[i]));
+                    }
+                    return combine(children);
+                };
+                return convert(convert, 0);
+            };
+            if(width == 4)
+                editRoot = convertWide(static_cast<const WideBVHNode<4>*>(wideNodes), std::integral_constant<int, 4>());
+            else
+                editRoot = convertWide(static_cast<const WideBVHNode<8>*>(wideNodes), std::integral_constant<int, 8>());
+        }
+        else
+        {
+            auto convert = [&](auto& self, int quantizedIndex) -> int
+            {
+                const QuantizedBVHNode& node = quantizedNodes[quantizedIndex];
+                std::vector<int> children;
+                for(int i = 0; i < 2; i++)
+                {
+                    if(node.nPrimitives[i] > 0)
+                        makeLeaves(node.offset[i], node.nPrimitives[i], children);
+                    else
+                        children.push_back(self(self, node.offset[i]));
+                }
+                return combine(children);
+            };
+            editRoot = convert(convert, 0);
+        }
+    }
+
+    void BVHAccel::releaseEditTree()
+    {
+        editNodes.clear();
+        editNodes.shrink_to_fit();
+        editLeaves.clear();
+        editRoot = -1;
+        editFreeList = -1;
+    }
+
+    int BVHAccel::allocateEditNode()
+    {
+        int index;
+        if(editFreeList >= 0)
+        {
+            index = editFreeList;
+            editFreeList = editNodes[index].children[0];
+        }
+        else
+        {
+            index = editNodes.size();
+            editNodes.emplace_back();
+        }
+        BVHEditNode& node = editNodes[index];
+        node.bounds = Bounds3f();
+        node.primitive = nullptr;
+        node.parent = -1;
+        node.children[0] = node.children[1] = -1;
+        node.nPrimitives = 0;
+        return index;
+    }
+
+    int BVHAccel::createEditLeaf(const std::shared_ptr<Primitive>& primitive)
+    {
+        int leaf = allocateEditNode();
+        BVHEditNode& node = editNodes[leaf];
+        node.bounds = primitive->WorldBound();
+        node.primitive = primitive;
+        node.nPrimitives = 1;
+        editLeaves[primitive.get()] = leaf;
+        return leaf;
+    }
+
+    void BVHAccel::insertEditLeaf(int leaf)
+    {
+        if(editRoot < 0)
+        {
+            editRoot = leaf;
+            return;
+        }
+        //branch and bound search for the sibling, a candidate costs the area of its union with the leaf
+        //plus the area that union adds to its ancestors, and the inherited part bounds the cost of every node below it
+        struct Candidate
+        {
+            //the cheapest inherited cost is searched first
+            bool operator<(const Candidate& other) const { return inheritedCost > other.inheritedCost; }
+            Float inheritedCost;
+            int node;
+        };
+        Bounds3f leafBounds = editNodes[leaf].bounds;
+        Float leafArea = leafBounds.SurfaceArea();
+        int sibling = editRoot;
+        Float bestCost = Union(editNodes[editRoot].bounds, leafBounds).SurfaceArea();
+        std::priority_queue<Candidate> candidates;
+        candidates.push({ 0, editRoot });
+        while(!candidates.empty())
+        {
+            Candidate candidate = candidates.top();
+            candidates.pop();
+            if(leafArea + candidate.inheritedCost >= bestCost)
+                break;
+            const BVHEditNode& node = editNodes[candidate.node];
+            Float unionArea = Union(node.bounds, leafBounds).SurfaceArea();
+            if(unionArea + candidate.inheritedCost < bestCost)
+            {
+                bestCost = unionArea + candidate.inheritedCost;
+                sibling = candidate.node;
+            }
+            if(node.primitive)
+                continue;
+            Float childInheritedCost = candidate.inheritedCost + unionArea - node.bounds.SurfaceArea();
+            if(leafArea + childInheritedCost < bestCost)
+            {
+                candidates.push({ childInheritedCost, node.children[0] });
+                candidates.push({ childInheritedCost, node.children[1] });
+            }
+        }
+        //replace the sibling with a new parent of the sibling and the leaf
+        int parent = allocateEditNode();
+        int grandparent = editNodes[sibling].parent;
+        BVHEditNode& node = editNodes[parent];
+        node.parent = grandparent;
+        node.children[0] = sibling;
+        node.children[1] = leaf;
+        editNodes[sibling].parent = parent;
+        editNodes[leaf].parent = parent;
+        if(grandparent < 0)
+            editRoot = parent;
+        else
+        {
+            BVHEditNode& grandparentNode = editNodes[grandparent];
+            grandparentNode.children[grandparentNode.children[0] == sibling ? 0 : 1] = parent;
+        }
+        refitEditPath(parent);
+    }
+
+    void BVHAccel::removeEditLeaf(int leaf)
+    {
+        int parent = editNodes[leaf].parent;
+        editNodes[leaf].primitive = nullptr;
+        editNodes[leaf].children[0] = editFreeList;
+        editFreeList = leaf;
+        if(parent < 0)
+        {
+            editRoot = -1;
+            return;
+        }
+        //the sibling takes the place of the parent
+        BVHEditNode& parentNode = editNodes[parent];
+        int sibling = parentNode.children[parentNode.children[0] == leaf ? 1 : 0];
+        int grandparent = parentNode.parent;
+        editNodes[sibling].parent = grandparent;
+        parentNode.children[0] = editFreeList;
+        editFreeList = parent;
+        if(grandparent < 0)
+        {
+            editRoot = sibling;
+            return;
+        }
+        BVHEditNode& grandparentNode = editNodes[grandparent];
+        grandparentNode.children[grandparentNode.children[0] == parent ? 0 : 1] = sibling;
+        refitEditPath(grandparent);
+    }
+
+    void BVHAccel::refitEditPath(int node)
+    {
+        for(; node >= 0; node = editNodes[node].parent)
+        {
+            BVHEditNode& editNode = editNodes[node];
+            const BVHEditNode& child0 = editNodes[editNode.children[0]];
+            const BVHEditNode& child1 = editNodes[editNode.children[1]];
+            editNode.bounds = Union(child0.bounds, child1.bounds);
+            editNode.nPrimitives = child0.nPrimitives + child1.nPrimitives;
+            rotateEditNode(node);
+        }
+    }
+
+    void BVHAccel::rotateEditNode(int node)
+    {
+        //swapping a child with a grandchild under the other child keeps the bounds of node,
+        //and the other child then bounds the swapped child and the remaining grandchild
+        BVHEditNode& editNode = editNodes[node];
+        Float bestDelta = 0;
+        int bestChild = -1, bestGrandchild = -1;
+        for(int i = 0; i < 2; i++)
+        {
+            const BVHEditNode& other = editNodes[editNode.children[1 - i]];
+            if(other.primitive)
+                continue;
+            const Bounds3f& childBounds = editNodes[editNode.children[i]].bounds;
+            for(int j = 0; j < 2; j++)
+            {
+                Float delta = Union(childBounds, editNodes[other.children[1 - j]].bounds).SurfaceArea() - other.bounds.SurfaceArea();
+                if(delta < bestDelta)
+                {
+                    bestDelta = delta;
+                    bestChild = i;
+                    bestGrandchild = j;
+                }
+            }
+        }
+        if(bestChild < 0)
+            return;
+        int child = editNode.children[bestChild];
+        int otherIndex = editNode.children[1 - bestChild];
+        BVHEditNode& other = editNodes[otherIndex];
+        int grandchild = other.children[bestGrandchild];
+        editNode.children[bestChild] = grandchild;
+        editNodes[grandchild].parent = node;
+        other.children[bestGrandchild] = child;
+        editNodes[child].parent = otherIndex;
+        other.bounds = Union(editNodes[other.children[0]].bounds, editNodes[other.children[1]].bounds);
+        other.nPrimitives = editNodes[other.children[0]].nPrimitives + editNodes[other.children[1]].nPrimitives;
+    }
+
+    BVHBuildNode* BVHAccel::emitEditTree(MemoryArena& arena, int node, int depth, int* totalNodes, int* maxDepth,
+                                         std::vector<std::shared_ptr<Primitive>>& orderedPrimitives) const
+    {
+        const BVHEditNode& editNode = editNodes[node];
+        BVHBuildNode* buildNode = arena.Alloc<BVHBuildNode>();
+        (*totalNodes)++;
+        *maxDepth = std::max(*maxDepth, depth);
+        //small subtrees become a leaf when it is cheaper for the cost model of the build
+        bool leaf = editNode.primitive != nullptr;
+        if(!leaf && editNode.nPrimitives <= maxPrimsInNode)
+        {
+            const BVHEditNode& child0 = editNodes[editNode.children[0]];
+            const BVHEditNode& child1 = editNodes[editNode.children[1]];
+            Float area = editNode.bounds.SurfaceArea();
+            leaf = editNode.nPrimitives * area <= 0.125f * area + child0.nPrimitives * child0.bounds.SurfaceArea() +
+                                                  child1.nPrimitives * child1.bounds.SurfaceArea();
+        }
+        if(leaf)
+        {
+            int firstPrimOffset = orderedPrimitives.size();
+            std::vector<int> toVisit = { node };
+            while(!toVisit.empty())
+            {
+                const BVHEditNode& visited = editNodes[toVisit.back()];
+                toVisit.pop_back();
+                if(visited.primitive)
+                    orderedPrimitives.push_back(visited.primitive);
+                else
+                {
+                    toVisit.push_back(visited.children[1]);
+                    toVisit.push_back(visited.children[0]);
+                }
+            }
+            buildNode->InitLeaf(firstPrimOffset, editNode.nPrimitives, editNode.bounds);
+            return buildNode;
+        }
+        //the split axis orders the children for traversal, so the child with the lower centroid goes first
+        Vector3f delta = editNodes[editNode.children[1]].bounds.pMin + editNodes[editNode.children[1]].bounds.pMax -
+                         editNodes[editNode.children[0]].bounds.pMin - Vector3f(editNodes[editNode.children[0]].bounds.pMax);
+        int axis = MaxDimension(Abs(delta));
+        int first = delta[axis] >= 0 ? 0 : 1;
+        BVHBuildNode* left = emitEditTree(arena, editNode.children[first], depth + 1, totalNodes, maxDepth, orderedPrimitives);
+        BVHBuildNode* right = emitEditTree(arena, editNode.children[1 - first], depth + 1, totalNodes, maxDepth, orderedPrimitives);
+        buildNode->InitInterior(axis, left, right);
+        return buildNode;
+    }
+
+    void BVHAccel::flattenEditTree()
+    {
+        releaseNodes();
+        if(editRoot < 0)
+        {
+            primitives.clear();
+            bounds = Bounds3f();
+            return;
+        }
+        MemoryArena arena(1024 * 1024);
+        int totalNodes = 0, maxDepth = 0;
+        std::vector<std::shared_ptr<Primitive>> orderedPrimitives;
+        orderedPrimitives.reserve(editNodes[editRoot].nPrimitives);
+        BVHBuildNode* root = emitEditTree(arena, editRoot, 0, &totalNodes, &maxDepth, orderedPrimitives);
+        primitives.swap(orderedPrimitives);
+        nodes = AllocAligned<LinearBVHNode>(totalNodes);
+        int offset = 0;
+        flattenBVHTree(root, &offset);
+        Assert(totalNodes == offset);
+        nTreeNodes = totalNodes;
+        bounds = nodes[0].bounds;
+        //edits are measured against the tree of the last build, the first edits of an empty tree become the reference
+        Float referenceCost = builtSAHCost;
+        finishBuild();
+        Float editedCost = builtSAHCost;
+        if(referenceCost > 0)
+            builtSAHCost = referenceCost;
+        if((referenceCost > 0 && editedCost > rebuildThreshold * referenceCost) || maxDepth >= MaxEditDepth)
+            build();
+    }
+
+    Float BVHAccel::computeSAHCost() const
+    {
+        //the same cost model as the SAH build, relative to the surface area of the root
+        Float rootArea = bounds.SurfaceArea();
+        if(rootArea <= 0)
+            return 0;
+        Float cost = 0;
+        if(wideNodes)
+        {
+            //the root is always visited, every interior slot adds a visit of the wide node it points to
+            cost = 0.125f * rootArea;
+            auto accumulate = [&](const auto* wide, auto nChildren)
+            {
+                constexpr int N = decltype(nChildren)::value;
+                std::vector<int> toVisit = { 0 };
+                while(!toVisit.empty())
+                {
+                    const WideBVHNode<N>& node = wide[toVisit.back()];
+                    toVisit.pop_back();
+                    for(int i = 0; i < N; i++)
+                    {
+                        if(node.offset[i] < 0)
+                            continue;
+                        Bounds3f childBounds(Point3f(node.bounds[0][0][i], node.bounds[0][1][i], node.bounds[0][2][i]),
+                                             Point3f(node.bounds[1][0][i], node.bounds[1][1][i], node.bounds[1][2][i]));
+                        if(node.nPrimitives[i] > 0)
+                            cost += node.nPrimitives[i] * childBounds.SurfaceArea();
+                        else
+                        {
+                            cost += 0.125f * childBounds.SurfaceArea();
+                            toVisit.push_back(node.offset[i]);
+                        }
+                    }
+                }
+            };
+            if(width == 4)
+                accumulate(static_cast<const WideBVHNode<4>*>(wideNodes), std::integral_constant<int, 4>());
+            else
+                accumulate(static_cast<const WideBVHNode<8>*>(wideNodes), std::integral_constant<int, 8>());
+            return cost / rootArea;
+        }
+        if(quantizedNodes)
+        {
+            cost = 0.125f * rootArea;
+            struct NodeEntry
+            {
+                int node;
+                Bounds3f box;
+            };
+            std::vector<NodeEntry> toVisit = { { 0, bounds } };
+            while(!toVisit.empty())
+            {
+                NodeEntry entry = toVisit.back();
+                toVisit.pop_back();
+                const QuantizedBVHNode& node = quantizedNodes[entry.node];
+                Vector3f step = QuantizationStep(entry.box);
+                for(int i = 0; i < 2; i++)
+                {
+                    Bounds3f childBounds = DequantizeBounds(node.childBounds[i], entry.box, step);
+                    if(node.nPrimitives[i] > 0)
+                        cost += node.nPrimitives[i] * childBounds.SurfaceArea();
+                    else
+                    {
+                        cost += 0.125f * childBounds.SurfaceArea();
+                        toVisit.push_back({ node.offset[i], childBounds });
+                    }
+                }
+            }
+            return cost / rootArea;
+        }
+        int nNodes = 1;
+        for(int i = 0; i < nNodes; i++)
+        {
+            //interior nodes always have a second child after the first, so the nodes are counted on the way
+            const LinearBVHNode& node = nodes[i];
+            if(node.nPrimitives > 0)
+                cost += node.nPrimitives * node.bounds.SurfaceArea();
+            else
+            {
+                cost += 0.125f * node.bounds.SurfaceArea();
+                nNodes = std::max(nNodes, node.secondChildOffset + 1);
+            }
+        }
+        return cost / rootArea;
+    }
+
+    void BVHAccel::reportStatistics()
+    {
+        //count the nodes of the tree in use, so collapsed, quantized and cached trees are reported as traversed
+        int64_t nInterior = 0, nLeaves = 0, nodeBytes = 0;
+        int maxDepth = 0;
+        auto addLeaf = [&](int nPrimitives, int depth)
+        {
+            nLeaves++;
+            primitivesPerLeaf.Add(nPrimitives);
+            maxDepth = std::max(maxDepth, depth);
+        };
+        //pairs of node index and depth
+        std::vector<std::pair<int, int>> toVisit = { { 0, 0 } };
+        if(wideNodes)
+        {
+            auto visit = [&](const auto* wide, auto nChildren)
+            {
+                constexpr int N = decltype(nChildren)::value;
+                while(!toVisit.empty())
+                {
+                    std::pair<int, int> entry = toVisit.back();
+                    toVisit.pop_back();
+                    const WideBVHNode<N>& node = wide[entry.first];
+                    nInterior++;
+                    for(int i = 0; i < N; i++)
+                    {
+                        if(node.offset[i] < 0)
+                            continue;
+                        if(node.nPrimitives[i] > 0)
+                            addLeaf(node.nPrimitives[i], entry.second + 1);
+                        else
+                            toVisit.push_back({ node.offset[i], entry.second + 1 });
+                    }
+                }
+            };
+            if(width == 4)
+                visit(static_cast<const WideBVHNode<4>*>(wideNodes), std::integral_constant<int, 4>());
+            else
+                visit(static_cast<const WideBVHNode<8>*>(wideNodes), std::integral_constant<int, 8>());
+            nodeBytes = (int64_t)nTreeNodes * (width == 4 ? sizeof(WideBVHNode<4>) : sizeof(WideBVHNode<8>));
+        }
+        else if(quantizedNodes)
+        {
+            while(!toVisit.empty())
+            {
+                std::pair<int, int> entry = toVisit.back();
+                toVisit.pop_back();
+                const QuantizedBVHNode& node = quantizedNodes[entry.first];
+                nInterior++;
+                for(int i = 0; i < 2; i++)
+                {
+                    if(node.nPrimitives[i] > 0)
+                        addLeaf(node.nPrimitives[i], entry.second + 1);
+                    else
+                        toVisit.push_back({ node.offset[i], entry.second + 1 });
+                }
+            }
+            nodeBytes = (int64_t)nTreeNodes * sizeof(QuantizedBVHNode);
+        }
+        else if(nodes)
+        {
+            while(!toVisit.empty())
+            {
+                std::pair<int, int> entry = toVisit.back();
+                toVisit.pop_back();
+                const LinearBVHNode& node = nodes[entry.first];
+                if(node.nPrimitives > 0)
+                    addLeaf(node.nPrimitives, entry.second);
+                else
+                {
+                    nInterior++;
+                    toVisit.push_back({ entry.first + 1, entry.second + 1 });
+                    toVisit.push_back({ node.secondChildOffset, entry.second + 1 });
+                }
+            }
+            nodeBytes = (int64_t)nTreeNodes * sizeof(LinearBVHNode);
+        }
+        else
+            return;
+        int64_t bytes = nodeBytes + primitives.size() * sizeof(primitives[0]);
+        if(leafTriangles)
+            bytes += primitives.size() * sizeof(LeafTriangle);
+        if(motionBounds)
+            bytes += (int64_t)nTreeNodes * motionSegments * sizeof(Bounds3f);
+        //the counters describe the trees in use, so a rebuild takes back what the previous tree of this BVH reported,
+        //unless the statistics were cleared since then, the distributions keep a sample of every build
+        if(reportedClearCount == StatsClearCount())
+        {
+            interiorNodes -= reported.interiorNodes;
+            leafNodes -= reported.leafNodes;
+            treeBytes -= reported.bytes;
+        }
+        interiorNodes += nInterior;
+        leafNodes += nLeaves;
+        treeBytes += bytes;
+        reported = { nInterior, nLeaves, bytes };
+        reportedClearCount = StatsClearCount();
+        treeDepth.Add(maxDepth);
+        sahCost.Add(builtSAHCost);
+    }
+
+    BVHAccel::~BVHAccel()
+    {
+        releaseNodes();
+    }
+
+    Bounds3f BVHAccel::WorldBound() const
+    {
+        return bounds;
+    }
+
+    Bounds3f BVHAccel::MotionBound(Float time0, Float time1) const
+    {
+        if(!motionBounds)
+            return bounds;
+        Bounds3f rootBounds;
+        for(int segment = motionSegment(time0); segment <= motionSegment(time1); segment++)
+            rootBounds = Union(rootBounds, motionBounds[segment]);
+        return rootBounds;
+    }
+
+    int BVHAccel::splitPrimitives(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, const Bounds3f& bounds,
+                                  const Bounds3f& centroidBounds, int dim, bool parallel) const
+    {
+        int nPrimitives = end - start;
+        auto partition = [&](const auto& predicate)
+        {
+            if(parallel)
+                return ParallelPartition(primitiveInfo, start, end, predicate);
+            BVHPrimitiveInfo* pMiddle = std::partition(&primitiveInfo[start], &primitiveInfo[end - 1] + 1, predicate);
+            return (int)(pMiddle - &primitiveInfo[0]);
+        };
+        auto equalCounts = [&]()
+        {
+            //partition primitives into equally sized subsets
+            int middle = (start + end) / 2;
+            std::nth_element(&primitiveInfo[start], &primitiveInfo[middle], &primitiveInfo[end - 1] + 1,
+            [dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) { return a.centroid[dim] < b.centroid[dim]; });
+            return middle;
+        };
+        switch(splitMethod)
+        {
+        case SplitMethod::Middle:
+        {
+            //partition primitives through node's midpoint
+            Float pMiddle = (centroidBounds.pMin[dim] + centroidBounds.pMax[dim]) / 2;
+            int middle = partition([dim, pMiddle](const BVHPrimitiveInfo& info) { return info.centroid[dim] < pMiddle; });
+            //for lots of prims with large overlapping bounding boxes, this may fail to partition
+            if(middle != start && middle != end)
+                return middle;
+            //otherwise fall back to EqualCounts
+            return equalCounts();
+        }
+        case SplitMethod::EqualCounts:
+            return equalCounts();
+        case SplitMethod::SAH:
+        default:
+        {
+            //partition primitives using approximate SAH
+            if(nPrimitives <= 2)
+                return equalCounts();
+            //initialize BucketInfo for SAH partition buckets
+            BucketInfo buckets[MaxSAHBuckets];
+            if(!parallel)
+            {
+                for(int i = start; i < end; i++)
+                {
+                    int b = BucketIndex(primitiveInfo[i].centroid, centroidBounds, dim, nBuckets);
+                    buckets[b].count++;
+                    buckets[b].bounds = Union(buckets[b].bounds, primitiveInfo[i].bounds);
+                }
+            }
+            else
+            {
+                //bin every chunk into its own buckets, then merge them in order
+                int nChunks = (nPrimitives + ParallelChunkSize - 1) / ParallelChunkSize;
+                std::vector<BucketInfo> chunkBuckets(nChunks * nBuckets);
+                ParallelFor([&](int chunk)
+                {
+                    BucketInfo* local = &chunkBuckets[chunk * nBuckets];
+                    int chunkStart = start + chunk * ParallelChunkSize;
+                    int chunkEnd = std::min(chunkStart + ParallelChunkSize, end);
+                    for(int i = chunkStart; i < chunkEnd; i++)
+                    {
+                        int b = BucketIndex(primitiveInfo[i].centroid, centroidBounds, dim, nBuckets);
+                        local[b].count++;
+                        local[b].bounds = Union(local[b].bounds, primitiveInfo[i].bounds);
+                    }
+                }, nChunks);
+                for(int chunk = 0; chunk < nChunks; chunk++)
+                {
+                    for(int b = 0; b < nBuckets; b++)
+                    {
+                        buckets[b].count += chunkBuckets[chunk * nBuckets + b].count;
+                        buckets[b].bounds = Union(buckets[b].bounds, chunkBuckets[chunk * nBuckets + b].bounds);
+                    }
+                }
+            }
+            //find bucket to split at that minimizes SAH metric
+            Float minCost;
+            int minCostSplitBucket = FindSAHSplit(buckets, nBuckets, bounds, &minCost);
+            //either create leaf or split primitives at selected SAH bucket
+            Float leafCost = nPrimitives;
+            if(nPrimitives <= maxPrimsInNode && minCost >= leafCost)
+                return -1;
+            return partition([&](const BVHPrimitiveInfo& info)
+            {
+                return BucketIndex(info.centroid, centroidBounds, dim, nBuckets) <= minCostSplitBucket;
+            });
+        }
+        }
+    }
+
+    BVHBuildNode* BVHAccel::recursiveBuild(MemoryArena& arena, std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+                                           int* totalNodes, std::vector<std::shared_ptr<Primitive>>& orderedPrimitives)
+    {
+        Assert(start != end);
+        BVHBuildNode* node = arena.Alloc<BVHBuildNode>();
+        (*totalNodes)++;
+        //compute bounds of all primitives and their centroids in BVH node
+        Bounds3f bounds, centroidBounds;
+        ComputeBounds(primitiveInfo, start, end, &bounds, &centroidBounds, false);
+        int nPrimitives = end - start;
+        //create leaf BVHBuildNode, primitives of a leaf are stored in the same range they occupy in primitiveInfo
+        auto createLeaf = [&]()
+        {
+            for(int i = start; i < end; i++)
+                orderedPrimitives[i] = primitives[primitiveInfo[i].primitiveIndex];
+            node->InitLeaf(start, nPrimitives, bounds);
+            return node;
+        };
+        if(nPrimitives == 1)
+            return createLeaf();
+        //choose split dimension
+        int dim = centroidBounds.MaximumExtent();
+        //all of the centroids are at the same position, no way to split them
+        if(centroidBounds.pMax[dim] == centroidBounds.pMin[dim])
+            return createLeaf();
+        //partition primitives into two sets and build children
+        int middle = splitPrimitives(primitiveInfo, start, end, bounds, centroidBounds, dim, false);
+        if(middle < 0)
+            return createLeaf();
+        node->InitInterior(dim, recursiveBuild(arena, primitiveInfo, start, middle, totalNodes, orderedPrimitives),
+                                recursiveBuild(arena, primitiveInfo, middle, end, totalNodes, orderedPrimitives));
+        return node;
+    }
+
+    BVHBuildNode* BVHAccel::parallelBuild(MemoryArena& arena, std::vector<std::unique_ptr<MemoryArena>>& subtreeArenas,
+                                          std::vector<BVHPrimitiveInfo>& primitiveInfo, int* totalNodes,
+                                          std::vector<std::shared_ptr<Primitive>>& orderedPrimitives)
+    {
+        int nPrimitives = primitiveInfo.size();
+        if(nPrimitives <= ParallelBuildThreshold)
+            return recursiveBuild(arena, primitiveInfo, 0, nPrimitives, totalNodes, orderedPrimitives);
+        //split the upper levels with parallel binning and partition
+        std::vector<BVHBuildTask> tasks;
+        BVHBuildNode* root = buildUpperLevels(arena, primitiveInfo, 0, nPrimitives, totalNodes, orderedPrimitives, tasks);
+        //the subtrees are disjoint ranges of primitiveInfo, build them in parallel with their own arena and node count
+        subtreeArenas.resize(tasks.size());
+        std::vector<int> subtreeNodes(tasks.size(), 0);
+        ParallelFor([&](int i)
+        {
+            subtreeArenas[i].reset(new MemoryArena);
+            *tasks[i].node = recursiveBuild(*subtreeArenas[i], primitiveInfo, tasks[i].start, tasks[i].end,
+                                            &subtreeNodes[i], orderedPrimitives);
+        }, tasks.size());
+        for(int count : subtreeNodes)
+            *totalNodes += count;
+        return root;
+    }
+
+    BVHBuildNode* BVHAccel::buildUpperLevels(MemoryArena& arena, std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+                                             int* totalNodes, std::vector<std::shared_ptr<Primitive>>& orderedPrimitives,
+                                             std::vector<BVHBuildTask>& tasks)
+    {
+        BVHBuildNode* node = arena.Alloc<BVHBuildNode>();
+        (*totalNodes)++;
+        Bounds3f bounds, centroidBounds;
+        ComputeBounds(primitiveInfo, start, end, &bounds, &centroidBounds, true);
+        int dim = centroidBounds.MaximumExtent();
+        int middle = -1;
+        if(centroidBounds.pMax[dim] > centroidBounds.pMin[dim])
+            middle = splitPrimitives(primitiveInfo, start, end, bounds, centroidBounds, dim, true);
+        if(middle < 0)
+        {
+            for(int i = start; i < end; i++)
+                orderedPrimitives[i] = primitives[primitiveInfo[i].primitiveIndex];
+            node->InitLeaf(start, end - start, bounds);
+            return node;
+        }
+        //children are linked after they are built
+        node->InitInterior(dim, bounds);
+        auto buildChild = [&](BVHBuildNode** child, int childStart, int childEnd)
+        {
+            if(childEnd - childStart > ParallelBuildThreshold)
+                *child = buildUpperLevels(arena, primitiveInfo, childStart, childEnd, totalNodes, orderedPrimitives, tasks);
+            else
+                tasks.push_back({ child, childStart, childEnd });
+        };
+        buildChild(&node->left, start, middle);
+        buildChild(&node->right, middle, end);
+        return node;
+    }
+
+    BVHBuildNode* BVHAccel::HLBVHBuild(MemoryArena& arena, const std::vector<BVHPrimitiveInfo>& primitiveInfo, int* totalNodes,
+                                       std::vector<std::shared_ptr<Primitive>>& orderedPrimitives)
+    {
+        //compute bounding box of all primitive centroids
+        Bounds3f bounds, centroidBounds;
+        ComputeBounds(primitiveInfo, 0, primitiveInfo.size(), &bounds, &centroidBounds, primitiveInfo.size() > ParallelBuildThreshold);
+        //compute Morton indices of primitives
+        std::vector<MortonPrimitive> mortonPrimitives(primitiveInfo.size());
+        ParallelFor([&](int i)
+        {
+            //initialize mortonPrimitives[i] for ith primitive
+            constexpr int mortonBits = 10;
+            constexpr int mortonScale = 1 << mortonBits;
+            mortonPrimitives[i].primitiveIndex = primitiveInfo[i].primitiveIndex;
+            Vector3f centroidOffset = centroidBounds.Offset(primitiveInfo[i].centroid);
+            mortonPrimitives[i].mortonCode = EncodeMorton3(centroidOffset * (Float)mortonScale);
+        }, primitiveInfo.size(), 512);
+        //radix sort primitive Morton indices
+        RadixSort(&mortonPrimitives);
+        //create LBVH treelets at bottom of BVH
+        //find intervals of primitives for each treelet, which share the upper 12 bits of their Morton codes
+        std::vector<LBVHTreelet> treeletsToBuild;
+        for(int start = 0, end = 1; end <= (int)mortonPrimitives.size(); end++)
+        {
+            constexpr uint32_t mask = 0b00111111111111000000000000000000;
+            if(end == (int)mortonPrimitives.size() ||
+               ((mortonPrimitives[start].mortonCode & mask) != (mortonPrimitives[end].mortonCode & mask)))
+            {
+                //add entry to treeletsToBuild for this treelet
+                int nPrimitives = end - start;
+                int maxBVHNodes = 2 * nPrimitives - 1;
+                BVHBuildNode* nodes = arena.Alloc<BVHBuildNode>(maxBVHNodes, false);
+                treeletsToBuild.push_back({ start, nPrimitives, nodes });
+                start = end;
+            }
+        }
+        //create LBVHs for treelets in parallel
+        std::vector<int> treeletNodes(treeletsToBuild.size(), 0);
+        ParallelFor([&](int i)
+        {
+            //generate ith LBVH treelet
+            //the first bit to split at is the highest bit below the 12 treelet bits
+            constexpr int firstBitIndex = 29 - 12;
+            LBVHTreelet& treelet = treeletsToBuild[i];
+            treelet.buildNodes = emitLBVH(treelet.buildNodes, &mortonPrimitives[treelet.startIndex], treelet.startIndex,
+                                          treelet.nPrimitives, &treeletNodes[i], orderedPrimitives, firstBitIndex);
+        }, treeletsToBuild.size());
+        for(int count : treeletNodes)
+            *totalNodes += count;
+        //create and return SAH BVH from LBVH treelets
+        std::vector<BVHBuildNode*> finishedTreelets;
+        finishedTreelets.reserve(treeletsToBuild.size());
+        for(LBVHTreelet& treelet : treeletsToBuild)
+            finishedTreelets.push_back(treelet.buildNodes);
+        return buildUpperSAH(arena, finishedTreelets, 0, finishedTreelets.size(), totalNodes);
+    }
+
+    BVHBuildNode* BVHAccel::emitLBVH(BVHBuildNode*& buildNodes, const MortonPrimitive* mortonPrimitives, int mortonOffset,
+                                     int nPrimitives, int* totalNodes, std::vector<std::shared_ptr<Primitive>>& orderedPrimitives,
+                                     int bitIndex) const
+    {
+        Assert(nPrimitives > 0);
+        if(bitIndex == -1 || nPrimitives < maxPrimsInNode)
+        {
+            //create and return leaf node of LBVH treelet
+            //the leaf keeps the primitives at their position in Morton order
+            (*totalNodes)++;
+            BVHBuildNode* node = buildNodes++;
+            Bounds3f bounds;
+            for(int i = 0; i < nPrimitives; i++)
+            {
+                int primitiveIndex = mortonPrimitives[i].primitiveIndex;
+                orderedPrimitives[mortonOffset + i] = primitives[primitiveIndex];
+                bounds = Union(bounds, primitives[primitiveIndex]->WorldBound());
+            }
+            node->InitLeaf(mortonOffset, nPrimitives, bounds);
+            return node;
+        }
+        else
+        {
+            int mask = 1 << bitIndex;
+            //advance to next subtree level if there's no LBVH split for this bit
+            if((mortonPrimitives[0].mortonCode & mask) == (mortonPrimitives[nPrimitives - 1].mortonCode & mask))
+                return emitLBVH(buildNodes, mortonPrimitives, mortonOffset, nPrimitives, totalNodes, orderedPrimitives, bitIndex - 1);
+            //find LBVH split point for this dimension
+            int searchStart = 0, searchEnd = nPrimitives - 1;
+            while(searchStart + 1 != searchEnd)
+            {
+                Assert(searchStart != searchEnd);
+                int middle = (searchStart + searchEnd) / 2;
+                if((mortonPrimitives[searchStart].mortonCode & mask) == (mortonPrimitives[middle].mortonCode & mask))
+                    searchStart = middle;
+                else
+                {
+                    Assert((mortonPrimitives[middle].mortonCode & mask) == (mortonPrimitives[searchEnd].mortonCode & mask));
+                    searchEnd = middle;
+                }
+            }
+            int splitOffset = searchEnd;
+            Assert(splitOffset <= nPrimitives - 1);
+            Assert((mortonPrimitives[splitOffset - 1].mortonCode & mask) != (mortonPrimitives[splitOffset].mortonCode & mask));
+            //create and return interior LBVH node
+            (*totalNodes)++;
+            BVHBuildNode* node = buildNodes++;
+            BVHBuildNode* lbvh[2] = {
+                emitLBVH(buildNodes, mortonPrimitives, mortonOffset, splitOffset, totalNodes, orderedPrimitives, bitIndex - 1),
+                emitLBVH(buildNodes, &mortonPrimitives[splitOffset], mortonOffset + splitOffset, nPrimitives - splitOffset,
+                         totalNodes, orderedPrimitives, bitIndex - 1) };
+            //the bits are interleaved as zyxzyx..., so the split axis cycles with the bit index
+            int axis = bitIndex % 3;
+            node->InitInterior(axis, lbvh[0], lbvh[1]);
+            return node;
+        }
+    }
+
+    BVHBuildNode* BVHAccel::spatialSplitBuild(MemoryArena& arena, std::vector<BVHPrimitiveInfo>& references, Float rootSurfaceArea,
+                                              int depth, int* totalNodes, std::vector<std::shared_ptr<Primitive>>& orderedPrimitives)
+    {
+        Assert(!references.empty());
+        BVHBuildNode* node = arena.Alloc<BVHBuildNode>();
+        (*totalNodes)++;
+        int nReferences = references.size();
+        Bounds3f bounds, centroidBounds;
+        ComputeBounds(references, 0, nReferences, &bounds, &centroidBounds, false);
+        auto createLeaf = [&]()
+        {
+            int firstPrimOffset = orderedPrimitives.size();
+            for(const BVHPrimitiveInfo& reference : references)
+                orderedPrimitives.push_back(primitives[reference.primitiveIndex]);
+            node->InitLeaf(firstPrimOffset, nReferences, bounds);
+            return node;
+        };
+        if(nReferences == 1)
+            return createLeaf();
+        //try spatial splits only if the children of the best object split overlap more than the budget
+        SBVHSplit objectSplit = FindObjectSplit(references, bounds, centroidBounds, nBuckets);
+        SBVHSplit spatialSplit;
+        if(depth < MaxSpatialSplitDepth && (objectSplit.dim < 0 ||
+           OverlapSurfaceArea(objectSplit.leftBounds, objectSplit.rightBounds) > splitAlpha * rootSurfaceArea))
+            spatialSplit = FindSpatialSplit(references, bounds, nBuckets, primitives);
+        if(objectSplit.dim < 0 && spatialSplit.dim < 0)
+            return createLeaf();
+        Float leafCost = nReferences;
+        if(nReferences <= maxPrimsInNode && std::min(objectSplit.cost, spatialSplit.cost) >= leafCost)
+            return createLeaf();
+        std::vector<BVHPrimitiveInfo> left, right;
+        int dim;
+        if(spatialSplit.cost < objectSplit.cost)
+        {
+            dim = spatialSplit.dim;
+            Float position = spatialSplit.position;
+            Bounds3f leftBounds = spatialSplit.leftBounds, rightBounds = spatialSplit.rightBounds;
+            int leftCount = spatialSplit.leftCount, rightCount = spatialSplit.rightCount;
+            for(const BVHPrimitiveInfo& reference : references)
+            {
+                if(reference.bounds.pMax[dim] <= position)
+                    left.push_back(reference);
+                else if(reference.bounds.pMin[dim] >= position)
+                    right.push_back(reference);
+                else
+                {
+                    //unsplit the reference if moving it to a single side is cheaper than duplicating it
+                    Float splitCost = leftCount * leftBounds.SurfaceArea() + rightCount * rightBounds.SurfaceArea();
+                    Bounds3f unionLeft = Union(leftBounds, reference.bounds), unionRight = Union(rightBounds, reference.bounds);
+                    Float leftOnlyCost = leftCount * unionLeft.SurfaceArea() + (rightCount - 1) * rightBounds.SurfaceArea();
+                    Float rightOnlyCost = (leftCount - 1) * leftBounds.SurfaceArea() + rightCount * unionRight.SurfaceArea();
+                    if(leftOnlyCost < splitCost && leftOnlyCost <= rightOnlyCost)
+                    {
+                        left.push_back(reference);
+                        leftBounds = unionLeft;
+                        rightCount--;
+                        continue;
+                    }
+                    if(rightOnlyCost < splitCost)
+                    {
+                        right.push_back(reference);
+                        rightBounds = unionRight;
+                        leftCount--;
+                        continue;
+                    }
+                    //clip the primitive to both sides of the plane
+                    Bounds3f below = reference.bounds, above = reference.bounds;
+                    below.pMax[dim] = position;
+                    above.pMin[dim] = position;
+                    const std::shared_ptr<Primitive>& primitive = primitives[reference.primitiveIndex];
+                    below = primitive->ClippedWorldBound(below);
+                    above = primitive->ClippedWorldBound(above);
+                    if(!IsEmpty(below))
+                        left.emplace_back(reference.primitiveIndex, below);
+                    if(!IsEmpty(above))
+                        right.emplace_back(reference.primitiveIndex, above);
+                    if(IsEmpty(below) && IsEmpty(above))
+                        left.push_back(reference);
+                }
+            }
+        }
+        //unsplitting can leave one side empty, use the object split then
+        if(left.empty() || right.empty())
+        {
+            if(objectSplit.dim < 0)
+                return createLeaf();
+            left.clear();
+            right.clear();
+            dim = objectSplit.dim;
+            for(const BVHPrimitiveInfo& reference : references)
+            {
+                if(BucketIndex(reference.centroid, centroidBounds, dim, nBuckets) <= objectSplit.bucket)
+                    left.push_back(reference);
+                else
+                    right.push_back(reference);
+            }
+        }
+        //references of this node are not needed any more
+        std::vector<BVHPrimitiveInfo>().swap(references);
+        BVHBuildNode* leftChild = spatialSplitBuild(arena, left, rootSurfaceArea, depth + 1, totalNodes, orderedPrimitives);
+        BVHBuildNode* rightChild = spatialSplitBuild(arena, right, rootSurfaceArea, depth + 1, totalNodes, orderedPrimitives);
+        node->InitInterior(dim, leftChild, rightChild);
+        return node;
+    }
+
+    BVHBuildNode* BVHAccel::buildUpperSAH(MemoryArena& arena, std::vector<BVHBuildNode*>& treeletRoots, int start, int end,
+                                          int* totalNodes) const
+    {
+        Assert(start < end);
+        int nNodes = end - start;
+        if(nNodes == 1)
+            return treeletRoots[start];
+        (*totalNodes)++;
+        BVHBuildNode* node = arena.Alloc<BVHBuildNode>();
+        //compute bounds of all nodes under this HLBVH node
+        Bounds3f bounds;
+        for(int i = start; i < end; i++)
+            bounds = Union(bounds, treeletRoots[i]->bounds);
+        //compute bound of HLBVH node centroids, choose split dimension
+        Bounds3f centroidBounds;
+        for(int i = start; i < end; i++)
+        {
+            Point3f centroid = (treeletRoots[i]->bounds.pMin + treeletRoots[i]->bounds.pMax) * 0.5f;
+            centroidBounds = Union(centroidBounds, centroid);
+        }
+        int dim = centroidBounds.MaximumExtent();
+        //roots whose centroids coincide can't be separated by the buckets, such as the treelets of stacked geometry
+        //or overlapping out of core buckets, split them in halves so the recursion always ends
+        int middle = (start + end) / 2;
+        if(centroidBounds.pMax[dim] > centroidBounds.pMin[dim])
+        {
+            //initialize BucketInfo for HLBVH SAH partition buckets
+            BucketInfo buckets[MaxSAHBuckets];
+            auto bucketIndex = [&](const BVHBuildNode* root)
+            {
+                Point3f centroid = (root->bounds.pMin + root->bounds.pMax) * 0.5f;
+                return BucketIndex(centroid, centroidBounds, dim, nBuckets);
+            };
+            for(int i = start; i < end; i++)
+            {
+                int b = bucketIndex(treeletRoots[i]);
+                buckets[b].count++;
+                buckets[b].bounds = Union(buckets[b].bounds, treeletRoots[i]->bounds);
+            }
+            //find bucket to split at that minimizes SAH metric
+            Float minCost;
+            int minCostSplitBucket = FindSAHSplit(buckets, nBuckets, bounds, &minCost);
+            //split nodes and create interior HLBVH SAH node
+            BVHBuildNode** pMiddle = std::partition(&treeletRoots[start], &treeletRoots[end - 1] + 1,
+            [&](const BVHBuildNode* root) { return bucketIndex(root) <= minCostSplitBucket; });
+            //the outermost buckets are never empty, but keep the halves if rounding put every root on one side
+            if(pMiddle != &treeletRoots[start] && pMiddle != &treeletRoots[end - 1] + 1)
+                middle = pMiddle - &treeletRoots[0];
+        }
+        node->InitInterior(dim, buildUpperSAH(arena, treeletRoots, start, middle, totalNodes),
+                                buildUpperSAH(arena, treeletRoots, middle, end, totalNodes));
+        return node;
+    }
+
+    template<int N>
+    void BVHAccel::buildWideBVH()
+    {
+        //collapse the binary tree into wide nodes, then release the binary nodes
+        std::vector<WideBVHNode<N>> wide;
+        collapseBVH<N>(0, wide);
+        WideBVHNode<N>* wideArray = AllocAligned<WideBVHNode<N>>(wide.size());
+        std::copy(wide.begin(), wide.end(), wideArray);
+        wideNodes = wideArray;
+        nTreeNodes = wide.size();
+        FreeAligned(nodes);
+        nodes = nullptr;
+    }
+
+    template<int N>
+    int BVHAccel::collapseBVH(int nodeIndex, std::vector<WideBVHNode<N>>& wide) const
+    {
+        int wideIndex = wide.size();
+        wide.emplace_back();
+        //gather up to N descendants, always opening the interior child with the largest surface area
+        int children[N];
+        int nChildren = 0;
+        if(nodes[nodeIndex].nPrimitives > 0)
+            children[nChildren++] = nodeIndex;
+        else
+        {
+            children[nChildren++] = nodeIndex + 1;
+            children[nChildren++] = nodes[nodeIndex].secondChildOffset;
+        }
+        while(nChildren < N)
+        {
+            int largest = -1;
+            for(int i = 0; i < nChildren; i++)
+            {
+                const LinearBVHNode& child = nodes[children[i]];
+                if(child.nPrimitives == 0 &&
+                   (largest < 0 || child.bounds.SurfaceArea() > nodes[children[largest]].bounds.SurfaceArea()))
+                    largest = i;
+            }
+            if(largest < 0)
+                break;
+            int opened = children[largest];
+            children[largest] = opened + 1;
+            children[nChildren++] = nodes[opened].secondChildOffset;
+        }
+        //fill in the child slots, the recursion may reallocate wide so the node is accessed by index
+        for(int i = 0; i < N; i++)
+        {
+            Bounds3f childBounds;
+            int32_t offset = -1;
+            uint16_t nPrimitives = 0;
+            if(i < nChildren)
+            {
+                const LinearBVHNode& child = nodes[children[i]];
+                childBounds = child.bounds;
+                if(child.nPrimitives > 0)
+                {
+                    offset = child.primitivesOffset;
+                    nPrimitives = child.nPrimitives;
+                }
+                else
+                    offset = collapseBVH<N>(children[i], wide);
+            }
+            WideBVHNode<N>& node = wide[wideIndex];
+            for(int axis = 0; axis < 3; axis++)
+            {
+                node.bounds[0][axis][i] = childBounds.pMin[axis];
+                node.bounds[1][axis][i] = childBounds.pMax[axis];
+            }
+            node.offset[i] = offset;
+            node.nPrimitives[i] = nPrimitives;
+        }
+        return wideIndex;
+    }
+
+    template<int N>
+    bool BVHAccel::intersectWide(const Ray& ray, SurfaceInteraction* surfaceInteraction) const
+    {
+        const WideBVHNode<N>* wide = static_cast<const WideBVHNode<N>*>(wideNodes);
+        TraversalStats stats(nodesVisited, primitivesTested);
+        bool hit = false;
+        Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        uint32_t dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+        //every visited level pushes at most N - 1 nodes, with their entry distance to cull them after closer hits
+        struct StackEntry
+        {
+            int node;
+            Float tNear;
+        };
+        StackEntry nodesToVisit[64 * (N - 1) + 1];
+        int toVisitOffset = 0;
+        nodesToVisit[toVisitOffset++] = { 0, 0 };
+        while(toVisitOffset > 0)
+        {
+            StackEntry entry = nodesToVisit[--toVisitOffset];
+            if(entry.tNear > ray.tMax)
+                continue;
+            stats.nNodes++;
+            const WideBVHNode<N>& node = wide[entry.node];
+            alignas(32) Float tNear[N];
+            int hitMask = IntersectChildren<N>(node, ray.o, invDir, dirIsNeg, ray.tMax, tNear);
+            //intersect leaf children first so that the interior ones can be culled by the shortened ray
+            int interior[N];
+            int nInterior = 0;
+            for(int i = 0; i < N; i++)
+            {
+                if(!(hitMask & (1 << i)))
+                    continue;
+                if(node.nPrimitives[i] > 0)
+                {
+                    stats.nPrimitives += node.nPrimitives[i];
+                    if(intersectLeaf(node.offset[i], node.nPrimitives[i], ray, surfaceInteraction))
+                        hit = true;
+                }
+                else
+                    interior[nInterior++] = i;
+            }
+            //push interior children from far to near, so the nearest is visited next
+            for(int i = 1; i < nInterior; i++)
+            {
+                int child = interior[i], j = i;
+                for(; j > 0 && tNear[interior[j - 1]] < tNear[child]; j--)
+                    interior[j] = interior[j - 1];
+                interior[j] = child;
+            }
+            for(int i = 0; i < nInterior; i++)
+            {
+                if(tNear[interior[i]] <= ray.tMax)
+                    nodesToVisit[toVisitOffset++] = { node.offset[interior[i]], tNear[interior[i]] };
+            }
+        }
+        return hit;
+    }
+
+    template<int N>
+    bool BVHAccel::intersectWideP(const Ray& ray, const Primitive** occluder) const
+    {
+        const WideBVHNode<N>* wide = static_cast<const WideBVHNode<N>*>(wideNodes);
+        TraversalStats stats(shadowNodesVisited, shadowPrimitivesTested);
+        Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        uint32_t dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+        int nodesToVisit[64 * (N - 1) + 1];
+        int toVisitOffset = 0;
+        nodesToVisit[toVisitOffset++] = 0;
+        while(toVisitOffset > 0)
+        {
+            const WideBVHNode<N>& node = wide[nodesToVisit[--toVisitOffset]];
+            stats.nNodes++;
+            alignas(32) Float tNear[N];
+            int hitMask = IntersectChildren<N>(node, ray.o, invDir, dirIsNeg, ray.tMax, tNear);
+            //return as soon as any hit is found
+            int interior[N];
+            int nInterior = 0;
+            for(int i = 0; i < N; i++)
+            {
+                if(!(hitMask & (1 << i)))
+                    continue;
+                if(node.nPrimitives[i] > 0)
+                {
+                    stats.nPrimitives += node.nPrimitives[i];
+                    if(intersectLeafP(node.offset[i], node.nPrimitives[i], ray, occluder))
+                        return true;
+                }
+                else
+                    interior[nInterior++] = i;
+            }
+            //wide nodes keep no split axis, so children are ordered by entry distance, the nearest is visited next
+            for(int i = 1; i < nInterior; i++)
+            {
+                int child = interior[i], j = i;
+                for(; j > 0 && tNear[interior[j - 1]] < tNear[child]; j--)
+                    interior[j] = interior[j - 1];
+                interior[j] = child;
+            }
+            for(int i = 0; i < nInterior; i++)
+                nodesToVisit[toVisitOffset++] = node.offset[interior[i]];
+        }
+        return false;
+    }
+
+    void BVHAccel::buildQuantizedBVH()
+    {
+        //a leaf node root has no children to quantize, and leaves can only count 255 primitives
+        if(nodes[0].nPrimitives > 0)
+            return;
+        int nInterior = 0, nNodes = 1;
+        for(int i = 0; i < nNodes; i++)
+        {
+            if(nodes[i].nPrimitives > 255)
+            {
+                Warn("BVH leaf with {} primitives can't be quantized. Using full precision nodes.", nodes[i].nPrimitives);
+                return;
+            }
+            if(nodes[i].nPrimitives == 0)
+            {
+                nInterior++;
+                nNodes = std::max(nNodes, nodes[i].secondChildOffset + 1);
+            }
+        }
+        //leaves are stored in the slots of their parents, so only interior nodes remain
+        quantizedNodes = AllocAligned<QuantizedBVHNode>(nInterior);
+        int offset = 0;
+        quantizeBVH(0, bounds, &offset);
+        Assert(offset == nInterior);
+        nTreeNodes = nInterior;
+        FreeAligned(nodes);
+        nodes = nullptr;
+    }
+
+    int BVHAccel::quantizeBVH(int nodeIndex, const Bounds3f& box, int* offset)
+    {
+        int quantizedIndex = (*offset)++;
+        QuantizedBVHNode& quantized = quantizedNodes[quantizedIndex];
+        const LinearBVHNode& node = nodes[nodeIndex];
+        memset(&quantized, 0, sizeof(QuantizedBVHNode));
+        quantized.axis = node.axis;
+        Vector3f step = QuantizationStep(box);
+        int children[2] = { nodeIndex + 1, node.secondChildOffset };
+        for(int i = 0; i < 2; i++)
+        {
+            const LinearBVHNode& child = nodes[children[i]];
+            QuantizeBounds(child.bounds, box, step, quantized.childBounds[i]);
+            if(child.nPrimitives > 0)
+            {
+                quantized.offset[i] = child.primitivesOffset;
+                quantized.nPrimitives[i] = child.nPrimitives;
+            }
+            else
+            {
+                //the children of an interior child are quantized in its decoded box, which contains its exact box
+                quantized.nPrimitives[i] = 0;
+                quantized.offset[i] = quantizeBVH(children[i], DequantizeBounds(quantized.childBounds[i], box, step), offset);
+            }
+        }
+        return quantizedIndex;
+    }
+
+    bool BVHAccel::intersectQuantized(const Ray& ray, SurfaceInteraction* surfaceInteraction) const
+    {
+        TraversalStats stats(nodesVisited, primitivesTested);
+        bool hit = false;
+        Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        uint32_t dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+        if(!bounds.IntersectP(ray, invDir, dirIsNeg))
+            return false;
+        //the decoded box of every node to visit is kept on the stack
+        struct StackEntry
+        {
+            int node;
+            Bounds3f box;
+        };
+        StackEntry nodesToVisit[64];
+        int toVisitOffset = 0;
+        nodesToVisit[toVisitOffset++] = { 0, bounds };
+        while(toVisitOffset > 0)
+        {
+            StackEntry entry = nodesToVisit[--toVisitOffset];
+            //the ray may have been shortened since the node was pushed
+            if(!entry.box.IntersectP(ray, invDir, dirIsNeg))
+                continue;
+            stats.nNodes++;
+            const QuantizedBVHNode& node = quantizedNodes[entry.node];
+            Vector3f step = QuantizationStep(entry.box);
+            //visit the near child first
+            int near = dirIsNeg[node.axis], far = 1 - near;
+            Bounds3f childBounds[2] = { DequantizeBounds(node.childBounds[0], entry.box, step),
+                                        DequantizeBounds(node.childBounds[1], entry.box, step) };
+            //intersect leaf children at once, push interior children with the far one below the near one
+            for(int i : { far, near })
+            {
+                if(node.nPrimitives[i] > 0 || !childBounds[i].IntersectP(ray, invDir, dirIsNeg))
+                    continue;
+                nodesToVisit[toVisitOffset++] = { node.offset[i], childBounds[i] };
+            }
+            for(int i : { near, far })
+            {
+                if(node.nPrimitives[i] == 0 || !childBounds[i].IntersectP(ray, invDir, dirIsNeg))
+                    continue;
+                stats.nPrimitives += node.nPrimitives[i];
+                if(intersectLeaf(node.offset[i], node.nPrimitives[i], ray, surfaceInteraction))
+                    hit = true;
+            }
+        }
+        return hit;
+    }
+
+    bool BVHAccel::intersectQuantizedP(const Ray& ray, const Primitive** occluder) const
+    {
+        TraversalStats stats(shadowNodesVisited, shadowPrimitivesTested);
+        Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        uint32_t dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+        if(!bounds.IntersectP(ray, invDir, dirIsNeg))
+            return false;
+        struct StackEntry
+        {
+            int node;
+            Bounds3f box;
+        };
+        StackEntry nodesToVisit[64];
+        int toVisitOffset = 0;
+        nodesToVisit[toVisitOffset++] = { 0, bounds };
+        while(toVisitOffset > 0)
+        {
+            StackEntry entry = nodesToVisit[--toVisitOffset];
+            stats.nNodes++;
+            const QuantizedBVHNode& node = quantizedNodes[entry.node];
+            Vector3f step = QuantizationStep(entry.box);
+            //test the leaf on the near side of the split first, and push the near interior child last to visit it next
+            int near = dirIsNeg[node.axis], far = 1 - near;
+            for(int i : { near, far })
+            {
+                Bounds3f childBounds = DequantizeBounds(node.childBounds[i], entry.box, step);
+                if(node.nPrimitives[i] == 0 || !childBounds.IntersectP(ray, invDir, dirIsNeg))
+                    continue;
+                //return as soon as any hit is found
+                stats.nPrimitives += node.nPrimitives[i];
+                if(intersectLeafP(node.offset[i], node.nPrimitives[i], ray, occluder))
+                    return true;
+            }
+            for(int i : { far, near })
+            {
+                if(node.nPrimitives[i] > 0)
+                    continue;
+                Bounds3f childBounds = DequantizeBounds(node.childBounds[i], entry.box, step);
+                if(childBounds.IntersectP(ray, invDir, dirIsNeg))
+                    nodesToVisit[toVisitOffset++] = { node.offset[i], childBounds };
+            }
+        }
+        return false;
+    }
+
+    uint64_t BVHAccel::cacheKey(const std::vector<std::shared_ptr<Primitive>>& input) const
+    {
+        //the tree depends on the bounds of the primitives and the build settings,
+        //and on the vertices of the triangles for SpatialSplit
+        int nPrimitives = input.size();
+        uint64_t key = HashBytes(&nPrimitives, sizeof(nPrimitives));
+        int splitMethodIndex = (int)splitMethod, compressed = compressNodes;
+        key = HashBytes(&maxPrimsInNode, sizeof(maxPrimsInNode), key);
+        key = HashBytes(&splitMethodIndex, sizeof(splitMethodIndex), key);
+        key = HashBytes(&nBuckets, sizeof(nBuckets), key);
+        key = HashBytes(&width, sizeof(width), key);
+        key = HashBytes(&splitAlpha, sizeof(splitAlpha), key);
+        key = HashBytes(&compressed, sizeof(compressed), key);
+        key = HashBytes(&treeletPasses, sizeof(treeletPasses), key);
+        if(splitMethod == SplitMethod::SpatialSplit)
+            key = HashTriangleVertices(input, key);
+        return HashPrimitiveBounds(input, key);
+    }
+
+    uint64_t BVHAccel::Fingerprint() const
+    {
+        uint64_t hash = HashBytes(&nTreeNodes, sizeof(nTreeNodes));
+        if(wideNodes)
+            hash = HashBytes(wideNodes, nTreeNodes * (width == 4 ? sizeof(WideBVHNode<4>) : sizeof(WideBVHNode<8>)), hash);
+        else if(quantizedNodes)
+            hash = HashBytes(quantizedNodes, nTreeNodes * sizeof(QuantizedBVHNode), hash);
+        else if(nodes)
+            hash = HashBytes(nodes, nTreeNodes * sizeof(LinearBVHNode), hash);
+        //the bounds stand for the primitives, their addresses change from run to run
+        return HashPrimitiveBounds(primitives, hash);
+    }
+
+    bool BVHAccel::loadCache(const std::string& filename, uint64_t key, const std::vector<std::shared_ptr<Primitive>>& input)
+    {
+        ProfilePhase _(Profiler::AccelConstruction);
+        std::unique_ptr<MappedFile> file(new MappedFile);
+        if(!file->Map(filename))
+            return false;
+        const uint8_t* data = (const uint8_t*)file->Data();
+        size_t size = file->Size();
+        if(size < sizeof(BVHCacheHeader))
+            return false;
+        BVHCacheHeader header;
+        memcpy(&header, data, sizeof(header));
+        uint32_t expectedFormat = width == 4 || width == 8 ? width : compressNodes ? 1 : 0;
+        size_t expectedNodeSize = header.nodeFormat == 4 ? sizeof(WideBVHNode<4>) : header.nodeFormat == 8 ? sizeof(WideBVHNode<8>) :
+                                  header.nodeFormat == 1 ? sizeof(QuantizedBVHNode) : sizeof(LinearBVHNode);
+        //compressed trees are stored with full precision nodes when they can't be quantized
+        if(memcmp(header.magic, BVHCacheMagic, sizeof(BVHCacheMagic)) != 0 || header.version != BVHCacheVersion ||
+           header.floatSize != sizeof(Float) || header.key != key || header.nPrimitives != input.size() ||
+           (header.nodeFormat != expectedFormat && !(expectedFormat == 1 && header.nodeFormat == 0)) ||
+           header.nodeSize != expectedNodeSize || header.nNodes == 0)
+        {
+            Warn("BVH cache \"{}\" doesn't match the scene. Rebuilding.", filename);
+            return false;
+        }
+        //counts too large for the file are checked first, so the offsets below can't overflow
+        if(header.nReferences > size / sizeof(uint32_t) || header.nNodes > size / header.nodeSize)
+        {
+            Warn("BVH cache \"{}\" is corrupted. Rebuilding.", filename);
+            return false;
+        }
+        size_t indicesOffset = AlignCacheOffset(sizeof(BVHCacheHeader));
+        size_t nodesOffset = AlignCacheOffset(indicesOffset + header.nReferences * sizeof(uint32_t));
+        if(size < nodesOffset + header.nNodes * header.nodeSize)
+        {
+            Warn("BVH cache \"{}\" is truncated. Rebuilding.", filename);
+            return false;
+        }
+        //restore the order of primitive references
+        const uint32_t* indices = (const uint32_t*)(data + indicesOffset);
+        std::vector<std::shared_ptr<Primitive>> orderedPrimitives(header.nReferences);
+        for(uint64_t i = 0; i < header.nReferences; i++)
+        {
+            if(indices[i] >= input.size())
+            {
+                Warn("BVH cache \"{}\" is corrupted. Rebuilding.", filename);
+                return false;
+            }
+            orderedPrimitives[i] = input[indices[i]];
+        }
+        void* fileNodes = (void*)(data + nodesOffset);
+        if(!ValidCacheNodes(fileNodes, header.nodeFormat, header.nNodes, header.nReferences))
+        {
+            Warn("BVH cache \"{}\" is corrupted. Rebuilding.", filename);
+            return false;
+        }
+        //use the nodes in place from the mapping
+        releaseNodes();
+        if(header.nodeFormat == 4 || header.nodeFormat == 8)
+            wideNodes = fileNodes;
+        else if(header.nodeFormat == 1)
+            quantizedNodes = (QuantizedBVHNode*)fileNodes;
+        else
+            nodes = (LinearBVHNode*)fileNodes;
+        cacheFile = std::move(file);
+        nTreeNodes = header.nNodes;
+        primitives.swap(orderedPrimitives);
+        bounds = Bounds3f(Point3f(header.bounds[0][0], header.bounds[0][1], header.bounds[0][2]),
+                          Point3f(header.bounds[1][0], header.bounds[1][1], header.bounds[1][2]));
+        builtSAHCost = header.builtSAHCost;
+        gatherTriangles();
+        computeMotionBounds();
+        reportStatistics();
+        return true;
+    }
+
+    void BVHAccel::writeCache(const std::string& filename, uint64_t key, const std::vector<std::shared_ptr<Primitive>>& input) const
+    {
+        if(!nodes && !wideNodes && !quantizedNodes)
+            return;
+        BVHCacheHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BVHCacheMagic, sizeof(BVHCacheMagic));
+        header.version = BVHCacheVersion;
+        header.floatSize = sizeof(Float);
+        header.key = key;
+        header.nPrimitives = input.size();
+        header.nReferences = primitives.size();
+        header.nNodes = nTreeNodes;
+        const void* treeNodes;
+        if(wideNodes)
+        {
+            header.nodeFormat = width;
+            header.nodeSize = width == 4 ? sizeof(WideBVHNode<4>) : sizeof(WideBVHNode<8>);
+            treeNodes = wideNodes;
+        }
+        else if(quantizedNodes)
+        {
+            header.nodeFormat = 1;
+            header.nodeSize = sizeof(QuantizedBVHNode);
+            treeNodes = quantizedNodes;
+        }
+        else
+        {
+            header.nodeFormat = 0;
+            header.nodeSize = sizeof(LinearBVHNode);
+            treeNodes = nodes;
+        }
+        for(int axis = 0; axis < 3; axis++)
+        {
+            header.bounds[0][axis] = bounds.pMin[axis];
+            header.bounds[1][axis] = bounds.pMax[axis];
+        }
+        header.builtSAHCost = builtSAHCost;
+        //map the ordered references back to the indices of the input primitives
+        std::unordered_map<const Primitive*, uint32_t> inputIndices;
+        inputIndices.reserve(input.size());
+        for(size_t i = 0; i < input.size(); i++)
+            inputIndices.emplace(input[i].get(), (uint32_t)i);
+        std::vector<uint32_t> indices(primitives.size());
+        for(size_t i = 0; i < primitives.size(); i++)
+            indices[i] = inputIndices[primitives[i].get()];
+        //write to a temporary file and rename it, so concurrent renders never map a partial file
+        std::string temporaryFilename = filename + "." + UniqueFileToken() + ".tmp";
+        FILE* file = fopen(temporaryFilename.c_str(), "wb");
+        if(!file)
+        {
+            Warn("Unable to write BVH cache \"{}\".", filename);
+            return;
+        }
+        const char padding[BVHCacheAlignment] = {};
+        size_t indicesOffset = AlignCacheOffset(sizeof(BVHCacheHeader));
+        size_t nodesOffset = AlignCacheOffset(indicesOffset + indices.size() * sizeof(uint32_t));
+        bool success = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                       fwrite(padding, 1, indicesOffset - sizeof(header), file) == indicesOffset - sizeof(header) &&
+                       fwrite(indices.data(), sizeof(uint32_t), indices.size(), file) == indices.size() &&
+                       fwrite(padding, 1, nodesOffset - indicesOffset - indices.size() * sizeof(uint32_t), file) ==
+                       nodesOffset - indicesOffset - indices.size() * sizeof(uint32_t) &&
+                       fwrite(treeNodes, header.nodeSize, header.nNodes, file) == header.nNodes;
+        success = fclose(file) == 0 && success;
+        if(!success || !ReplaceCacheFile(temporaryFilename, filename))
+        {
+            std::remove(temporaryFilename.c_str());
+            Warn("Unable to write BVH cache \"{}\".", filename);
+        }
+    }
+
+    //spill the primitives given by next to the buckets of the next OutOfCoreBucketBits bits of their Morton codes,
+    //next fills a chunk and returns its count or 0 at the end, the non-empty buckets are appended to buckets
+    static bool SpillPrimitives(const std::string& prefix, int mortonBits, const Bounds3f& centroidBounds,
+                                const std::function<int(SpilledPrimitive*)>& next, std::vector<SpillBucket>& buckets)
+    {
+        constexpr int nSpillBuckets = 1 << OutOfCoreBucketBits;
+        std::vector<SpillBucket> spilled(nSpillBuckets);
+        std::vector<std::vector<SpilledPrimitive>> buffers(nSpillBuckets);
+        std::vector<bool> flushed(nSpillBuckets, false);
+        bool success = true;
+        //buckets are opened only to append a full buffer, so there is never a file handle per bucket,
+        //the first flush truncates the file in case one of the same name was left behind
+        auto flush = [&](int bucket)
+        {
+            std::vector<SpilledPrimitive>& buffer = buffers[bucket];
+            FILE* file = fopen(spilled[bucket].filename.c_str(), flushed[bucket] ? "ab" : "wb");
+            flushed[bucket] = true;
+            success = file && fwrite(buffer.data(), sizeof(SpilledPrimitive), buffer.size(), file) == buffer.size() && success;
+            success = file && fclose(file) == 0 && success;
+            buffer.clear();
+        };
+        for(int bucket = 0; bucket < nSpillBuckets; bucket++)
+        {
+            spilled[bucket].filename = prefix + "_" + std::to_string(bucket);
+            spilled[bucket].mortonBits = mortonBits + OutOfCoreBucketBits;
+        }
+        constexpr int mortonScale = 1 << 10;
+        int shift = 30 - mortonBits - OutOfCoreBucketBits;
+        std::vector<SpilledPrimitive> chunk(OutOfCoreChunkSize);
+        int nChunk;
+        while(success && (nChunk = next(chunk.data())) > 0)
+        {
+            for(int i = 0; i < nChunk; i++)
+            {
+                Point3f centroid = 0.5f * chunk[i].bounds.pMin + 0.5f * chunk[i].bounds.pMax;
+                uint32_t mortonCode = EncodeMorton3(centroidBounds.Offset(centroid) * (Float)mortonScale);
+                int bucket = (mortonCode >> shift) & (nSpillBuckets - 1);
+                spilled[bucket].nPrimitives++;
+                spilled[bucket].bounds = Union(spilled[bucket].bounds, chunk[i].bounds);
+                buffers[bucket].push_back(chunk[i]);
+                if(buffers[bucket].size() == OutOfCoreChunkSize)
+                    flush(bucket);
+            }
+        }
+        for(int bucket = 0; bucket < nSpillBuckets; bucket++)
+        {
+            if(!buffers[bucket].empty())
+                flush(bucket);
+            if(spilled[bucket].nPrimitives > 0)
+                buckets.push_back(spilled[bucket]);
+        }
+        return success;
+    }
+
+    bool BVHAccel::buildOutOfCore(const std::string& filename, uint64_t key)
+    {
+        ProfilePhase _(Profiler::AccelConstruction);
+        releaseNodes();
+        releaseEditTree();
+        int nPrimitives = primitives.size();
+        //the first pass bounds the centroids for the Morton codes
+        Bounds3f centroidBounds;
+        for(const std::shared_ptr<Primitive>& primitive : primitives)
+        {
+            Bounds3f primitiveBounds = primitive->WorldBound();
+            centroidBounds = Union(centroidBounds, 0.5f * primitiveBounds.pMin + 0.5f * primitiveBounds.pMax);
+        }
+        //the second pass spills the primitives, then buckets larger than outOfCorePrimitives are spilled again
+        //by the following Morton bits until they fit or the 30 bits of the codes run out
+        std::vector<SpillBucket> toSpill, buckets;
+        std::string token = UniqueFileToken();
+        std::string prefix = filename + "." + token + ".spill";
+        int nextPrimitive = 0;
+        bool success = SpillPrimitives(prefix, 0, centroidBounds, [&](SpilledPrimitive* chunk)
+        {
+            int nChunk = std::min(OutOfCoreChunkSize, nPrimitives - nextPrimitive);
+            for(int i = 0; i < nChunk; i++, nextPrimitive++)
+                chunk[i] = { (uint32_t)nextPrimitive, primitives[nextPrimitive]->WorldBound() };
+            return nChunk;
+        }, toSpill);
+        while(success && !toSpill.empty())
+        {
+            SpillBucket bucket = toSpill.back();
+            toSpill.pop_back();
+            if(bucket.nPrimitives <= outOfCorePrimitives || bucket.mortonBits + OutOfCoreBucketBits > 30)
+            {
+                buckets.push_back(bucket);
+                continue;
+            }
+            FILE* file = fopen(bucket.filename.c_str(), "rb");
+            success = file != nullptr;
+            if(success)
+            {
+                success = SpillPrimitives(bucket.filename, bucket.mortonBits, centroidBounds, [&](SpilledPrimitive* chunk)
+                {
+                    return (int)fread(chunk, sizeof(SpilledPrimitive), OutOfCoreChunkSize, file);
+                }, toSpill);
+                fclose(file);
+            }
+            std::remove(bucket.filename.c_str());
+        }
+        auto removeSpillFiles = [&]()
+        {
+            for(const SpillBucket& bucket : toSpill)
+                std::remove(bucket.filename.c_str());
+            for(const SpillBucket& bucket : buckets)
+                std::remove(bucket.filename.c_str());
+        };
+        if(!success)
+        {
+            removeSpillFiles();
+            return false;
+        }
+        //SAH tree over the buckets, whose leaves stand for the subtrees of the buckets
+        MemoryArena arena;
+        std::vector<BVHBuildNode*> bucketRoots(buckets.size());
+        int totalNodes = 0;
+        for(size_t i = 0; i < buckets.size(); i++)
+        {
+            bucketRoots[i] = arena.Alloc<BVHBuildNode>();
+            bucketRoots[i]->InitLeaf(i, buckets[i].nPrimitives, buckets[i].bounds);
+        }
+        BVHBuildNode* root = buildUpperSAH(arena, bucketRoots, 0, bucketRoots.size(), &totalNodes);
+        //a tree with a primitive per leaf has the most nodes, the file is cut to the nodes written
+        size_t indicesOffset = AlignCacheOffset(sizeof(BVHCacheHeader));
+        size_t nodesOffset = AlignCacheOffset(indicesOffset + nPrimitives * sizeof(uint32_t));
+        std::string temporaryFilename = filename + "." + token + ".tmp";
+        MappedFile file;
+        if(!file.Create(temporaryFilename, nodesOffset + (2 * (size_t)nPrimitives - 1) * sizeof(LinearBVHNode)))
+        {
+            removeSpillFiles();
+            Warn("Unable to create BVH cache \"{}\".", filename);
+            return false;
+        }
+        uint8_t* data = (uint8_t*)file.Data();
+        uint32_t* indices = (uint32_t*)(data + indicesOffset);
+        nodes = (LinearBVHNode*)(data + nodesOffset);
+        //emit the tree depth-first, building the subtree of a bucket when its leaf is reached
+        int offset = 0, primitiveOffset = 0;
+        auto emit = [&](auto& self, BVHBuildNode* node, int depth) -> int
+        {
+            if(!success)
+                return -1;
+            if(node->nPrimitives == 0)
+            {
+                int nodeOffset = offset++;
+                nodes[nodeOffset] = LinearBVHNode();
+                nodes[nodeOffset].bounds = node->bounds;
+                nodes[nodeOffset].axis = node->splitAxis;
+                nodes[nodeOffset].nPrimitives = 0;
+                self(self, node->left, depth + 1);
+                int secondChildOffset = self(self, node->right, depth + 1);
+                nodes[nodeOffset].secondChildOffset = secondChildOffset;
+                return nodeOffset;
+            }
+            SpillBucket& bucket = buckets[node->firstPrimOffset];
+            std::vector<BVHPrimitiveInfo> primitiveInfo;
+            primitiveInfo.reserve(bucket.nPrimitives);
+            FILE* spillFile = fopen(bucket.filename.c_str(), "rb");
+            if(spillFile)
+            {
+                std::vector<SpilledPrimitive> chunk(OutOfCoreChunkSize);
+                int nChunk;
+                while((nChunk = fread(chunk.data(), sizeof(SpilledPrimitive), OutOfCoreChunkSize, spillFile)) > 0)
+                {
+                    for(int i = 0; i < nChunk; i++)
+                        primitiveInfo.push_back({ chunk[i].primitiveIndex, chunk[i].bounds });
+                }
+                fclose(spillFile);
+            }
+            std::remove(bucket.filename.c_str());
+            if((int)primitiveInfo.size() != bucket.nPrimitives)
+            {
+                success = false;
+                primitiveInfo.resize(0);
+                return -1;
+            }
+            //build the bucket in memory and flatten it in place, its leaves are offset to its primitives
+            MemoryArena bucketArena(1024 * 1024);
+            std::vector<std::unique_ptr<MemoryArena>> subtreeArenas;
+            std::vector<std::shared_ptr<Primitive>> orderedPrimitives(bucket.nPrimitives);
+            int bucketNodes = 0;
+            BVHBuildNode* bucketRoot = parallelBuild(bucketArena, subtreeArenas, primitiveInfo, &bucketNodes, orderedPrimitives);
+            for(int pass = 0; pass < treeletPasses; pass++)
+                RestructureSubtree(bucketRoot, depth, -1);
+            int firstNode = offset;
+            int rootOffset = flattenBVHTree(bucketRoot, &offset);
+            for(int i = firstNode; i < offset; i++)
+            {
+                if(nodes[i].nPrimitives > 0)
+                    nodes[i].primitivesOffset += primitiveOffset;
+            }
+            for(int i = 0; i < bucket.nPrimitives; i++)
+                indices[primitiveOffset + i] = primitiveInfo[i].primitiveIndex;
+            primitiveOffset += bucket.nPrimitives;
+            return rootOffset;
+        };
+        emit(emit, root, 0);
+        //the header is written last, so a failed build never leaves a file that matches
+        if(success)
+        {
+            nTreeNodes = offset;
+            bounds = nodes[0].bounds;
+            BVHCacheHeader header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, BVHCacheMagic, sizeof(BVHCacheMagic));
+            header.version = BVHCacheVersion;
+            header.floatSize = sizeof(Float);
+            header.key = key;
+            header.nPrimitives = nPrimitives;
+            header.nReferences = nPrimitives;
+            header.nNodes = nTreeNodes;
+            header.nodeFormat = 0;
+            header.nodeSize = sizeof(LinearBVHNode);
+            for(int axis = 0; axis < 3; axis++)
+            {
+                header.bounds[0][axis] = bounds.pMin[axis];
+                header.bounds[1][axis] = bounds.pMax[axis];
+            }
+            header.builtSAHCost = computeSAHCost();
+            memcpy(data, &header, sizeof(header));
+        }
+        nodes = nullptr;
+        nTreeNodes = 0;
+        removeSpillFiles();
+        success = file.Truncate(nodesOffset + offset * sizeof(LinearBVHNode)) && success;
+        if(!success || !ReplaceCacheFile(temporaryFilename, filename))
+        {
+            std::remove(temporaryFilename.c_str());
+            Warn("Unable to write BVH cache \"{}\".", filename);
+            return false;
+        }
+        return true;
+    }
+
+    int BVHAccel::flattenBVHTree(BVHBuildNode* node, int* offset)
+    {
+        LinearBVHNode* linearNode = &nodes[*offset];
+        //clear the unused axis of leaves and the padding, so the same tree is always stored as the same bytes
+        *linearNode = LinearBVHNode();
+        linearNode->bounds = node->bounds;
+        int myOffset = (*offset)++;
+        if(node->nPrimitives > 0)
+        {
+            //create leaf flattened BVH node
+            Assert(!node->left && !node->right);
+            Assert(node->nPrimitives < 65536);
+            linearNode->primitivesOffset = node->firstPrimOffset;
+            linearNode->nPrimitives = node->nPrimitives;
+        }
+        else
+        {
+            //create interior flattened BVH node
+            //the first child is placed right after its parent, only the second child's offset is stored
+            linearNode->axis = node->splitAxis;
+            linearNode->nPrimitives = 0;
+            flattenBVHTree(node->left, offset);
+            linearNode->secondChildOffset = flattenBVHTree(node->right, offset);
+        }
+        return myOffset;
+    }
+
+    bool BVHAccel::Intersect(const Ray& ray, SurfaceInteraction* surfaceInteraction) const
+    {
+        ProfilePhase _(Profiler::AccelIntersect);
+        if(width == 4 && wideNodes)
+            return intersectWide<4>(ray, surfaceInteraction);
+        if(width == 8 && wideNodes)
+            return intersectWide<8>(ray, surfaceInteraction);
+        if(quantizedNodes)
+            return intersectQuantized(ray, surfaceInteraction);
+        if(!nodes)
+            return false;
+        TraversalStats stats(nodesVisited, primitivesTested);
+        bool hit = false;
+        Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        uint32_t dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+        //with motion segments the nodes are tested with their bounds in the segment of the ray
+        int segment = motionBounds ? motionSegment(ray.time) : 0;
+        //follow ray through BVH nodes to find primitive intersections
+        int toVisitOffset = 0, currentNodeIndex = 0;
+        int nodesToVisit[64];
+        while(true)
+        {
+            const LinearBVHNode* node = &nodes[currentNodeIndex];
+            stats.nNodes++;
+            //check ray against BVH node
+            const Bounds3f& nodeBounds = motionBounds ? motionBounds[currentNodeIndex * motionSegments + segment] : node->bounds;
+            if(nodeBounds.IntersectP(ray, invDir, dirIsNeg))
+            {
+                if(node->nPrimitives > 0)
+                {
+                    //intersect ray with primitives in leaf BVH node
+                    stats.nPrimitives += node->nPrimitives;
+                    if(intersectLeaf(node->primitivesOffset, node->nPrimitives, ray, surfaceInteraction))
+                        hit = true;
+                    if(toVisitOffset == 0)
+                        break;
+                    currentNodeIndex = nodesToVisit[--toVisitOffset];
+                }
+                else
+                {
+                    //put far BVH node on nodesToVisit stack, advance to near node
+                    if(dirIsNeg[node->axis])
+                    {
+                        nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                        currentNodeIndex = node->secondChildOffset;
+                    }
+                    else
+                    {
+                        nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+                        currentNodeIndex = currentNodeIndex + 1;
+                    }
+                }
+            }
+            else
+            {
+                if(toVisitOffset == 0)
+                    break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            }
+        }
+        return hit;
+    }
+
+    bool BVHAccel::IntersectP(const Ray& ray) const
+    {
+        const Primitive* occluder;
+        return IntersectOccluder(ray, &occluder);
+    }
+
+    bool BVHAccel::IntersectOccluder(const Ray& ray, const Primitive** occluder) const
+    {
+        ProfilePhase _(Profiler::AccelIntersectP);
+        if(width == 4 && wideNodes)
+            return intersectWideP<4>(ray, occluder);
+        if(width == 8 && wideNodes)
+            return intersectWideP<8>(ray, occluder);
+        if(quantizedNodes)
+            return intersectQuantizedP(ray, occluder);
+        if(!nodes)
+            return false;
+        TraversalStats stats(shadowNodesVisited, shadowPrimitivesTested);
+        Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        uint32_t dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+        int segment = motionBounds ? motionSegment(ray.time) : 0;
+        int toVisitOffset = 0, currentNodeIndex = 0;
+        int nodesToVisit[64];
+        while(true)
+        {
+            const LinearBVHNode* node = &nodes[currentNodeIndex];
+            stats.nNodes++;
+            const Bounds3f& nodeBounds = motionBounds ? motionBounds[currentNodeIndex * motionSegments + segment] : node->bounds;
+            if(nodeBounds.IntersectP(ray, invDir, dirIsNeg))
+            {
+                //process BVH node for traversal, return as soon as any hit is found
+                if(node->nPrimitives > 0)
+                {
+                    stats.nPrimitives += node->nPrimitives;
+                    if(intersectLeafP(node->primitivesOffset, node->nPrimitives, ray, occluder))
+                        return true;
+                    if(toVisitOffset == 0)
+                        break;
+                    currentNodeIndex = nodesToVisit[--toVisitOffset];
+                }
+                else
+                {
+                    if(dirIsNeg[node->axis])
+                    {
+                        nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                        currentNodeIndex = node->secondChildOffset;
+                    }
+                    else
+                    {
+                        nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+                        currentNodeIndex = currentNodeIndex + 1;
+                    }
+                }
+            }
+            else
+            {
+                if(toVisitOffset == 0)
+                    break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            }
+        }
+        return false;
+    }
+
+    void BVHAccel::IntersectPacket(const Ray* const rays[], int nRays, SurfaceInteraction* surfaceInteractions, bool* hits) const
+    {
+        Assert(nRays > 0 && nRays <= MaxRayPacketSize);
+        //wide and quantized trees are traced ray by ray
+        if(!nodes)
+        {
+            Aggregate::IntersectPacket(rays, nRays, surfaceInteractions, hits);
+            return;
+        }
+        ProfilePhase _(Profiler::AccelIntersect);
+        RayPacketSoA packet;
+        InitRayPacket(&packet, rays, nRays);
+        for(int i = 0; i < nRays; i++)
+            hits[i] = false;
+        //the packet is coherent, so the direction of the first ray decides the order of children for all rays
+        uint32_t dirIsNeg[3] = { packet.invDir[0][0] < 0, packet.invDir[1][0] < 0, packet.invDir[2][0] < 0 };
+        //every stack entry keeps the rays that hit its parent
+        struct StackEntry
+        {
+            int node;
+            int activeMask;
+        };
+        StackEntry nodesToVisit[64];
+        int toVisitOffset = 0, currentNodeIndex = 0;
+        int activeMask = (1 << nRays) - 1;
+        while(true)
+        {
+            const LinearBVHNode* node = &nodes[currentNodeIndex];
+            //check all active rays against BVH node at once
+            int hitMask = IntersectPacketBounds(node->bounds, packet, nRays, activeMask);
+            if(hitMask && node->nPrimitives == 0)
+            {
+                //put far BVH node on nodesToVisit stack, advance to near node with the rays that hit
+                if(dirIsNeg[node->axis])
+                {
+                    nodesToVisit[toVisitOffset++] = { currentNodeIndex + 1, hitMask };
+                    currentNodeIndex = node->secondChildOffset;
+                }
+                else
+                {
+                    nodesToVisit[toVisitOffset++] = { node->secondChildOffset, hitMask };
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+                activeMask = hitMask;
+                continue;
+            }
+            //intersect rays that hit the leaf with its primitives
+            for(int i = 0; hitMask; i++, hitMask >>= 1)
+            {
+                if(!(hitMask & 1))
+                    continue;
+                for(int j = 0; j < node->nPrimitives; j++)
+                {
+                    if(primitives[node->primitivesOffset + j]->Intersect(*rays[i], &surfaceInteractions[i]))
+                        hits[i] = true;
+                }
+                packet.tMax[i] = rays[i]->tMax;
+            }
+            if(toVisitOffset == 0)
+                break;
+            --toVisitOffset;
+            currentNodeIndex = nodesToVisit[toVisitOffset].node;
+            activeMask = nodesToVisit[toVisitOffset].activeMask;
+        }
+    }
+
+    void BVHAccel::IntersectPacketP(const Ray* const rays[], int nRays, bool* occluded) const
+    {
+        Assert(nRays > 0 && nRays <= MaxRayPacketSize);
+        if(!nodes)
+        {
+            Aggregate::IntersectPacketP(rays, nRays, occluded);
+            return;
+        }
+        ProfilePhase _(Profiler::AccelIntersectP);
+        RayPacketSoA packet;
+        InitRayPacket(&packet, rays, nRays);
+        for(int i = 0; i < nRays; i++)
+            occluded[i] = false;
+        uint32_t dirIsNeg[3] = { packet.invDir[0][0] < 0, packet.invDir[1][0] < 0, packet.invDir[2][0] < 0 };
+        struct StackEntry
+        {
+            int node;
+            int activeMask;
+        };
+        StackEntry nodesToVisit[64];
+        int toVisitOffset = 0, currentNodeIndex = 0;
+        int allMask = (1 << nRays) - 1;
+        int activeMask = allMask, occludedMask = 0;
+        while(true)
+        {
+            const LinearBVHNode* node = &nodes[currentNodeIndex];
+            //occluded rays are dropped from the packet
+            int hitMask = IntersectPacketBounds(node->bounds, packet, nRays, activeMask & ~occludedMask);
+            if(hitMask && node->nPrimitives == 0)
+            {
+                if(dirIsNeg[node->axis])
+                {
+                    nodesToVisit[toVisitOffset++] = { currentNodeIndex + 1, hitMask };
+                    currentNodeIndex = node->secondChildOffset;
+                }
+                else
+                {
+                    nodesToVisit[toVisitOffset++] = { node->secondChildOffset, hitMask };
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+                activeMask = hitMask;
+                continue;
+            }
+            for(int i = 0; hitMask; i++, hitMask >>= 1)
+            {
+                if(!(hitMask & 1))
+                    continue;
+                for(int j = 0; j < node->nPrimitives; j++)
+                {
+                    if(primitives[node->primitivesOffset + j]->IntersectP(*rays[i]))
+                    {
+                        occluded[i] = true;
+                        occludedMask |= 1 << i;
+                        break;
+                    }
+                }
+            }
+            //return as soon as every ray is occluded
+            if(occludedMask == allMask || toVisitOffset == 0)
+                break;
+            --toVisitOffset;
+            currentNodeIndex = nodesToVisit[toVisitOffset].node;
+            activeMask = nodesToVisit[toVisitOffset].activeMask;
+        }
+    }
+
+    std::shared_ptr<BVHAccel> CreateBVHAccelerator(std::vector<std::shared_ptr<Primitive>>& primitives, const ParamSet& params,
+                                                   Float motionStartTime, Float motionEndTime)
+    {
+        BVHAccel::Options options;
+        std::string splitMethodName = params.FindOneString("splitmethod", "sah");
+        if(splitMethodName == "sah")
+            options.splitMethod = BVHAccel::SplitMethod::SAH;
+        else if(splitMethodName == "hlbvh")
+            options.splitMethod = BVHAccel::SplitMethod::HLBVH;
+        else if(splitMethodName == "middle")
+            options.splitMethod = BVHAccel::SplitMethod::Middle;
+        else if(splitMethodName == "equal")
+            options.splitMethod = BVHAccel::SplitMethod::EqualCounts;
+        else if(splitMethodName == "sbvh")
+            options.splitMethod = BVHAccel::SplitMethod::SpatialSplit;
+        else
+        {
+            Warn("BVH split method \"{}\" unknown. Using \"sah\".", splitMethodName);
+            options.splitMethod = BVHAccel::SplitMethod::SAH;
+        }
+        options.maxPrimsInNode = params.FindOneInt("maxnodeprims", 4);
+        options.nBuckets = params.FindOneInt("buckets", 12);
+        options.width = params.FindOneInt("width", 2);
+        if(options.width != 2 && options.width != 4 && options.width != 8)
+        {
+            Warn("BVH width {} unsupported, should be 2, 4 or 8. Using 2.", options.width);
+            options.width = 2;
+        }
+        options.splitAlpha = params.FindOneFloat("splitalpha", 1e-5f);
+        options.rebuildThreshold = params.FindOneFloat("refitthreshold", 1.5f);
+        options.compressNodes = params.FindOneBool("compressed", false);
+        if(options.compressNodes && options.width != 2)
+            Warn("Compressed BVH nodes are only supported with width 2. Using full precision nodes.");
+        options.cacheDirectory = params.FindOneFilename("cachedir", "");
+        options.treeletPasses = params.FindOneInt("treeletpasses", 0);
+        //BVHAccel falls back to binary full precision nodes for motion segments
+        options.motionSegments = params.FindOneInt("motionsegments", 1);
+        options.motionStartTime = motionStartTime;
+        options.motionEndTime = motionEndTime;
+        options.outOfCorePrimitives = params.FindOneInt("outofcoreprims", 0);
+        if(options.outOfCorePrimitives > 0 && options.cacheDirectory.empty())
+        {
+            Warn("Out of core BVH build needs \"cachedir\" for its files. Building in memory.");
+            options.outOfCorePrimitives = 0;
+        }
+        if(options.outOfCorePrimitives > 0 && (options.width != 2 || options.compressNodes))
+        {
+            Warn("Out of core BVH build writes binary full precision nodes. Using width 2 without compression.");
+            options.width = 2;
+            options.compressNodes = false;
+        }
+        return std::make_shared<BVHAccel>(primitives, options);
     }
-}
\ No newline at end of file
+}
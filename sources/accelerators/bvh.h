@@ -1,9 +1,23 @@
 #pragma once
 #include"core/pbrt.h"
+#include"core/primitive/primitive.h"
+#include<unordered_map>
 
 namespace pbrt
 {
-    class BVHAccel
+    struct BVHBuildNode;
+    struct BVHBuildTask;
+    struct BVHPrimitiveInfo;
+    struct LinearBVHNode;
+    struct MortonPrimitive;
+    struct QuantizedBVHNode;
+    struct LeafTriangle;
+    struct BVHEditNode;
+    class MappedFile;
+    template<int N>
+    struct WideBVHNode;
+
+    class BVHAccel : public Aggregate
     {
     public:
         //the algorithms that can be specify to create BVH tree
@@ -12,16 +26,220 @@ namespace pbrt
             SAH,
             HLBVH,
             Middle,
-            EqualCounts
+            EqualCounts,
+            SpatialSplit
+        };
+
+        //the settings of a build, CreateBVHAccelerator fills them from the parameters of the accelerator
+        struct Options
+        {
+            //primitives in a leaf, at most 255
+            int maxPrimsInNode = 1;
+            SplitMethod splitMethod = SplitMethod::SAH;
+            //buckets that primitive centroids are binned into for SAH splits
+            int nBuckets = 12;
+            //children of a node, 4 or 8 collapse the binary tree into a wide tree
+            int width = 2;
+            //SpatialSplit only tries spatial splits where object split children overlap by more than this times the root area
+            Float splitAlpha = 1e-5f;
+            //Refit rebuilds once the SAH cost exceeds this times the cost right after the build
+            Float rebuildThreshold = 1.5f;
+            //store binary trees as QuantizedBVHNode with 8-bit child bounds
+            bool compressNodes = false;
+            //load the tree from a cache file here keyed by the primitives and settings, or build and write it
+            std::string cacheDirectory;
+            //passes that reorganize treelets of 7 subtrees into their SAH-optimal topologies
+            int treeletPasses = 0;
+            //time segments of [motionStartTime, motionEndTime] with their own node bounds, forces binary full precision nodes
+            int motionSegments = 1;
+            Float motionStartTime = 0, motionEndTime = 1;
+            //build larger inputs out of core through spill files in cacheDirectory, about this many primitives at once
+            int outOfCorePrimitives = 0;
         };
 
-        BVHAccel(std::vector<std::shared_ptr<Primitive>>& primitives, int maxPrimsInNode, SplitMethod splitMethod);
+        //every build is deterministic, the parallel steps work on chunks of fixed size and merge them in order,
+        //so the nodes and the order of the primitives never depend on the count of threads or the scheduling
+        BVHAccel(std::vector<std::shared_ptr<Primitive>>& primitives);
+        BVHAccel(std::vector<std::shared_ptr<Primitive>>& primitives, const Options& options);
+        ~BVHAccel();
+        Bounds3f WorldBound() const override;
+        Bounds3f MotionBound(Float time0, Float time1) const override;
+        bool Intersect(const Ray& ray, SurfaceInteraction* surfaceInteraction) const override;
+        bool IntersectP(const Ray& ray) const override;
+        bool IntersectOccluder(const Ray& ray, const Primitive** occluder) const override;
+        //trace the packet through the binary tree, testing each node against all active rays at once
+        void IntersectPacket(const Ray* const rays[], int nRays, SurfaceInteraction* surfaceInteractions, bool* hits) const override;
+        void IntersectPacketP(const Ray* const rays[], int nRays, bool* occluded) const override;
+        //recompute the bounds of all nodes bottom-up after the primitives moved, keeping the topology,
+        //return true if the SAH cost degraded past the threshold and the tree was rebuilt instead
+        //not thread safe with intersection queries
+        bool Refit();
+        //insert primitives without a rebuild, each one is paired with the node that increases the SAH cost the least
+        //and the nodes above it are rotated to keep the quality, then the node arrays are regenerated from the edited tree
+        //not thread safe with intersection queries
+        void Insert(const std::vector<std::shared_ptr<Primitive>>& added);
+        //remove primitives without a rebuild, return the count of them found in the tree
+        //not thread safe with intersection queries
+        int Remove(const std::vector<std::shared_ptr<Primitive>>& removed);
+        //hash of the node array in use and the bounds of the ordered primitives,
+        //equal for the builds of the same primitives and settings on any count of threads or machines of the same Float
+        uint64_t Fingerprint() const;
     private:
+        //build the tree over primitives, replacing the current one
+        void build();
+        //collapse or quantize the flattened binary tree in nodes as configured and prepare it for traversal
+        void finishBuild();
+        //create the editable tree from the node arrays in use on the first edit
+        void beginEdit();
+        //drop the editable tree, the node arrays are rebuilt or refitted without it
+        void releaseEditTree();
+        //take a node from the free list of editNodes or append one
+        int allocateEditNode();
+        //create a leaf of the editable tree for primitive, not linked into the tree yet
+        int createEditLeaf(const std::shared_ptr<Primitive>& primitive);
+        //place the leaf editNodes[leaf] next to the node with the lowest SAH cost increase
+        void insertEditLeaf(int leaf);
+        //unlink the leaf editNodes[leaf] and free it and its parent
+        void removeEditLeaf(int leaf);
+        //refit and rotate the nodes from editNodes[node] up to the root
+        void refitEditPath(int node);
+        //swap a child of editNodes[node] with a grandchild if it reduces the surface area of the other child
+        void rotateEditNode(int node);
+        //convert the subtree of editNodes[node] to build nodes, appending the primitives of its leaves to orderedPrimitives
+        BVHBuildNode* emitEditTree(MemoryArena& arena, int node, int depth, int* totalNodes, int* maxDepth,
+                                   std::vector<std::shared_ptr<Primitive>>& orderedPrimitives) const;
+        //regenerate the node arrays from the editable tree
+        void flattenEditTree();
+        //free the node arrays or unmap the cache file they were loaded from
+        void releaseNodes();
+        //hash of the bounds of the input primitives and the build settings, and the triangle vertices for SpatialSplit
+        uint64_t cacheKey(const std::vector<std::shared_ptr<Primitive>>& input) const;
+        //map the cache file and use its nodes in place, return false if it is missing or doesn't match key
+        bool loadCache(const std::string& filename, uint64_t key, const std::vector<std::shared_ptr<Primitive>>& input);
+        void writeCache(const std::string& filename, uint64_t key, const std::vector<std::shared_ptr<Primitive>>& input) const;
+        //write the cache file of primitives with an out of core build, the bounds of the primitives are spilled to files
+        //by their Morton codes until each file fits in memory, then the file subtrees are built one by one
+        //below an SAH tree over the files, return false if the files can't be written
+        bool buildOutOfCore(const std::string& filename, uint64_t key);
+        //build BVH tree of primitiveInfo in range [start, end)
+        BVHBuildNode* recursiveBuild(MemoryArena& arena, std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+                                     int* totalNodes, std::vector<std::shared_ptr<Primitive>>& orderedPrimitives);
+        //build the upper levels serially with parallel binning and partition,
+        //then build the subtrees below them as parallel tasks
+        BVHBuildNode* parallelBuild(MemoryArena& arena, std::vector<std::unique_ptr<MemoryArena>>& subtreeArenas,
+                                    std::vector<BVHPrimitiveInfo>& primitiveInfo, int* totalNodes,
+                                    std::vector<std::shared_ptr<Primitive>>& orderedPrimitives);
+        //split nodes larger than the parallel threshold, and record the remaining subtrees in tasks
+        BVHBuildNode* buildUpperLevels(MemoryArena& arena, std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+                                       int* totalNodes, std::vector<std::shared_ptr<Primitive>>& orderedPrimitives,
+                                       std::vector<BVHBuildTask>& tasks);
+        //partition primitiveInfo[start, end) along dim with splitMethod, return the split position or -1 for a leaf
+        int splitPrimitives(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, const Bounds3f& bounds,
+                            const Bounds3f& centroidBounds, int dim, bool parallel) const;
+        //build LBVH treelets from primitives sorted by Morton codes, then build the upper levels with SAH
+        BVHBuildNode* HLBVHBuild(MemoryArena& arena, const std::vector<BVHPrimitiveInfo>& primitiveInfo, int* totalNodes,
+                                 std::vector<std::shared_ptr<Primitive>>& orderedPrimitives);
+        //split mortonPrimitives at the highest differing bit from bitIndex, buildNodes is advanced by the nodes used
+        BVHBuildNode* emitLBVH(BVHBuildNode*& buildNodes, const MortonPrimitive* mortonPrimitives, int mortonOffset,
+                               int nPrimitives, int* totalNodes, std::vector<std::shared_ptr<Primitive>>& orderedPrimitives,
+                               int bitIndex) const;
+        //build SBVH over references, which may be parts of primitives clipped by spatial splits,
+        //leaves append their primitives to orderedPrimitives so a primitive can be referenced by several leaves
+        BVHBuildNode* spatialSplitBuild(MemoryArena& arena, std::vector<BVHPrimitiveInfo>& references, Float rootSurfaceArea,
+                                        int depth, int* totalNodes, std::vector<std::shared_ptr<Primitive>>& orderedPrimitives);
+        //build SAH tree over the treelet roots in range [start, end)
+        BVHBuildNode* buildUpperSAH(MemoryArena& arena, std::vector<BVHBuildNode*>& treeletRoots, int start, int end,
+                                    int* totalNodes) const;
+        //quantize the flattened binary tree into quantizedNodes, and release the binary nodes
+        void buildQuantizedBVH();
+        //quantize the children of nodes[nodeIndex] in box, the decoded box of the node, return the index of its node
+        int quantizeBVH(int nodeIndex, const Bounds3f& box, int* offset);
+        bool intersectQuantized(const Ray& ray, SurfaceInteraction* surfaceInteraction) const;
+        bool intersectQuantizedP(const Ray& ray, const Primitive** occluder) const;
+        //gather the interior nodes at RefitTaskDepth, whose subtrees are refitted in parallel
+        void collectRefitTasks(int nodeIndex, int depth, std::vector<int>& tasks) const;
+        //refit the subtree of nodes[nodeIndex] and return its bounds, interior nodes at stopDepth are taken as refitted
+        Bounds3f refitBVH(int nodeIndex, int depth, int stopDepth);
+        template<int N>
+        void collectWideRefitTasks(int wideIndex, int depth, std::vector<int>& tasks) const;
+        template<int N>
+        Bounds3f refitWide(int wideIndex, int depth, int stopDepth);
+        //SAH cost of the tree relative to the surface area of the root
+        Float computeSAHCost() const;
+        //report the node and leaf counts, memory, leaf sizes, depth and SAH cost of the tree to the statistics
+        void reportStatistics();
+        //store the build tree in nodes with depth-first order, return the offset of the node
+        int flattenBVHTree(BVHBuildNode* node, int* offset);
+        //collapse the flattened binary tree into nodes with N children, and release the binary nodes
+        template<int N>
+        void buildWideBVH();
+        //collapse the subtree rooted at nodes[nodeIndex] into wide, return the index of its wide node
+        template<int N>
+        int collapseBVH(int nodeIndex, std::vector<WideBVHNode<N>>& wide) const;
+        template<int N>
+        bool intersectWide(const Ray& ray, SurfaceInteraction* surfaceInteraction) const;
+        template<int N>
+        bool intersectWideP(const Ray& ray, const Primitive** occluder) const;
+        //copy the vertices of triangle primitives into leafTriangles, in the order of primitives
+        void gatherTriangles();
+        //compute motionBounds of the binary nodes bottom-up
+        void computeMotionBounds();
+        //index of the time segment of time, times out of the motion interval fall in the first or last one
+        int motionSegment(Float time) const
+        {
+            int segment = (time - motionStartTime) / (motionEndTime - motionStartTime) * motionSegments;
+            return Clamp(segment, 0, motionSegments - 1);
+        }
+        //intersect the primitives [offset, offset + nPrimitives) of a leaf, triangles are tested back to back inline
+        //and only the closest one is asked for its interaction
+        bool intersectLeaf(int offset, int nPrimitives, const Ray& ray, SurfaceInteraction* surfaceInteraction) const;
+        bool intersectLeafP(int offset, int nPrimitives, const Ray& ray, const Primitive** occluder) const;
+
         const int maxPrimsInNode;
         const SplitMethod splitMethod;
+        const int nBuckets;
+        const int width;
+        const Float splitAlpha;
+        const Float rebuildThreshold;
+        const bool compressNodes;
+        const int treeletPasses;
+        const int motionSegments;
+        const Float motionStartTime, motionEndTime;
+        const int outOfCorePrimitives;
         std::vector<std::shared_ptr<Primitive>> primitives;
-    }
-    
-
+        //linear BVH tree, the first child of an interior node is just after it
+        LinearBVHNode* nodes = nullptr;
+        //WideBVHNode<width> array, replace nodes when width is 4 or 8
+        void* wideNodes = nullptr;
+        //replace nodes when compressNodes is set, leaves live in the child slots of their parents
+        QuantizedBVHNode* quantizedNodes = nullptr;
+        //parallel to primitives, nullptr if there is no triangle
+        LeafTriangle* leafTriangles = nullptr;
+        //motionSegments bounds of every binary node, nullptr if motion segments are off
+        Bounds3f* motionBounds = nullptr;
+        //count of nodes in the node array in use
+        int nTreeNodes = 0;
+        //the mapping of the cache file the nodes were loaded from
+        std::unique_ptr<MappedFile> cacheFile;
+        Bounds3f bounds;
+        //SAH cost of the tree when it was built, the reference of the refit quality heuristic
+        Float builtSAHCost = 0;
+        //the counters last added by reportStatistics(), and the StatsClearCount() at that time
+        struct
+        {
+            int64_t interiorNodes = 0, leafNodes = 0, bytes = 0;
+        } reported;
+        int reportedClearCount = -1;
+        //editable binary tree with a primitive per leaf, created on the first Insert or Remove
+        std::vector<BVHEditNode> editNodes;
+        int editRoot = -1;
+        //head of the free list of editNodes linked through the first child
+        int editFreeList = -1;
+        //the leaf of every primitive in the editable tree
+        std::unordered_map<const Primitive*, int> editLeaves;
+    };
 
+    //motionStartTime and motionEndTime are the times of the animated transforms of the scene
+    std::shared_ptr<BVHAccel> CreateBVHAccelerator(std::vector<std::shared_ptr<Primitive>>& primitives, const ParamSet& params,
+                                                   Float motionStartTime = 0, Float motionEndTime = 1);
 }
@@ -0,0 +1,82 @@
+#include"bvh.h"
+#include"core/parallel/parallel.h"
+#include"core/interaction/interaction.h"
+#include<cstdio>
+#include<random>
+
+using namespace pbrt;
+
+//BVH builds must give the same tree on any count of threads,
+//every configuration is built with 1, 2, 8 and 64 threads and the fingerprints are compared
+
+//a box that is never hit, the builds only look at the bounds of the primitives
+class BoxPrimitive : public Primitive
+{
+public:
+    BoxPrimitive(const Bounds3f& bounds) : bounds(bounds) { }
+    Bounds3f WorldBound() const override { return bounds; }
+    bool Intersect(const Ray& ray, SurfaceInteraction* surfaceInteraction) const override { return false; }
+    bool IntersectP(const Ray& ray) const override { return false; }
+    const AreaLight* GetAreaLight() const override { return nullptr; }
+    const Material* GetMaterial() const override { return nullptr; }
+private:
+    Bounds3f bounds;
+};
+
+int main()
+{
+    //boxes of random sizes, every 50th one is large so that spatial splits are taken
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<Float> uniform(0, 1);
+    std::vector<std::shared_ptr<Primitive>> primitives;
+    for(int i = 0; i < 50000; i++)
+    {
+        Point3f p(uniform(rng) * 100, uniform(rng) * 100, uniform(rng) * 100);
+        Float size = uniform(rng) * (i % 50 == 0 ? 20.f : 1.5f);
+        primitives.push_back(std::make_shared<BoxPrimitive>(Bounds3f(p, p + Vector3f(size, size * uniform(rng), size))));
+    }
+    //every split method with binary, wide and compressed nodes, with and without treelet passes
+    std::vector<BVHAccel::Options> configurations;
+    for(BVHAccel::SplitMethod splitMethod : { BVHAccel::SplitMethod::SAH, BVHAccel::SplitMethod::HLBVH, BVHAccel::SplitMethod::Middle,
+                                              BVHAccel::SplitMethod::EqualCounts, BVHAccel::SplitMethod::SpatialSplit })
+    {
+        for(int nodes = 0; nodes < 4; nodes++)
+        {
+            for(int treeletPasses : { 0, 2 })
+            {
+                BVHAccel::Options options;
+                options.maxPrimsInNode = 4;
+                options.splitMethod = splitMethod;
+                options.width = nodes == 1 ? 4 : nodes == 2 ? 8 : 2;
+                options.compressNodes = nodes == 3;
+                options.treeletPasses = treeletPasses;
+                configurations.push_back(options);
+            }
+        }
+    }
+    std::vector<uint64_t> reference(configurations.size());
+    int nFailed = 0;
+    for(int nThreads : { 1, 2, 8, 64 })
+    {
+        PbrtOptions.nThreads = nThreads;
+        ParallelInit();
+        for(size_t i = 0; i < configurations.size(); i++)
+        {
+            const BVHAccel::Options& options = configurations[i];
+            BVHAccel bvh(primitives, options);
+            uint64_t fingerprint = bvh.Fingerprint();
+            if(nThreads == 1)
+                reference[i] = fingerprint;
+            else if(fingerprint != reference[i])
+            {
+                printf("split method %d, width %d, compressed %d, treelet passes %d: %d threads built %016llx, 1 thread %016llx\n",
+                       (int)options.splitMethod, options.width, (int)options.compressNodes, options.treeletPasses, nThreads,
+                       (unsigned long long)fingerprint, (unsigned long long)reference[i]);
+                nFailed++;
+            }
+        }
+        ParallelCleanup();
+    }
+    printf("%d of %d builds differ from the build on 1 thread\n", nFailed, (int)configurations.size() * 3);
+    return nFailed == 0 ? 0 : 1;
+}
@@ -0,0 +1,327 @@
+#include"grid.h"
+#include"core/parallel/parallel.h"
+#include"core/parameter/parameter.h"
+#include"core/interaction/interaction.h"
+#include"core/statistics/stats.h"
+#include<atomic>
+#include<algorithm>
+
+namespace pbrt
+{
+    STAT_COUNTER("Grid/Cells", gridCells);
+    STAT_COUNTER("Grid/Primitive references", gridReferences);
+    STAT_MEMORY_COUNTER("Memory/Grid", gridBytes);
+
+    //count of primitives or cells a task of the parallel build works on
+    constexpr int GridChunkSize = 4096;
+
+    //cells per axis at most, so the count of cells and the cell indices fit in int
+    constexpr int MaxGridResolution = 1024;
+
+    //3D-DDA over the cells [cellMin, cellMax) of a grid whose cell 0 starts at origin
+    struct GridDDA
+    {
+        //start in the cell that contains the ray at tEnter
+        GridDDA(const Ray& ray, const Vector3f& invDir, Float tEnter, const Point3f& origin, const Vector3f& width,
+                const Vector3f& invWidth, const int cellMin[3], const int cellMax[3])
+        {
+            Point3f p = ray(tEnter);
+            for(int axis = 0; axis < 3; axis++)
+            {
+                cell[axis] = Clamp((int)std::floor((p[axis] - origin[axis]) * invWidth[axis]), cellMin[axis], cellMax[axis] - 1);
+                if(ray.d[axis] == 0)
+                {
+                    //the ray never leaves the cell along this axis
+                    nextCrossingT[axis] = std::numeric_limits<Float>::infinity();
+                    deltaT[axis] = 0;
+                    step[axis] = 0;
+                    out[axis] = -1;
+                }
+                else if(ray.d[axis] > 0)
+                {
+                    Float nextPosition = origin[axis] + (cell[axis] + 1) * width[axis];
+                    nextCrossingT[axis] = tEnter + (nextPosition - p[axis]) * invDir[axis];
+                    deltaT[axis] = width[axis] * invDir[axis];
+                    step[axis] = 1;
+                    out[axis] = cellMax[axis];
+                }
+                else
+                {
+                    Float nextPosition = origin[axis] + cell[axis] * width[axis];
+                    nextCrossingT[axis] = tEnter + (nextPosition - p[axis]) * invDir[axis];
+                    deltaT[axis] = -width[axis] * invDir[axis];
+                    step[axis] = -1;
+                    out[axis] = cellMin[axis] - 1;
+                }
+            }
+        }
+        //parametric distance where the ray leaves the current cell
+        Float Exit() const
+        {
+            return std::min(nextCrossingT[0], std::min(nextCrossingT[1], nextCrossingT[2]));
+        }
+        //move to the next cell, return false if the ray left the cell range
+        bool Step()
+        {
+            int axis = nextCrossingT[0] < nextCrossingT[1] ? (nextCrossingT[0] < nextCrossingT[2] ? 0 : 2) :
+                                                             (nextCrossingT[1] < nextCrossingT[2] ? 1 : 2);
+            cell[axis] += step[axis];
+            if(cell[axis] == out[axis])
+                return false;
+            nextCrossingT[axis] += deltaT[axis];
+            return true;
+        }
+
+        int cell[3], step[3], out[3];
+        Float nextCrossingT[3], deltaT[3];
+    };
+
+    GridAccel::GridAccel(std::vector<std::shared_ptr<Primitive>>& primitives, Float density, int maxResolution,
+                         int macroCellSize)
+    : primitives(primitives), macroCellSize(macroCellSize > 1 ? macroCellSize : 0)
+    {
+        //build grid for accelerator
+        ProfilePhase _(Profiler::AccelConstruction);
+        if(this->primitives.empty())
+            return;
+        int nPrimitives = this->primitives.size();
+        //compute bounds for grid construction
+        std::vector<Bounds3f> primitiveBounds(nPrimitives);
+        ParallelFor([&](int i)
+        {
+            primitiveBounds[i] = this->primitives[i]->WorldBound();
+        }, nPrimitives, GridChunkSize);
+        for(const Bounds3f& primitiveBound : primitiveBounds)
+            bounds = Union(bounds, primitiveBound);
+        //choose the resolution so a cube over the longest axis would have about density cells per primitive
+        Vector3f extent = bounds.Diagonal();
+        Float maxExtent = extent[bounds.MaximumExtent()];
+        Float cellsPerUnit = maxExtent > 0 ? std::cbrt(density * nPrimitives) / maxExtent : 0;
+        int axisResolution = Clamp(maxResolution, 1, MaxGridResolution);
+        for(int axis = 0; axis < 3; axis++)
+        {
+            resolution[axis] = (int)Clamp(std::round(extent[axis] * cellsPerUnit), Float(1), Float(axisResolution));
+            cellWidth[axis] = extent[axis] / resolution[axis];
+            //flat axes have a single cell that every position maps to
+            invCellWidth[axis] = cellWidth[axis] > 0 ? 1 / cellWidth[axis] : 0;
+        }
+        int nCells = resolution[0] * resolution[1] * resolution[2];
+        //count the primitives overlapping every cell
+        std::unique_ptr<std::atomic<int>[]> cellCounts(new std::atomic<int>[nCells]);
+        ParallelFor([&](int i)
+        {
+            cellCounts[i].store(0, std::memory_order_relaxed);
+        }, nCells, GridChunkSize);
+        auto forEachCell = [&](int primitive, const auto& function)
+        {
+            int cellMin[3], cellMax[3];
+            cellRange(primitiveBounds[primitive], cellMin, cellMax);
+            for(int z = cellMin[2]; z <= cellMax[2]; z++)
+                for(int y = cellMin[1]; y <= cellMax[1]; y++)
+                    for(int x = cellMin[0]; x <= cellMax[0]; x++)
+                        function(cellIndex(x, y, z));
+        };
+        ParallelFor([&](int i)
+        {
+            forEachCell(i, [&](int cell) { cellCounts[cell].fetch_add(1, std::memory_order_relaxed); });
+        }, nPrimitives, GridChunkSize);
+        //counting sort, the offsets of the cells are the prefix sums of the counts
+        //each chunk sums its cells first, then offsets them by the sums of the chunks before it
+        int nChunks = (nCells + GridChunkSize - 1) / GridChunkSize;
+        std::vector<int> chunkOffsets(nChunks + 1, 0);
+        ParallelFor([&](int chunk)
+        {
+            int chunkEnd = std::min((chunk + 1) * GridChunkSize, nCells);
+            int sum = 0;
+            for(int i = chunk * GridChunkSize; i < chunkEnd; i++)
+                sum += cellCounts[i].load(std::memory_order_relaxed);
+            chunkOffsets[chunk + 1] = sum;
+        }, nChunks);
+        for(int chunk = 0; chunk < nChunks; chunk++)
+            chunkOffsets[chunk + 1] += chunkOffsets[chunk];
+        cellOffsets.resize(nCells + 1);
+        ParallelFor([&](int chunk)
+        {
+            int chunkEnd = std::min((chunk + 1) * GridChunkSize, nCells);
+            int offset = chunkOffsets[chunk];
+            for(int i = chunk * GridChunkSize; i < chunkEnd; i++)
+            {
+                cellOffsets[i] = offset;
+                offset += cellCounts[i].load(std::memory_order_relaxed);
+                //the counts become the next free slot of the cells
+                cellCounts[i].store(cellOffsets[i], std::memory_order_relaxed);
+            }
+        }, nChunks);
+        cellOffsets[nCells] = chunkOffsets[nChunks];
+        //scatter the primitives into the slots of their cells
+        cellPrimitives.resize(cellOffsets[nCells]);
+        ParallelFor([&](int i)
+        {
+            forEachCell(i, [&](int cell) { cellPrimitives[cellCounts[cell].fetch_add(1, std::memory_order_relaxed)] = i; });
+        }, nPrimitives, GridChunkSize);
+        //the scattered order depends on the scheduling, sort the primitives of every cell so the grid is always the same
+        ParallelFor([&](int i)
+        {
+            std::sort(&cellPrimitives[cellOffsets[i]], &cellPrimitives[cellOffsets[i + 1]]);
+        }, nCells, GridChunkSize);
+        //mark the macro cells with any primitive
+        if(this->macroCellSize > 0)
+        {
+            for(int axis = 0; axis < 3; axis++)
+                macroResolution[axis] = (resolution[axis] + this->macroCellSize - 1) / this->macroCellSize;
+            int nMacroCells = macroResolution[0] * macroResolution[1] * macroResolution[2];
+            macroCellOccupied.resize(nMacroCells);
+            ParallelFor([&](int macroCell)
+            {
+                int macroX = macroCell % macroResolution[0];
+                int macroY = (macroCell / macroResolution[0]) % macroResolution[1];
+                int macroZ = macroCell / (macroResolution[0] * macroResolution[1]);
+                int cellMin[3] = { macroX * this->macroCellSize, macroY * this->macroCellSize, macroZ * this->macroCellSize };
+                bool occupied = false;
+                for(int z = cellMin[2]; z < std::min(cellMin[2] + this->macroCellSize, resolution[2]) && !occupied; z++)
+                    for(int y = cellMin[1]; y < std::min(cellMin[1] + this->macroCellSize, resolution[1]) && !occupied; y++)
+                        for(int x = cellMin[0]; x < std::min(cellMin[0] + this->macroCellSize, resolution[0]); x++)
+                        {
+                            int cell = cellIndex(x, y, z);
+                            if(cellOffsets[cell + 1] > cellOffsets[cell])
+                            {
+                                occupied = true;
+                                break;
+                            }
+                        }
+                macroCellOccupied[macroCell] = occupied;
+            }, nMacroCells, 64);
+        }
+        gridCells += nCells;
+        gridReferences += cellPrimitives.size();
+        gridBytes += cellOffsets.size() * sizeof(int) + cellPrimitives.size() * sizeof(int) + macroCellOccupied.size() +
+                     this->primitives.size() * sizeof(this->primitives[0]);
+    }
+
+    Bounds3f GridAccel::WorldBound() const
+    {
+        return bounds;
+    }
+
+    void GridAccel::cellRange(const Bounds3f& primitiveBounds, int cellMin[3], int cellMax[3]) const
+    {
+        for(int axis = 0; axis < 3; axis++)
+        {
+            cellMin[axis] = Clamp((int)std::floor((primitiveBounds.pMin[axis] - bounds.pMin[axis]) * invCellWidth[axis]),
+                                  0, resolution[axis] - 1);
+            cellMax[axis] = Clamp((int)std::floor((primitiveBounds.pMax[axis] - bounds.pMin[axis]) * invCellWidth[axis]),
+                                  0, resolution[axis] - 1);
+        }
+    }
+
+    template<typename Visit>
+    void GridAccel::walkCells(const Ray& ray, Visit visit) const
+    {
+        Float tMin, tMax;
+        if(cellOffsets.empty() || !bounds.IntersectP(ray, &tMin, &tMax))
+            return;
+        Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        //walk the cells in [cellMin, cellMax) between tEnter and tExit, return true if visit stopped the walk
+        auto walkRange = [&](Float tEnter, Float tExit, const int cellMin[3], const int cellMax[3])
+        {
+            GridDDA dda(ray, invDir, tEnter, bounds.pMin, cellWidth, invCellWidth, cellMin, cellMax);
+            while(true)
+            {
+                Float tCellExit = std::min(dda.Exit(), tExit);
+                if(visit(cellIndex(dda.cell[0], dda.cell[1], dda.cell[2]), tCellExit))
+                    return true;
+                if(tCellExit >= tExit || !dda.Step())
+                    return false;
+            }
+        };
+        const int gridMin[3] = { 0, 0, 0 };
+        if(macroCellSize == 0)
+        {
+            walkRange(tMin, tMax, gridMin, resolution);
+            return;
+        }
+        //walk the macro cells, and the cells of the occupied ones
+        Vector3f macroWidth = cellWidth * macroCellSize, invMacroWidth = invCellWidth / macroCellSize;
+        GridDDA macro(ray, invDir, tMin, bounds.pMin, macroWidth, invMacroWidth, gridMin, macroResolution);
+        Float tEnter = tMin;
+        while(true)
+        {
+            Float tMacroExit = std::min(macro.Exit(), tMax);
+            int macroCell = (macro.cell[2] * macroResolution[1] + macro.cell[1]) * macroResolution[0] + macro.cell[0];
+            if(macroCellOccupied[macroCell])
+            {
+                int cellMin[3], cellMax[3];
+                for(int axis = 0; axis < 3; axis++)
+                {
+                    cellMin[axis] = macro.cell[axis] * macroCellSize;
+                    cellMax[axis] = std::min(cellMin[axis] + macroCellSize, resolution[axis]);
+                }
+                if(walkRange(tEnter, tMacroExit, cellMin, cellMax))
+                    return;
+            }
+            if(tMacroExit >= tMax || !macro.Step())
+                return;
+            tEnter = tMacroExit;
+        }
+    }
+
+    bool GridAccel::Intersect(const Ray& ray, SurfaceInteraction* surfaceInteraction) const
+    {
+        ProfilePhase _(Profiler::AccelIntersect);
+        bool hit = false;
+        walkCells(ray, [&](int cell, Float tExit)
+        {
+            for(int i = cellOffsets[cell]; i < cellOffsets[cell + 1]; i++)
+            {
+                if(primitives[cellPrimitives[i]]->Intersect(ray, surfaceInteraction))
+                    hit = true;
+            }
+            //a primitive may reach into later cells, only a hit inside this cell is sure to be the closest
+            return hit && ray.tMax <= tExit;
+        });
+        return hit;
+    }
+
+    bool GridAccel::IntersectP(const Ray& ray) const
+    {
+        const Primitive* occluder;
+        return IntersectOccluder(ray, &occluder);
+    }
+
+    bool GridAccel::IntersectOccluder(const Ray& ray, const Primitive** occluder) const
+    {
+        ProfilePhase _(Profiler::AccelIntersectP);
+        bool hit = false;
+        walkCells(ray, [&](int cell, Float /*tExit*/)
+        {
+            for(int i = cellOffsets[cell]; i < cellOffsets[cell + 1]; i++)
+            {
+                if(primitives[cellPrimitives[i]]->IntersectOccluder(ray, occluder))
+                {
+                    hit = true;
+                    return true;
+                }
+            }
+            return false;
+        });
+        return hit;
+    }
+
+    std::shared_ptr<GridAccel> CreateGridAccelerator(std::vector<std::shared_ptr<Primitive>>& primitives, const ParamSet& params)
+    {
+        Float density = params.FindOneFloat("density", 2);
+        if(density <= 0)
+        {
+            Warn("Grid density {} should be positive. Using 2.", density);
+            density = 2;
+        }
+        int maxResolution = std::max(params.FindOneInt("maxresolution", 256), 1);
+        if(maxResolution > MaxGridResolution)
+        {
+            Warn("Grid resolution {} too large. Using {}.", maxResolution, MaxGridResolution);
+            maxResolution = MaxGridResolution;
+        }
+        int macroCellSize = params.FindOneInt("macrocells", 0);
+        return std::make_shared<GridAccel>(primitives, density, maxResolution, macroCellSize);
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include"core/pbrt.h"
+#include"core/primitive/primitive.h"
+
+namespace pbrt
+{
+    class GridAccel : public Aggregate
+    {
+    public:
+        //the grid has about density cells per primitive along the longest axis cubed, at most maxResolution per axis
+        //and never more than 1024,
+        //macroCellSize > 1 groups that many cells per axis into macro cells, so rays skip empty space a macro cell at a time
+        GridAccel(std::vector<std::shared_ptr<Primitive>>& primitives, Float density = 2, int maxResolution = 256,
+                  int macroCellSize = 0);
+        Bounds3f WorldBound() const override;
+        bool Intersect(const Ray& ray, SurfaceInteraction* surfaceInteraction) const override;
+        bool IntersectP(const Ray& ray) const override;
+        bool IntersectOccluder(const Ray& ray, const Primitive** occluder) const override;
+    private:
+        //the cells of primitiveBounds in [cellMin, cellMax]
+        void cellRange(const Bounds3f& primitiveBounds, int cellMin[3], int cellMax[3]) const;
+        int cellIndex(int x, int y, int z) const { return (z * resolution[1] + y) * resolution[0] + x; }
+        //walk the cells pierced by the ray front to back, visit(cell, tExit) returns true to stop the walk
+        template<typename Visit>
+        void walkCells(const Ray& ray, Visit visit) const;
+
+        std::vector<std::shared_ptr<Primitive>> primitives;
+        Bounds3f bounds;
+        int resolution[3] = { 0, 0, 0 };
+        Vector3f cellWidth, invCellWidth;
+        //the primitives of cell i are cellPrimitives[cellOffsets[i]] to cellPrimitives[cellOffsets[i + 1] - 1]
+        std::vector<int> cellOffsets;
+        std::vector<int> cellPrimitives;
+        //0 if macro cells are off
+        int macroCellSize = 0;
+        int macroResolution[3] = { 0, 0, 0 };
+        //1 if any cell of the macro cell has a primitive
+        std::vector<uint8_t> macroCellOccupied;
+    };
+
+    std::shared_ptr<GridAccel> CreateGridAccelerator(std::vector<std::shared_ptr<Primitive>>& primitives, const ParamSet& params);
+}
@@ -0,0 +1,450 @@
+#include"kdtree.h"
+#include"core/memory/memory.h"
+#include"core/parallel/parallel.h"
+#include"core/parameter/parameter.h"
+#include"core/interaction/interaction.h"
+#include"core/statistics/stats.h"
+#include<cstring>
+
+namespace pbrt
+{
+    STAT_COUNTER("Kd-Tree/Interior nodes", kdInteriorNodes);
+    STAT_COUNTER("Kd-Tree/Leaf nodes", kdLeafNodes);
+    STAT_MEMORY_COUNTER("Memory/Kd-Tree", kdTreeBytes);
+
+    //the node of the kd-tree, 8 bytes so four nodes fit in a cache line
+    //the below child of an interior node is just after it, only the offset of the above child is stored
+    struct KdTreeNode
+    {
+        //initialize leaf node, a single primitive is stored in the node itself
+        void InitLeaf(const int* primitiveNumbers, int np, std::vector<int>* primitiveIndices)
+        {
+            flags = 3;
+            nPrims |= (np << 2);
+            if(np == 0)
+                onePrimitive = 0;
+            else if(np == 1)
+                onePrimitive = primitiveNumbers[0];
+            else
+            {
+                primitiveIndicesOffset = primitiveIndices->size();
+                for(int i = 0; i < np; i++)
+                    primitiveIndices->push_back(primitiveNumbers[i]);
+            }
+            kdLeafNodes++;
+        }
+        //initialize interior node, the above child is set after the below child is built
+        void InitInterior(int axis, int aboveChild, Float split)
+        {
+            this->split = split;
+            flags = axis;
+            this->aboveChild |= (aboveChild << 2);
+            kdInteriorNodes++;
+        }
+        Float SplitPos() const { return split; }
+        int nPrimitives() const { return nPrims >> 2; }
+        //0, 1, 2 for xyz of interior node, 3 for leaf node
+        int SplitAxis() const { return flags & 3; }
+        bool IsLeaf() const { return (flags & 3) == 3; }
+        int AboveChild() const { return aboveChild >> 2; }
+
+        union
+        {
+            //interior node
+            Float split;
+            //leaf node with a single primitive
+            int onePrimitive;
+            //leaf node with several primitives, offset in primitiveIndices
+            int primitiveIndicesOffset;
+        };
+    private:
+        //the low 2 bits are the flags, the upper 30 bits are the count of primitives or the above child
+        union
+        {
+            int flags;
+            int nPrims;
+            int aboveChild;
+        };
+    };
+
+#ifndef PBRT_FLOAT_AS_DOUBLE
+    static_assert(sizeof(KdTreeNode) == 8, "KdTreeNode should be 8 bytes");
+#endif
+
+    enum class EdgeType
+    {
+        Start,
+        End
+    };
+
+    //the start or end of the bounds of a primitive projected on the split axis
+    struct BoundEdge
+    {
+        BoundEdge() { }
+        BoundEdge(Float t, int primitiveNumber, bool starting)
+        : t(t), primitiveNumber(primitiveNumber), type(starting ? EdgeType::Start : EdgeType::End) { }
+        Float t;
+        int primitiveNumber;
+        EdgeType type;
+    };
+
+    //a node waiting on the traversal stack with its parametric range
+    struct KdToDo
+    {
+        const KdTreeNode* node;
+        Float tMin, tMax;
+    };
+
+    constexpr int MaxKdToDo = 64;
+
+    KdTreeAccel::KdTreeAccel(std::vector<std::shared_ptr<Primitive>>& primitives, int intersectCost, int traversalCost,
+                             Float emptyBonus, int maxPrimitives, int maxDepth)
+    : intersectCost(intersectCost), traversalCost(traversalCost), maxPrimitives(maxPrimitives), emptyBonus(emptyBonus),
+      primitives(primitives)
+    {
+        //build kd-tree for accelerator
+        ProfilePhase _(Profiler::AccelConstruction);
+        if(this->primitives.empty())
+            return;
+        nextFreeNode = nAllocatedNodes = 0;
+        if(maxDepth <= 0)
+            maxDepth = std::round(8 + 1.3f * Log2(Float(this->primitives.size())));
+        //the traversal stack holds at most one node per level
+        maxDepth = std::min(maxDepth, MaxKdToDo);
+        //compute bounds for kd-tree construction
+        std::vector<Bounds3f> primitiveBounds(this->primitives.size());
+        ParallelFor([&](int i)
+        {
+            primitiveBounds[i] = this->primitives[i]->WorldBound();
+        }, this->primitives.size(), 4096);
+        for(const Bounds3f& primitiveBound : primitiveBounds)
+            bounds = Union(bounds, primitiveBound);
+        //allocate working memory for kd-tree construction
+        std::unique_ptr<BoundEdge[]> edges[3];
+        for(int i = 0; i < 3; i++)
+            edges[i].reset(new BoundEdge[2 * this->primitives.size()]);
+        std::unique_ptr<int[]> primitives0(new int[this->primitives.size()]);
+        std::unique_ptr<int[]> primitives1(new int[(maxDepth + 1) * this->primitives.size()]);
+        //initialize primitiveNumbers for kd-tree construction
+        std::unique_ptr<int[]> primitiveNumbers(new int[this->primitives.size()]);
+        for(size_t i = 0; i < this->primitives.size(); i++)
+            primitiveNumbers[i] = i;
+        //start recursive construction of kd-tree
+        buildTree(0, bounds, primitiveBounds, primitiveNumbers.get(), this->primitives.size(), maxDepth, edges,
+                  primitives0.get(), primitives1.get());
+        kdTreeBytes += nextFreeNode * sizeof(KdTreeNode) + primitiveIndices.size() * sizeof(int) +
+                       this->primitives.size() * sizeof(this->primitives[0]);
+    }
+
+    KdTreeAccel::~KdTreeAccel()
+    {
+        FreeAligned(nodes);
+    }
+
+    Bounds3f KdTreeAccel::WorldBound() const
+    {
+        return bounds;
+    }
+
+    void KdTreeAccel::buildTree(int nodeNumber, const Bounds3f& nodeBounds, const std::vector<Bounds3f>& primitiveBounds,
+                                int* primitiveNumbers, int nPrimitives, int depth, const std::unique_ptr<BoundEdge[]> edges[3],
+                                int* primitives0, int* primitives1, int badRefines)
+    {
+        Assert(nodeNumber == nextFreeNode);
+        //get next free node from nodes array, doubling it when full
+        if(nextFreeNode == nAllocatedNodes)
+        {
+            int nNewAllocatedNodes = std::max(2 * nAllocatedNodes, 512);
+            KdTreeNode* newNodes = AllocAligned<KdTreeNode>(nNewAllocatedNodes);
+            if(nAllocatedNodes > 0)
+            {
+                memcpy(newNodes, nodes, nAllocatedNodes * sizeof(KdTreeNode));
+                FreeAligned(nodes);
+            }
+            nodes = newNodes;
+            nAllocatedNodes = nNewAllocatedNodes;
+        }
+        ++nextFreeNode;
+        //initialize leaf node if termination criteria met
+        if(nPrimitives <= maxPrimitives || depth == 0)
+        {
+            nodes[nodeNumber].InitLeaf(primitiveNumbers, nPrimitives, &primitiveIndices);
+            return;
+        }
+        //initialize interior node and continue recursion
+        //choose split axis position for interior node
+        int bestAxis = -1, bestOffset = -1;
+        Float bestCost = std::numeric_limits<Float>::infinity();
+        Float oldCost = intersectCost * Float(nPrimitives);
+        Float totalSA = nodeBounds.SurfaceArea();
+        Float invTotalSA = 1 / totalSA;
+        Vector3f d = nodeBounds.pMax - nodeBounds.pMin;
+        //choose which axis to split along
+        int axis = nodeBounds.MaximumExtent();
+        int retries = 0;
+        while(true)
+        {
+            //initialize edges for axis
+            for(int i = 0; i < nPrimitives; i++)
+            {
+                int primitiveNumber = primitiveNumbers[i];
+                const Bounds3f& bound = primitiveBounds[primitiveNumber];
+                edges[axis][2 * i] = BoundEdge(bound.pMin[axis], primitiveNumber, true);
+                edges[axis][2 * i + 1] = BoundEdge(bound.pMax[axis], primitiveNumber, false);
+            }
+            //sort edges for axis, starts go before ends at the same position
+            std::sort(&edges[axis][0], &edges[axis][2 * nPrimitives], [](const BoundEdge& e0, const BoundEdge& e1)
+            {
+                if(e0.t == e1.t)
+                    return (int)e0.type < (int)e1.type;
+                return e0.t < e1.t;
+            });
+            //compute cost of all splits for axis to find best
+            int nBelow = 0, nAbove = nPrimitives;
+            for(int i = 0; i < 2 * nPrimitives; i++)
+            {
+                if(edges[axis][i].type == EdgeType::End)
+                    --nAbove;
+                Float edgeT = edges[axis][i].t;
+                if(edgeT > nodeBounds.pMin[axis] && edgeT < nodeBounds.pMax[axis])
+                {
+                    //compute cost for split at ith edge
+                    //compute child surface areas for split at edgeT
+                    int otherAxis0 = (axis + 1) % 3, otherAxis1 = (axis + 2) % 3;
+                    Float belowSA = 2 * (d[otherAxis0] * d[otherAxis1] + (edgeT - nodeBounds.pMin[axis]) *
+                                         (d[otherAxis0] + d[otherAxis1]));
+                    Float aboveSA = 2 * (d[otherAxis0] * d[otherAxis1] + (nodeBounds.pMax[axis] - edgeT) *
+                                         (d[otherAxis0] + d[otherAxis1]));
+                    Float pBelow = belowSA * invTotalSA;
+                    Float pAbove = aboveSA * invTotalSA;
+                    Float eb = (nAbove == 0 || nBelow == 0) ? emptyBonus : 0;
+                    Float cost = traversalCost + intersectCost * (1 - eb) * (pBelow * nBelow + pAbove * nAbove);
+                    //update best split if this is lowest cost so far
+                    if(cost < bestCost)
+                    {
+                        bestCost = cost;
+                        bestAxis = axis;
+                        bestOffset = i;
+                    }
+                }
+                if(edges[axis][i].type == EdgeType::Start)
+                    ++nBelow;
+            }
+            Assert(nBelow == nPrimitives && nAbove == 0);
+            //create leaf if no good splits were found
+            if(bestAxis == -1 && retries < 2)
+            {
+                ++retries;
+                axis = (axis + 1) % 3;
+                continue;
+            }
+            break;
+        }
+        if(bestCost > oldCost)
+            ++badRefines;
+        if((bestCost > 4 * oldCost && nPrimitives < 16) || bestAxis == -1 || badRefines == 3)
+        {
+            nodes[nodeNumber].InitLeaf(primitiveNumbers, nPrimitives, &primitiveIndices);
+            return;
+        }
+        //classify primitives with respect to split
+        int n0 = 0, n1 = 0;
+        for(int i = 0; i < bestOffset; i++)
+        {
+            if(edges[bestAxis][i].type == EdgeType::Start)
+                primitives0[n0++] = edges[bestAxis][i].primitiveNumber;
+        }
+        for(int i = bestOffset + 1; i < 2 * nPrimitives; i++)
+        {
+            if(edges[bestAxis][i].type == EdgeType::End)
+                primitives1[n1++] = edges[bestAxis][i].primitiveNumber;
+        }
+        //recursively initialize children nodes
+        Float tSplit = edges[bestAxis][bestOffset].t;
+        Bounds3f bounds0 = nodeBounds, bounds1 = nodeBounds;
+        bounds0.pMax[bestAxis] = bounds1.pMin[bestAxis] = tSplit;
+        buildTree(nodeNumber + 1, bounds0, primitiveBounds, primitives0, n0, depth - 1, edges,
+                  primitives0, primitives1 + nPrimitives, badRefines);
+        int aboveChild = nextFreeNode;
+        nodes[nodeNumber].InitInterior(bestAxis, aboveChild, tSplit);
+        buildTree(aboveChild, bounds1, primitiveBounds, primitives1, n1, depth - 1, edges,
+                  primitives0, primitives1 + nPrimitives, badRefines);
+    }
+
+    bool KdTreeAccel::Intersect(const Ray& ray, SurfaceInteraction* surfaceInteraction) const
+    {
+        ProfilePhase _(Profiler::AccelIntersect);
+        //compute initial parametric range of ray inside kd-tree extent
+        Float tMin, tMax;
+        if(!nodes || !bounds.IntersectP(ray, &tMin, &tMax))
+            return false;
+        //prepare to traverse kd-tree for ray
+        Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        KdToDo todo[MaxKdToDo];
+        int todoPos = 0;
+        //traverse kd-tree nodes in order for ray, front to back
+        bool hit = false;
+        const KdTreeNode* node = &nodes[0];
+        while(node)
+        {
+            //bail out if we found a hit closer than the current node
+            if(ray.tMax < tMin)
+                break;
+            if(!node->IsLeaf())
+            {
+                //process kd-tree interior node
+                //compute parametric distance along ray to split plane
+                int axis = node->SplitAxis();
+                Float tPlane = (node->SplitPos() - ray.o[axis]) * invDir[axis];
+                //get node children pointers for ray
+                const KdTreeNode* firstChild, *secondChild;
+                bool belowFirst = (ray.o[axis] < node->SplitPos()) || (ray.o[axis] == node->SplitPos() && ray.d[axis] <= 0);
+                if(belowFirst)
+                {
+                    firstChild = node + 1;
+                    secondChild = &nodes[node->AboveChild()];
+                }
+                else
+                {
+                    firstChild = &nodes[node->AboveChild()];
+                    secondChild = node + 1;
+                }
+                //advance to next child node, possibly enqueue other child
+                if(tPlane > tMax || tPlane <= 0)
+                    node = firstChild;
+                else if(tPlane < tMin)
+                    node = secondChild;
+                else
+                {
+                    //enqueue secondChild in todo list
+                    todo[todoPos].node = secondChild;
+                    todo[todoPos].tMin = tPlane;
+                    todo[todoPos].tMax = tMax;
+                    ++todoPos;
+                    node = firstChild;
+                    tMax = tPlane;
+                }
+            }
+            else
+            {
+                //check for intersections inside leaf node
+                int nPrimitives = node->nPrimitives();
+                if(nPrimitives == 1)
+                {
+                    if(primitives[node->onePrimitive]->Intersect(ray, surfaceInteraction))
+                        hit = true;
+                }
+                else
+                {
+                    for(int i = 0; i < nPrimitives; i++)
+                    {
+                        int index = primitiveIndices[node->primitiveIndicesOffset + i];
+                        if(primitives[index]->Intersect(ray, surfaceInteraction))
+                            hit = true;
+                    }
+                }
+                //grab next node to process from todo list
+                if(todoPos > 0)
+                {
+                    --todoPos;
+                    node = todo[todoPos].node;
+                    tMin = todo[todoPos].tMin;
+                    tMax = todo[todoPos].tMax;
+                }
+                else
+                    break;
+            }
+        }
+        return hit;
+    }
+
+    bool KdTreeAccel::IntersectP(const Ray& ray) const
+    {
+        const Primitive* occluder;
+        return IntersectOccluder(ray, &occluder);
+    }
+
+    bool KdTreeAccel::IntersectOccluder(const Ray& ray, const Primitive** occluder) const
+    {
+        ProfilePhase _(Profiler::AccelIntersectP);
+        Float tMin, tMax;
+        if(!nodes || !bounds.IntersectP(ray, &tMin, &tMax))
+            return false;
+        Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        KdToDo todo[MaxKdToDo];
+        int todoPos = 0;
+        const KdTreeNode* node = &nodes[0];
+        while(node)
+        {
+            if(node->IsLeaf())
+            {
+                //return as soon as any hit is found
+                int nPrimitives = node->nPrimitives();
+                if(nPrimitives == 1)
+                {
+                    if(primitives[node->onePrimitive]->IntersectOccluder(ray, occluder))
+                        return true;
+                }
+                else
+                {
+                    for(int i = 0; i < nPrimitives; i++)
+                    {
+                        int index = primitiveIndices[node->primitiveIndicesOffset + i];
+                        if(primitives[index]->IntersectOccluder(ray, occluder))
+                            return true;
+                    }
+                }
+                if(todoPos > 0)
+                {
+                    --todoPos;
+                    node = todo[todoPos].node;
+                    tMin = todo[todoPos].tMin;
+                    tMax = todo[todoPos].tMax;
+                }
+                else
+                    break;
+            }
+            else
+            {
+                int axis = node->SplitAxis();
+                Float tPlane = (node->SplitPos() - ray.o[axis]) * invDir[axis];
+                const KdTreeNode* firstChild, *secondChild;
+                bool belowFirst = (ray.o[axis] < node->SplitPos()) || (ray.o[axis] == node->SplitPos() && ray.d[axis] <= 0);
+                if(belowFirst)
+                {
+                    firstChild = node + 1;
+                    secondChild = &nodes[node->AboveChild()];
+                }
+                else
+                {
+                    firstChild = &nodes[node->AboveChild()];
+                    secondChild = node + 1;
+                }
+                if(tPlane > tMax || tPlane <= 0)
+                    node = firstChild;
+                else if(tPlane < tMin)
+                    node = secondChild;
+                else
+                {
+                    todo[todoPos].node = secondChild;
+                    todo[todoPos].tMin = tPlane;
+                    todo[todoPos].tMax = tMax;
+                    ++todoPos;
+                    node = firstChild;
+                    tMax = tPlane;
+                }
+            }
+        }
+        return false;
+    }
+
+    std::shared_ptr<KdTreeAccel> CreateKdTreeAccelerator(std::vector<std::shared_ptr<Primitive>>& primitives, const ParamSet& params)
+    {
+        int intersectCost = params.FindOneInt("intersectcost", 80);
+        int traversalCost = params.FindOneInt("traversalcost", 1);
+        Float emptyBonus = params.FindOneFloat("emptybonus", 0.5f);
+        int maxPrimitives = params.FindOneInt("maxprims", 1);
+        int maxDepth = params.FindOneInt("maxdepth", -1);
+        return std::make_shared<KdTreeAccel>(primitives, intersectCost, traversalCost, emptyBonus, maxPrimitives, maxDepth);
+    }
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include"core/pbrt.h"
+#include"core/primitive/primitive.h"
+
+namespace pbrt
+{
+    struct KdTreeNode;
+    struct BoundEdge;
+
+    class KdTreeAccel : public Aggregate
+    {
+    public:
+        //intersectCost and traversalCost are the relative costs of a primitive intersection and a node traversal for SAH,
+        //emptyBonus in [0, 1] favors splits that cut off empty space, maxDepth <= 0 derives the depth from the primitive count
+        KdTreeAccel(std::vector<std::shared_ptr<Primitive>>& primitives, int intersectCost = 80, int traversalCost = 1,
+                    Float emptyBonus = 0.5f, int maxPrimitives = 1, int maxDepth = -1);
+        ~KdTreeAccel();
+        Bounds3f WorldBound() const override;
+        bool Intersect(const Ray& ray, SurfaceInteraction* surfaceInteraction) const override;
+        bool IntersectP(const Ray& ray) const override;
+        bool IntersectOccluder(const Ray& ray, const Primitive** occluder) const override;
+    private:
+        //build the node at nextFreeNode for primitiveNumbers inside nodeBounds
+        //edges hold scratch space for every axis, primitives0 for the primitives of this node and primitives1 below it
+        void buildTree(int nodeNumber, const Bounds3f& nodeBounds, const std::vector<Bounds3f>& primitiveBounds,
+                       int* primitiveNumbers, int nPrimitives, int depth, const std::unique_ptr<BoundEdge[]> edges[3],
+                       int* primitives0, int* primitives1, int badRefines = 0);
+
+        const int intersectCost, traversalCost, maxPrimitives;
+        const Float emptyBonus;
+        std::vector<std::shared_ptr<Primitive>> primitives;
+        //primitives of leaves with more than one primitive
+        std::vector<int> primitiveIndices;
+        KdTreeNode* nodes = nullptr;
+        int nAllocatedNodes = 0, nextFreeNode = 0;
+        Bounds3f bounds;
+    };
+
+    std::shared_ptr<KdTreeAccel> CreateKdTreeAccelerator(std::vector<std::shared_ptr<Primitive>>& primitives, const ParamSet& params);
+}
@@ -1,5 +1,9 @@
 #include"api.h"
 #include"core/parameter/parameter.h"
+#include"core/parallel/parallel.h"
+#include"accelerators/bvh.h"
+#include"accelerators/kdtree.h"
+#include"accelerators/grid.h"
 
 namespace pbrt
 {
@@ -38,16 +42,21 @@ namespace pbrt
     };
 
 
+    std::shared_ptr<Primitive> MakeAccelerator(const std::string& name, std::vector<std::shared_ptr<Primitive>>& primitives,
+    const ParamSet& paramSet);
+
     //render option for storing something had been set
     struct RenderOptions
     {
         //method
         Scene* MakeScene()
         {
-            std::shared_ptr<Primitive> accelrator = MakeAccelerator(AccelratorName, primitives, AccelratorParams);
-            if(!accelrator)
-                accelrator = std::make_shared<BVHAccel>(primitives);
-            Scene* scene = new Scene(accelrator, lights);
+            std::shared_ptr<Primitive> accelerator = MakeAccelerator(AcceleratorName, primitives, AcceleratorParams);
+            if(!accelerator)
+                accelerator = std::make_shared<BVHAccel>(primitives);
+            //BVH aggregates can be edited in place after the scene is rendered
+            editAggregate = std::dynamic_pointer_cast<BVHAccel>(accelerator);
+            Scene* scene = new Scene(accelerator, lights);
             //erase primitives and lights from RenderOptions
             primitives.erase(primitives.begin(), primitives.end());
             lights.erase(lights.begin(), lights.end());
@@ -63,6 +72,9 @@ namespace pbrt
         //pixel filter
         std::string FilterName = "box";
         ParamSet FilterParams;
+        //accelerator
+        std::string AcceleratorName = "bvh";
+        ParamSet AcceleratorParams;
         //camera
         std::string CameraName = "perspective";
         ParamSet CameraParams;
@@ -76,6 +88,12 @@ namespace pbrt
         //object instance
         std::map<std::string, std::vector<std::shared_ptr<Primitive>>> instances;
         std::vector<std::shared_ptr<Primitive>>* currentInstance = nullptr;
+        //scene edit, the scene of the last pbrtWorldEnd() is kept until the next pbrtWorldBegin()
+        std::unique_ptr<Scene> editScene;
+        std::shared_ptr<BVHAccel> editAggregate;
+        //primitives inserted by every named edit
+        std::map<std::string, std::vector<std::shared_ptr<Primitive>>> edits;
+        std::string currentEdit;
     };
 
     struct GraphicsState
@@ -120,7 +138,9 @@ namespace pbrt
         //outsize pbrtWorldBegin() and pbrtWorldEnd()
         OptionBlock,
         //insize pbrtWorldBegin() and pbrtWorldEnd()
-        WorldBlock
+        WorldBlock,
+        //inside pbrtEditBegin() and pbrtEditEnd(), shapes are described like in a world block
+        EditBlock
     };
 
     //api static variable
@@ -157,7 +177,7 @@ namespace pbrt
 
     #define VERIFY_OPTIONS(func)                                                                 \
     VERIFY_INITIALIZED(func)                                                                     \
-    if(currentApiState == APIState::WorldBlock)                                                  \
+    if(currentApiState == APIState::WorldBlock || currentApiState == APIState::EditBlock)        \
     {                                                                                            \
         Error("Options cannot be set inside world block; \"%s\" not allowed. Ignoring.", func);  \
         return;                                                                                  \
@@ -202,6 +222,24 @@ namespace pbrt
             shape = CreateDiskShape(ObjectToWorld, WorldToObject, reverseOrientation, paramSet);   
     }
 
+    //accelerator creation function
+    std::shared_ptr<Primitive> MakeAccelerator(const std::string& name, std::vector<std::shared_ptr<Primitive>>& primitives,
+    const ParamSet& paramSet)
+    {
+        std::shared_ptr<Primitive> accelerator;
+        if(name == "bvh")
+            accelerator = CreateBVHAccelerator(primitives, paramSet, renderOptions->transformStartTime,
+                                               renderOptions->transformEndTime);
+        else if(name == "kdtree")
+            accelerator = CreateKdTreeAccelerator(primitives, paramSet);
+        else if(name == "grid")
+            accelerator = CreateGridAccelerator(primitives, paramSet);
+        else
+            Warning("Accelerator \"%s\" unknown.", name.c_str());
+        paramSet.ReportUnused();
+        return accelerator;
+    }
+
     //material creation function
     std::shared_ptr<Material> MakeMaterial(const std::string& name, const TextureParams& texParams)
     {
@@ -219,6 +257,7 @@ namespace pbrt
         renderOptions.reset(new RenderOptions);
         graphicsState = GraphicsState();
         //general pbrt initialization
+        ParallelInit();
     }
     
     void pbrtCleanup()
@@ -228,8 +267,11 @@ namespace pbrt
             Error("pbrtCleanup() called without pbrtInit().");
         else if(currentApiState == APIState::WorldBlock)
             Error("pbrtCleanup() called while inside world block.");
+        else if(currentApiState == APIState::EditBlock)
+            Error("pbrtCleanup() called while inside an edit.");
         currentApiState = APIState::Uninitialized;
         renderOptions.reset(nullptr);
+        ParallelCleanup();
     }
 
     void pbrtIdentity()
@@ -292,6 +334,13 @@ namespace pbrt
         renderOptions->FilterParams = params;
     }
 
+    void pbrtAccelerator(const std::string& name, const ParamSet& params)
+    {
+        VERIFY_OPTIONS("Accelerator");
+        renderOptions->AcceleratorName = name;
+        renderOptions->AcceleratorParams = params;
+    }
+
     void pbrtCamera(const std::string& name, const ParamSet& params)
     {
         VERIFY_OPTIONS("Camera");
@@ -323,6 +372,10 @@ namespace pbrt
             curTransform[i] = Transform();
         activeTransformBits = AllTransformBits;
         namedCoordinateSystems["World"] = curTransform;
+        //a new world replaces the scene kept for editing
+        renderOptions->editScene.reset();
+        renderOptions->editAggregate.reset();
+        renderOptions->edits.clear();
     }
 
     void pbrtAttributeBegin()
@@ -407,6 +460,12 @@ namespace pbrt
     {
         VERIFY_WORLD("LightSource");
         WARN_IF_ANIMATED_TRANSFORM("LightSource");
+        //edits only insert primitives into the aggregate, the lights of the scene stay as they are
+        if(currentApiState == APIState::EditBlock)
+        {
+            Warning("Light sources not supported in scene edits. Ignoring \"%s\".", name.c_str());
+            return;
+        }
         MediumInterface interface = graphicsState.CreateMediumInterface();
         std::shared_ptr<Light> light = MakeLight(name, params, curTransform[0], interface);
         if(light)
@@ -474,7 +533,7 @@ namespace pbrt
             //get animatedObjectToWor ld transform for shape
             Transform* ObjToWorld[2];
             transformCache.Lookup(curTransform[0], &ObjToWorld[0], nullptr);
-            transformCache.Lookup(curTransform[0], &ObjToWorld[1], nullptr);
+            transformCache.Lookup(curTransform[1], &ObjToWorld[1], nullptr);
             AnimatedTransform animatedObjectToWorld(ObjToWorld[0], renderOptions->transformStartTime, ObjToWorld[1], renderOptions->transformEndTime);
             if(primitives.size() > 1)
             {
@@ -521,10 +580,20 @@ namespace pbrt
     {
         VERIFY_WORLD("ObjectInstance");
         //perform object instance error checking
-
+        if(renderOptions->currentInstance)
+        {
+            Error("ObjectInstance can't be called inside instance definition");
+            return;
+        }
+        if(renderOptions->instances.find(name) == renderOptions->instances.end())
+        {
+            Error("Unable to find instance named \"%s\"", name.c_str());
+            return;
+        }
         std::vector<std::shared_ptr<Primitive>>& instance = renderOptions->instances[name];
         if(instance.empty())
             return;
+        //the object is built into its own aggregate by its first instance, later instances share it
         if(instance.size() > 1)
         {
             //create aggregate for instace Primitives
@@ -535,19 +604,37 @@ namespace pbrt
             instance.erase(instance.begin(), instance.end());
             instance.push_back(accel);
         }
-        //create animatedInstanceToWorld transform for instance
-        Transform* InstanceToWorld[2];
-        transformCache.Lookup(curTransform[0], &InstanceToWorld[0], nullptr);
-        transformCache.Lookup(curTransform[0], &InstanceToWorld[1], nullptr);
-        AnimatedTransform animatedInstanceToWorld(InstanceToWorld[0], 
-        renderOptions->transformStartTime, InstanceToWorld[1], renderOptions->transformEndTime);
-        std::shared_ptr<Primitive> primitive(std::make_shared<TransformedPrimitive>(instance[0], animatedInstanceToWorld));
+        //the scene aggregate is built over the instance references, so it becomes the top level
+        std::shared_ptr<Primitive> primitive;
+        if(!curTransform.IsAnimated())
+        {
+            //static instances share the cached transforms instead of owning an AnimatedTransform
+            Transform* InstanceToWorld, *WorldToInstance;
+            transformCache.Lookup(curTransform[0], &InstanceToWorld, &WorldToInstance);
+            primitive = std::make_shared<TransformedPrimitive>(instance[0], InstanceToWorld, WorldToInstance);
+        }
+        else
+        {
+            //create animatedInstanceToWorld transform for instance
+            Transform* InstanceToWorld[2];
+            transformCache.Lookup(curTransform[0], &InstanceToWorld[0], nullptr);
+            transformCache.Lookup(curTransform[1], &InstanceToWorld[1], nullptr);
+            AnimatedTransform animatedInstanceToWorld(InstanceToWorld[0], 
+            renderOptions->transformStartTime, InstanceToWorld[1], renderOptions->transformEndTime);
+            primitive = std::make_shared<TransformedPrimitive>(instance[0], animatedInstanceToWorld);
+        }
         renderOptions->primitives.push_back(primitive);
     }
 
     void pbrtWorldEnd()
     {
         VERIFY_WORLD("WorldEnd");
+        //the shapes of an edit are not a world of their own
+        if(currentApiState == APIState::EditBlock)
+        {
+            Error("pbrtWorldEnd() called inside of an edit. Ignoring.");
+            return;
+        }
         //ensure there are no pushed graphics states
         while(pushedGraphicsStates.size())
         {
@@ -562,21 +649,101 @@ namespace pbrt
         }
         //create scene and render
         std::unique_ptr<Integrator> integrator(renderOptions->MakeIntegrator());
-        std::unique_ptr<Scene> scene(renderOptions->MakeScene());
-        if(scene && integrator)
-            integrator->Render(*scene);
-        TerminateWorkerThreads();
+        renderOptions->editScene.reset(renderOptions->MakeScene());
+        if(renderOptions->editScene && integrator)
+            integrator->Render(*renderOptions->editScene);
         //clean up after rendering
         currentApiState = APIState::OptionBlock;
+        MergeWorkerThreadStats();
         ReportThreadStats();
         if(!PbrtOptions.quiet)
         {
             PrintStats(stdout);
             ReportProfilerResults(stdout);
         }
+        ClearStats();
         for(int i = 0; i < MaxTransforms; i++)
             curTransform[i] = Transform();
         activeTransformBits = AllTransformBits;
         namedCoordinateSystems.erase(namedCoordinateSystems.begin(), namedCoordinateSystems.end());
     }
+
+    //render the scene kept by pbrtWorldEnd() again after its aggregate was edited
+    static void RenderEditedScene()
+    {
+        renderOptions->editScene->AggregateChanged();
+        std::unique_ptr<Integrator> integrator(renderOptions->MakeIntegrator());
+        if(integrator)
+            integrator->Render(*renderOptions->editScene);
+        MergeWorkerThreadStats();
+        ReportThreadStats();
+        if(!PbrtOptions.quiet)
+        {
+            PrintStats(stdout);
+            ReportProfilerResults(stdout);
+        }
+        ClearStats();
+    }
+
+    void pbrtEditBegin(const std::string& name)
+    {
+        VERIFY_OPTIONS("EditBegin");
+        if(!renderOptions->editScene || !renderOptions->editAggregate)
+        {
+            Error("pbrtEditBegin() needs a scene rendered with a \"bvh\" accelerator. Ignoring.");
+            return;
+        }
+        currentApiState = APIState::EditBlock;
+        for(uint32_t i = 0; i < MaxTransforms; i++)
+            curTransform[i] = Transform();
+        activeTransformBits = AllTransformBits;
+        renderOptions->currentEdit = name;
+    }
+
+    void pbrtEditEnd()
+    {
+        VERIFY_WORLD("EditEnd");
+        if(currentApiState != APIState::EditBlock)
+        {
+            Error("pbrtEditEnd() called outside of an edit. Ignoring.");
+            return;
+        }
+        while(pushedGraphicsStates.size())
+        {
+            Warning("Missing end to pbrtAttributeBegin()");
+            pushedGraphicsStates.pop_back();
+            pushedTransforms.pop_back();
+        }
+        while(pushedTransforms.size())
+        {
+            Warning("Missing end to pbrtTransformBegin()");
+            pushedTransforms.pop_back();
+        }
+        //only area lights of the shapes of the edit can be left here, pbrtLightSource() rejects the others
+        if(!renderOptions->lights.empty())
+        {
+            Warning("Area lights not supported in scene edits");
+            renderOptions->lights.clear();
+        }
+        std::vector<std::shared_ptr<Primitive>>& inserted = renderOptions->edits[renderOptions->currentEdit];
+        renderOptions->editAggregate->Insert(renderOptions->primitives);
+        inserted.insert(inserted.end(), renderOptions->primitives.begin(), renderOptions->primitives.end());
+        renderOptions->primitives.clear();
+        currentApiState = APIState::OptionBlock;
+        RenderEditedScene();
+    }
+
+    void pbrtEditRemove(const std::string& name)
+    {
+        VERIFY_OPTIONS("EditRemove");
+        auto edit = renderOptions->edits.find(name);
+        if(!renderOptions->editScene || edit == renderOptions->edits.end())
+        {
+            Error("Unable to find scene edit named \"%s\". Ignoring.", name.c_str());
+            return;
+        }
+        renderOptions->editAggregate->Remove(edit->second);
+        renderOptions->edits.erase(edit);
+        RenderEditedScene();
+    }
 }
@@ -122,4 +122,14 @@ namespace pbrt
 
     //end the world decription and create rendering scene and render
     void pbrtWorldEnd();
+
+    //start an edit of the scene rendered by the last pbrtWorldEnd(), the shapes and object instances
+    //given until pbrtEditEnd() are inserted into its aggregate as the group name instead of making a new scene
+    void pbrtEditBegin(const std::string& name);
+
+    //insert the shapes of the current edit into the scene and render it again
+    void pbrtEditEnd();
+
+    //remove the shapes inserted by the edits named name from the scene and render it again
+    void pbrtEditRemove(const std::string& name);
 }
@@ -1009,6 +1009,10 @@ namespace pbrt
 	};
 
 
+	//the maximum count of coherent rays that are traced together as a packet
+	static constexpr int MaxRayPacketSize = 16;
+
+
 	//aabb
 
 	//with left-handed, pMin(x, y, z) --> left bottom front, pMax(x, y, z) --> right top back
@@ -1084,6 +1088,7 @@ namespace pbrt
 			if (pMax.x > pMin.x) o.x /= pMax.x - pMin.x;
 			if (pMax.y > pMin.y) o.y /= pMax.y - pMin.y;
 			if (pMax.z > pMin.z) o.z /= pMax.z - pMin.z;
+			return o;
 		}
 
 		void BoundingSphere(Point3<T>* center, Float* radius) const
@@ -1118,16 +1123,16 @@ namespace pbrt
 		{
 			Float txMin = (this->operator[](dirIsNegative[0]).x - ray.o.x) * invDir.x;
 			Float txMax = (this->operator[](1u - dirIsNegative[0]).x - ray.o.x) * invDir.x;
-			Float tyMin = (this->operator[](dirIsNegative[0]).y - ray.o.y) * invDir.y;
-			Float tyMax = (this->operator[](1u - dirIsNegative[0]).y - ray.o.y) * invDir.y;
+			Float tyMin = (this->operator[](dirIsNegative[1]).y - ray.o.y) * invDir.y;
+			Float tyMax = (this->operator[](1u - dirIsNegative[1]).y - ray.o.y) * invDir.y;
 
 			if (txMin > tyMax || tyMin > txMax)
 				return false;
 			Float tMin = tyMin > txMin ? tyMin : txMin;
 			Float tMax = tyMax < txMax ? tyMax : txMax;
 
-			Float tzMin = (this->operator[](dirIsNegative[0]).z - ray.o.z) * invDir.z;
-			Float tzMax = (this->operator[](1u - dirIsNegative[0]).z - ray.o.z) * invDir.z;
+			Float tzMin = (this->operator[](dirIsNegative[2]).z - ray.o.z) * invDir.z;
+			Float tzMax = (this->operator[](1u - dirIsNegative[2]).z - ray.o.z) * invDir.z;
 			if (tMin > tzMax || tzMin > tMax)
 				return false;
 			tMin = std::max(tMin, tzMin);
@@ -1173,22 +1178,22 @@ namespace pbrt
 	inline Bounds3<T> Union(const Bounds3<T>& b1, const Bounds3<T>& b2)
 	{
 		return Bounds3<T>(Point3<T>(std::min(b1.pMin.x, b2.pMin.x),
-			std::min(b1.pMin.y, b2.pMin.x),
-			std::min(b1.pMin.z, b2.pMin.x)),
+			std::min(b1.pMin.y, b2.pMin.y),
+			std::min(b1.pMin.z, b2.pMin.z)),
 			Point3<T>(std::max(b1.pMax.x, b2.pMax.x),
-				std::max(b1.pMax.y, b2.pMax.x),
-				std::max(b1.pMax.z, b2.pMax.x)));
+				std::max(b1.pMax.y, b2.pMax.y),
+				std::max(b1.pMax.z, b2.pMax.z)));
 	}
 
 	template<typename T>
 	inline Bounds3<T> Intersect(const Bounds3<T>& b1, const Bounds3<T>& b2)
 	{
 		return Bounds3<T>(Point3<T>(std::max(b1.pMin.x, b2.pMin.x),
-			std::max(b1.pMin.y, b2.pMin.x),
-			std::max(b1.pMin.z, b2.pMin.x)),
+			std::max(b1.pMin.y, b2.pMin.y),
+			std::max(b1.pMin.z, b2.pMin.z)),
 			Point3<T>(std::min(b1.pMax.x, b2.pMax.x),
-				std::min(b1.pMax.y, b2.pMax.x),
-				std::min(b1.pMax.z, b2.pMax.x)));
+				std::min(b1.pMax.y, b2.pMax.y),
+				std::min(b1.pMax.z, b2.pMax.z)));
 	}
 
 	template<typename T>
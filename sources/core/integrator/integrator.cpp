@@ -17,9 +17,6 @@ namespace pbrt
             //render section of image corresponding to tile
             //allocate MemoryArena for tile
             MemoryArena arena;
-            //get sampler instance for tile
-            int seed = tile.y * nTiles + tile.z;
-            std::unique_ptr<Sampler> tileSampler = sampler->Clone();
             //compute sample bounds for tile
             int x0 = sampleBounds.pMin.x + tile.x * tileSize;
             int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
@@ -28,29 +25,86 @@ namespace pbrt
             Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
             //get FilmTile for tile
             std::unique_ptr<FilmTile> filmTile = camera->film->GetFilmTile(tileBounds);
+            //packets hold the samples of several neighbouring pixels when a pixel has fewer samples than a packet,
+            //so even a single sample per pixel fills them
+            int64_t samplesPerPixel = sampler->samplesPerPixel;
+            int pixelsPerPacket = (int)std::max<int64_t>(1, MaxRayPacketSize / samplesPerPixel);
+            int samplesPerPacket = (int)std::min<int64_t>(MaxRayPacketSize, samplesPerPixel);
+            //get sampler instance for every pixel of a packet, so Li continues the dimensions of its own camera sample
+            std::unique_ptr<Sampler> pixelSamplers[MaxRayPacketSize];
+            for (int i = 0; i < pixelsPerPacket; i++)
+                pixelSamplers[i] = sampler->Clone();
+            //visit the pixels of the tile in Morton order, so the pixels of a packet form a compact block
+            std::vector<Point2i> pixels;
+            pixels.reserve(tileSize * tileSize);
+            for (int i = 0; i < tileSize * tileSize; i++)
+            {
+                int dx = 0, dy = 0;
+                for (int bit = 0; (1 << bit) < tileSize; bit++)
+                {
+                    dx |= ((i >> (2 * bit)) & 1) << bit;
+                    dy |= ((i >> (2 * bit + 1)) & 1) << bit;
+                }
+                if (x0 + dx < x1 && y0 + dy < y1)
+                    pixels.push_back(Point2i(x0 + dx, y0 + dy));
+            }
             //loop over pixels in tile to render them
-            for (Point2i pixel : tileBounds)
+            for (size_t firstPixel = 0; firstPixel < pixels.size(); firstPixel += pixelsPerPacket)
             {
-                tileSampler->StartPixel(pixel);
-                do
+                int nPixels = (int)std::min<size_t>(pixelsPerPacket, pixels.size() - firstPixel);
+                for (int p = 0; p < nPixels; p++)
+                    pixelSamplers[p]->StartPixel(pixels[firstPixel + p]);
+                //trace camera rays of the pixels in coherent packets
+                for (int64_t firstSample = 0; firstSample < samplesPerPixel; firstSample += samplesPerPacket)
                 {
-                    //initialize CameraSample for current sample
-                    CameraSample cameraSample = tileSampler->GetCameraSample(pixel);
-                    //generate camera ray for current sample
-                    RayDifferential ray;
-                    Float rayWeight = camera->GenerateRayDifferential(cameraSample, &ray);
-                    ray.ScaleDifferentials(1.f / std::sqrt(tileSampler->samplesPerPixel));
-                    //evaluate radiance along camera ray
-                    Spectrum L(0.f);
-                    if (rayWeight > 0)
-                        L = Li(ray, scene, *tileSampler, arena);
-                    //issue warning if unexpected radiance value is returned
-
-                    //add camera ray's contribution to image
-                    filmTile->AddSample(CameraSample.pFilm, L, rayWeight);
-                    //free MemoryArena memory from computing image sample value
-                    arena.Reset();
-                } while (tileSampler->StartNextSample());
+                    int nSamples = (int)std::min<int64_t>(samplesPerPacket, samplesPerPixel - firstSample);
+                    int nEntries = nPixels * nSamples;
+                    CameraSample cameraSamples[MaxRayPacketSize];
+                    RayDifferential rays[MaxRayPacketSize];
+                    Float rayWeights[MaxRayPacketSize];
+                    //generate camera rays for current samples, entry p * nSamples + i is sample i of pixel p
+                    const Ray* packet[MaxRayPacketSize];
+                    int packetIndices[MaxRayPacketSize];
+                    int nRays = 0;
+                    for (int j = 0; j < nEntries; j++)
+                    {
+                        Point2i pixel = pixels[firstPixel + j / nSamples];
+                        Sampler& pixelSampler = *pixelSamplers[j / nSamples];
+                        pixelSampler.SetSampleNumber(firstSample + j % nSamples);
+                        cameraSamples[j] = pixelSampler.GetCameraSample(pixel);
+                        rayWeights[j] = camera->GenerateRayDifferential(cameraSamples[j], &rays[j]);
+                        rays[j].ScaleDifferentials(1.f / std::sqrt(samplesPerPixel));
+                        if (rayWeights[j] > 0)
+                        {
+                            packetIndices[nRays] = j;
+                            packet[nRays++] = &rays[j];
+                        }
+                    }
+                    //find closest intersections of the whole packet at once
+                    SurfaceInteraction isects[MaxRayPacketSize];
+                    bool hits[MaxRayPacketSize];
+                    if (nRays > 0)
+                        scene.IntersectPacket(packet, nRays, isects, hits);
+                    for (int j = 0, k = 0; j < nEntries; j++)
+                    {
+                        //restore sampler state so Li draws the same dimensions as a ray traced alone
+                        Point2i pixel = pixels[firstPixel + j / nSamples];
+                        Sampler& pixelSampler = *pixelSamplers[j / nSamples];
+                        pixelSampler.SetSampleNumber(firstSample + j % nSamples);
+                        pixelSampler.GetCameraSample(pixel);
+                        //evaluate radiance along camera ray
+                        Spectrum L(0.f);
+                        if (k < nRays && packetIndices[k] == j)
+                        {
+                            L = LiFromHit(rays[j], hits[k], isects[k], scene, pixelSampler, arena);
+                            k++;
+                        }
+                        //add camera ray's contribution to image
+                        filmTile->AddSample(cameraSamples[j].pFilm, L, rayWeights[j]);
+                        //free MemoryArena memory from computing image sample value
+                        arena.Reset();
+                    }
+                }
             }
             //merge image tile into Film
             camera->film->MergeFilmTile(std::move(filmTile));
@@ -22,6 +22,9 @@ namespace pbrt
         void Render(const Scene& scene);
         //Li
         virtual Spectrum Li(const RayDifferential& ray, const Scene& scene, Sampler& sampler, MemoryArena& arena, uint32_t depth = 0) const = 0;
+        //Li for a camera ray whose closest intersection was already found by a packet query,
+        //every integrator continues from the hit itself, so camera rays are never traced twice
+        virtual Spectrum LiFromHit(const RayDifferential& ray, bool hit, SurfaceInteraction& isect, const Scene& scene, Sampler& sampler, MemoryArena& arena, uint32_t depth = 0) const = 0;
         //specular reflection
         Spectrum SpecularReflect(const RayDifferential& ray, const SurfaceInteraction& isect, const Scene& scene, Sampler& sampler, MemoryArena& arena, uint32_t depth) const;
     protected:
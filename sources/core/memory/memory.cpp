@@ -1,4 +1,14 @@
 #include"memory.h"
+#if defined(PBRT_IS_WINDOWS)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include<windows.h>
+#else
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+#endif
 
 namespace pbrt
 {
@@ -28,6 +38,198 @@ namespace pbrt
         #endif
     }
 
+    void* AllocLocal(size_t size)
+    {
+        //implementation differs with different platform
+        #if defined(PBRT_IS_WINDOWS)
+        PROCESSOR_NUMBER processor;
+        GetCurrentProcessorNumberEx(&processor);
+        USHORT node;
+        void* ptr = nullptr;
+        if(GetNumaProcessorNodeEx(&processor, &node))
+            ptr = VirtualAllocExNuma(GetCurrentProcess(), nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+        if(!ptr)
+            ptr = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        if(!ptr)
+            return nullptr;
+        size_t pageSize = 4096;
+        #else
+        //fresh anonymous pages are placed on the node of the thread that touches them first
+        void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(ptr == MAP_FAILED)
+            return nullptr;
+        size_t pageSize = sysconf(_SC_PAGESIZE);
+        #endif
+        for(size_t offset = 0; offset < size; offset += pageSize)
+            static_cast<volatile uint8_t*>(ptr)[offset] = 0;
+        return ptr;
+    }
+
+    void FreeLocal(void* ptr, size_t size)
+    {
+        if(!ptr)
+            return;
+        #if defined(PBRT_IS_WINDOWS)
+        VirtualFree(ptr, 0, MEM_RELEASE);
+        #else
+        munmap(ptr, size);
+        #endif
+    }
+
+    MappedFile::~MappedFile()
+    {
+        Unmap();
+    }
+
+    bool MappedFile::Map(const std::string& filename)
+    {
+        Unmap();
+        //implementation differs with different platform
+        #if defined(PBRT_IS_WINDOWS)
+        HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL, nullptr);
+        if(file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER fileSize;
+        if(!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+        {
+            CloseHandle(file);
+            return false;
+        }
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+        if(!mapping)
+        {
+            CloseHandle(file);
+            return false;
+        }
+        void* view = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+        if(!view)
+        {
+            CloseHandle(mapping);
+            CloseHandle(file);
+            return false;
+        }
+        fileHandle = file;
+        mappingHandle = mapping;
+        data = view;
+        size = (size_t)fileSize.QuadPart;
+        #else
+        int fd = open(filename.c_str(), O_RDONLY);
+        if(fd < 0)
+            return false;
+        struct stat fileStat;
+        if(fstat(fd, &fileStat) != 0 || fileStat.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+        void* view = mmap(nullptr, fileStat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        //the mapping keeps its own reference to the file
+        close(fd);
+        if(view == MAP_FAILED)
+            return false;
+        data = view;
+        size = fileStat.st_size;
+        #endif
+        return true;
+    }
+
+    bool MappedFile::Create(const std::string& filename, size_t size)
+    {
+        Unmap();
+        if(size == 0)
+            return false;
+        //implementation differs with different platform
+        #if defined(PBRT_IS_WINDOWS)
+        HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                                  FILE_ATTRIBUTE_NORMAL, nullptr);
+        if(file == INVALID_HANDLE_VALUE)
+            return false;
+        //the mapping extends the file to its size
+        LARGE_INTEGER fileSize;
+        fileSize.QuadPart = size;
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, fileSize.HighPart, fileSize.LowPart, nullptr);
+        if(!mapping)
+        {
+            CloseHandle(file);
+            return false;
+        }
+        void* view = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0);
+        if(!view)
+        {
+            CloseHandle(mapping);
+            CloseHandle(file);
+            return false;
+        }
+        fileHandle = file;
+        mappingHandle = mapping;
+        #else
+        int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0)
+            return false;
+        if(ftruncate(fd, size) != 0)
+        {
+            close(fd);
+            return false;
+        }
+        void* view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(view == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+        //kept open to cut the file in Truncate
+        fileDescriptor = fd;
+        #endif
+        data = view;
+        this->size = size;
+        return true;
+    }
+
+    bool MappedFile::Truncate(size_t fileSize)
+    {
+        if(!data)
+            return false;
+        #if defined(PBRT_IS_WINDOWS)
+        UnmapViewOfFile(data);
+        CloseHandle(mappingHandle);
+        LARGE_INTEGER position;
+        position.QuadPart = fileSize;
+        bool success = SetFilePointerEx(fileHandle, position, nullptr, FILE_BEGIN) && SetEndOfFile(fileHandle);
+        CloseHandle(fileHandle);
+        mappingHandle = fileHandle = nullptr;
+        #else
+        if(fileDescriptor < 0)
+            return false;
+        munmap(data, size);
+        bool success = ftruncate(fileDescriptor, fileSize) == 0;
+        close(fileDescriptor);
+        fileDescriptor = -1;
+        #endif
+        data = nullptr;
+        size = 0;
+        return success;
+    }
+
+    void MappedFile::Unmap()
+    {
+        if(!data)
+            return;
+        #if defined(PBRT_IS_WINDOWS)
+        UnmapViewOfFile(data);
+        CloseHandle(mappingHandle);
+        CloseHandle(fileHandle);
+        mappingHandle = fileHandle = nullptr;
+        #else
+        munmap(data, size);
+        if(fileDescriptor >= 0)
+            close(fileDescriptor);
+        fileDescriptor = -1;
+        #endif
+        data = nullptr;
+        size = 0;
+    }
+
     void* MemoryArena::Alloc(size_t nBytes)
     {
         //round up nBytes to minimum machine alignment
@@ -65,7 +267,10 @@ namespace pbrt
             if(!currentBlock)
             {
                 currentAllocSize = std::max(nBytes, blockSize);
-                currentBlock = AllocAligned<uint8_t>(currentAllocSize);
+                if(localBlocks)
+                    currentBlock = static_cast<uint8_t*>(AllocLocal(currentAllocSize));
+                else
+                    currentBlock = AllocAligned<uint8_t>(currentAllocSize);
             }
 
             currentBlockPos = 0;
@@ -94,10 +299,17 @@ namespace pbrt
 
     MemoryArena::~MemoryArena()
     {
-        FreeAligned(currentBlock);
+        auto freeBlock = [&](size_t size, uint8_t* block)
+        {
+            if(localBlocks)
+                FreeLocal(block, size);
+            else
+                FreeAligned(block);
+        };
+        freeBlock(currentAllocSize, currentBlock);
         for(auto& block : usedBlocks)
-            FreeAligned(block.second);
+            freeBlock(block.first, block.second);
         for(auto& block : availbleBlocks)
-            FreeAligned(block.second);
+            freeBlock(block.first, block.second);
     }
 }
\ No newline at end of file
@@ -18,12 +18,50 @@ namespace pbrt
     //free memory
     void FreeAligned(void*);
 
+    //allocate page-aligned memory on the NUMA node of the calling thread, its pages are touched
+    //before it returns, so they stay on that node as long as the thread is pinned
+    void* AllocLocal(size_t size);
+
+    //free memory of AllocLocal, size is the size it was allocated with
+    void FreeLocal(void* ptr, size_t size);
+
+    //a whole file mapped into memory, the pages of Map are copy-on-write so the data can be changed without touching the file
+    class MappedFile
+    {
+    public:
+        MappedFile() = default;
+        ~MappedFile();
+        //map filename, return false if it can't be opened or mapped
+        bool Map(const std::string& filename);
+        //create filename with size bytes and map it shared, so the writes to the data go to the file
+        bool Create(const std::string& filename, size_t size);
+        //unmap a mapping of Create and cut its file to fileSize bytes
+        bool Truncate(size_t fileSize);
+        void Unmap();
+        void* Data() const { return data; }
+        size_t Size() const { return size; }
+    private:
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        void* data = nullptr;
+        size_t size = 0;
+        #if defined(PBRT_IS_WINDOWS)
+        void* fileHandle = nullptr;
+        void* mappingHandle = nullptr;
+        #else
+        //only kept open for mappings of Create
+        int fileDescriptor = -1;
+        #endif
+    };
+
     //arena-based memory allocation
     class MemoryArena
     {
     public:
         //allocate a block of memory with initial 256kb
         MemoryArena(size_t blockSize = 262144ull) : blockSize(blockSize) { }
+        ~MemoryArena();
         //allocate nBytes from block, and return the head pointer of the allocated nbytes
         void* Alloc(size_t nBytes);
         //allocate an array of objects of the given type
@@ -59,6 +97,8 @@ namespace pbrt
         std::list<std::pair<size_t, uint8_t*>> usedBlocks;
         //a list for further usage
         std::list<std::pair<size_t, uint8_t*>> availbleBlocks;
+        //with pinned threads the blocks are allocated on the NUMA node of the thread that uses the arena
+        const bool localBlocks = PbrtOptions.pinThreads;
     };
 
     //a class subdivide multiple dimension array into small block to decrease cache miss
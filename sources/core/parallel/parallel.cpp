@@ -1,157 +1,542 @@
 #include"parallel.h"
-#include<thread>
-#include<mutex>
+#include"core/statistics/stats.h"
+#include<deque>
+#include<chrono>
+#if defined(PBRT_IS_WINDOWS)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include<windows.h>
+#elif defined(__linux__)
+#include<sched.h>
+#include<pthread.h>
+#include<dirent.h>
+#include<cstdio>
+#include<cstdlib>
+#include<fstream>
+#include<sys/resource.h>
+#include<sys/syscall.h>
+#include<unistd.h>
+#endif
 
 namespace pbrt
 {
+    STAT_COUNTER("Parallel/Loop chunks", nLoopChunks);
+    STAT_COUNTER("Parallel/Tasks stolen", nStolenTasks);
+
     //parallel local definitions
 
-    //worked threads
-    static std::vector<std::thread> threads;
-    static bool shutdownThreads = false;
     //thread_local just like static, is a thread-dependent qualifier
     //whose life-time is dependent on connected thread
-    extern thread_local int ThreadIndex;
-    //workList holds a pointer to the head of a list of parallel "for" loops
-    class ParallelForLoop;
-    static ParallelForLoop* workList = nullptr;
-    static std::mutex workListMutex;
-    //signal for waking up worker threads
-    static std::condition_variable workListCondition;
+    //index of the thread and its work queue in its pool, 0 for the threads outside of any pool
+    thread_local int ThreadIndex = 0;
+
+    //a spawned task and the group that waits on it
+    struct Task
+    {
+        Task(std::function<void()> function, TaskGroup* group) : function(std::move(function)), group(group) { }
+        //run the task and delete it, the group may be gone as soon as it sees the task finished
+        void Run()
+        {
+            function();
+            TaskGroup* taskGroup = group;
+            delete this;
+            //count down under the lock of the group, Wait() takes the lock before it returns,
+            //so the group outlives the notification
+            std::lock_guard<std::mutex> lock(taskGroup->mutex);
+            if(taskGroup->pending.fetch_sub(1, std::memory_order_release) == 1)
+                taskGroup->finished.notify_all();
+        }
+
+        std::function<void()> function;
+        TaskGroup* group;
+    };
+
+    //the tasks spawned by a thread, the owner pushes and pops at the back so it runs its newest task first,
+    //thieves take from the front, the oldest tasks are the least likely to share data with what the owner runs
+    //every queue has its own lock, so threads only contend when they pick from the same queue
+    class WorkQueue
+    {
+    public:
+        void Push(Task* task)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(task);
+        }
+        Task* Pop()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(tasks.empty())
+                return nullptr;
+            Task* task = tasks.back();
+            tasks.pop_back();
+            return task;
+        }
+        Task* Steal()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(tasks.empty())
+                return nullptr;
+            Task* task = tasks.front();
+            tasks.pop_front();
+            return task;
+        }
+    private:
+        std::mutex mutex;
+        std::deque<Task*> tasks;
+    };
+
+    //times TaskGroup::Wait() yields without finding a task before it sleeps
+    static constexpr int WaitSpins = 256;
+
+    //the pool loops and task groups of threads outside of any pool run on
+    static std::unique_ptr<ThreadPool> defaultPool;
+    //the pool of a worker thread, nullptr for the threads outside of any pool
+    static thread_local ThreadPool* CurrentPool = nullptr;
 
     //perform loop for single thread
     class ParallelForLoop
     {
     public:
-        ParallelForLoop(std::function<void(int)> func1D, int64_t maxIndex, int chunkSize, uint64_t profilerState)
+        ParallelForLoop(const std::function<void(int)>& func1D, int64_t maxIndex, int chunkSize, uint64_t profilerState)
         : function1D(func1D), maxIndex(maxIndex), chunkSize(chunkSize), profilerState(profilerState) { }
         //for 2D
         ParallelForLoop(const std::function<void(Point2i)>& func2D, const Point2i& count, uint64_t profilerState)
-        : function2D(func2D), maxIndex(count.x * count.y), chunkSize(1), profilerState(profilerState)
+        : function2D(func2D), maxIndex(count.x * count.y), chunkSize(AdaptiveChunkSize), profilerState(profilerState)
         { xSum = count.x; }
-        bool Finished() const { return nextIndex >= maxIndex && activeWorkers == 0; }
+        //claim the set of loop iterations to run next, return false once all of them are claimed
+        bool Claim(int64_t* indexStart, int64_t* indexEnd)
+        {
+            if(chunkSize != AdaptiveChunkSize)
+            {
+                //a single atomic add without any lock
+                *indexStart = nextIndex.fetch_add(chunkSize, std::memory_order_relaxed);
+                if(*indexStart >= maxIndex)
+                    return false;
+                *indexEnd = std::min(*indexStart + chunkSize, maxIndex);
+                return true;
+            }
+            //guided chunk, a share of the remaining iterations for every thread
+            int64_t start = nextIndex.load(std::memory_order_relaxed);
+            int64_t size;
+            do
+            {
+                if(start >= maxIndex)
+                    return false;
+                size = std::max((maxIndex - start) / (2 * nThreads), minChunkSize.load(std::memory_order_relaxed));
+                size = std::min(size, maxIndex - start);
+            } while(!nextIndex.compare_exchange_weak(start, start + size, std::memory_order_relaxed));
+            *indexStart = start;
+            *indexEnd = start + size;
+            return true;
+        }
+        //run chunks of loop iterations until all of them are claimed
+        void Run()
+        {
+            //iterations are profiled as the phase that started the loop
+            uint64_t oldProfilerState = ProfilerState;
+            ProfilerState = profilerState;
+            int64_t indexStart, indexEnd;
+            while(Claim(&indexStart, &indexEnd))
+            {
+                ++nLoopChunks;
+                std::chrono::steady_clock::time_point startTime;
+                if(chunkSize == AdaptiveChunkSize)
+                    startTime = std::chrono::steady_clock::now();
+                //run loop indices in [indexStart, indexEnd]
+                for(int64_t index = indexStart; index < indexEnd; index++)
+                {
+                    if(function1D)
+                        function1D(index);
+                    //handle other types of loops
+                    else if(function2D)
+                        function2D(Point2i(index % xSum, index / xSum));
+                }
+                if(chunkSize == AdaptiveChunkSize)
+                {
+                    //the smallest chunk takes about AdaptiveChunkTime at the latest measured time per iteration,
+                    //so the chunks of cheap iterations stay large enough to hide the cost of claiming them
+                    std::chrono::duration<double> time = std::chrono::steady_clock::now() - startTime;
+                    double iterationTime = time.count() / (indexEnd - indexStart);
+                    int64_t size = iterationTime > 0 ? (int64_t)std::min<double>(AdaptiveChunkTime / iterationTime, maxIndex) : maxIndex;
+                    minChunkSize.store(std::max<int64_t>(size, 1), std::memory_order_relaxed);
+                }
+            }
+            ProfilerState = oldProfilerState;
+        }
     public:
-        std::function<void(int)> function1D;
-        std::function<void(Point2i)> function2D;
+        const std::function<void(int)> function1D;
+        const std::function<void(Point2i)> function2D;
         //2D image pixels count of x direction
-        int xSum = -1; 
+        int xSum = -1;
         //max count of computation required execution
         const int64_t maxIndex;
-        //the computation of required exection of every single loop 
+        //the computation of required exection of every single loop, AdaptiveChunkSize for guided chunks
         const int chunkSize;
         const uint64_t profilerState;
-        //the next loop index to be executed
-        int64_t nextIndex = 0;
-        //the amount of current worker threads which is running loop
-        int activeWorkers = 0;
-        ParallelForLoop* next = nullptr;
+        //the next loop index to be executed, it runs past maxIndex once every chunk is claimed
+        std::atomic<int64_t> nextIndex{0};
+        //count of threads running the loop, guided chunks are shared among them
+        int nThreads = 1;
+        //the smallest guided chunk, updated from the timing of the chunks run so far
+        std::atomic<int64_t> minChunkSize{1};
+    };
+
+    //a logical processor and the NUMA node it belongs to
+    struct Processor
+    {
+        //processor group on Windows, 0 elsewhere
+        int group;
+        int number;
+        int node;
     };
-    
 
-    static void workerThreadFunc(int tIndex)
+    //the processors worker threads are pinned to when PbrtOptions.pinThreads is set, ordered by node
+    static std::vector<Processor> processors;
+
+    #if defined(__linux__)
+    //parse a cpu list of sysfs like "0-3,8-11"
+    static std::vector<int> parseCpuList(const std::string& list)
+    {
+        std::vector<int> cpus;
+        size_t position = 0;
+        while(position < list.size())
+        {
+            size_t end = list.find(',', position);
+            if(end == std::string::npos)
+                end = list.size();
+            std::string range = list.substr(position, end - position);
+            size_t dash = range.find('-');
+            int first = std::atoi(range.c_str());
+            int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+            for(int cpu = first; cpu <= last; cpu++)
+                cpus.push_back(cpu);
+            position = end + 1;
+        }
+        return cpus;
+    }
+    #endif
+
+    //find the processors this process may run on and their NUMA nodes
+    static std::vector<Processor> systemProcessors()
+    {
+        std::vector<Processor> result;
+        #if defined(PBRT_IS_WINDOWS)
+        DWORD length = 0;
+        GetLogicalProcessorInformationEx(RelationNumaNode, nullptr, &length);
+        std::vector<char> buffer(length);
+        if(length > 0 && GetLogicalProcessorInformationEx(RelationNumaNode,
+            reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data()), &length))
+        {
+            for(DWORD offset = 0; offset < length;)
+            {
+                auto* info = reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data() + offset);
+                const GROUP_AFFINITY& mask = info->NumaNode.GroupMask;
+                for(int bit = 0; bit < 64; bit++)
+                {
+                    if(mask.Mask & (KAFFINITY(1) << bit))
+                        result.push_back({ (int)mask.Group, bit, (int)info->NumaNode.NodeNumber });
+                }
+                offset += info->Size;
+            }
+        }
+        #elif defined(__linux__)
+        //only the cpus of the affinity mask, a cpuset of the cgroup may exclude some of them
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+            return result;
+        std::vector<int> cpuNodes(CPU_SETSIZE, 0);
+        if(DIR* directory = opendir("/sys/devices/system/node"))
+        {
+            while(dirent* entry = readdir(directory))
+            {
+                int node;
+                if(sscanf(entry->d_name, "node%d", &node) != 1)
+                    continue;
+                std::ifstream file(std::string("/sys/devices/system/node/") + entry->d_name + "/cpulist");
+                std::string list;
+                std::getline(file, list);
+                for(int cpu : parseCpuList(list))
+                {
+                    if(cpu >= 0 && cpu < CPU_SETSIZE)
+                        cpuNodes[cpu] = node;
+                }
+            }
+            closedir(directory);
+        }
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if(CPU_ISSET(cpu, &allowed))
+                result.push_back({ 0, cpu, cpuNodes[cpu] });
+        }
+        #endif
+        //consecutive thread indices share a node
+        std::stable_sort(result.begin(), result.end(), [](const Processor& p0, const Processor& p1)
+        {
+            return p0.node < p1.node;
+        });
+        return result;
+    }
+
+    //pin the current thread to the NUMA node of the processor of its index, if the processors are known,
+    //the thread may run on any processor of the node, so the scheduler still spreads the threads of several
+    //processes that share the node instead of stacking them on the same cores
+    static void pinThread(int tIndex)
+    {
+        if(processors.empty())
+            return;
+        const Processor& processor = processors[tIndex % processors.size()];
+        #if defined(PBRT_IS_WINDOWS)
+        GROUP_AFFINITY affinity = {};
+        affinity.Group = (WORD)processor.group;
+        for(const Processor& p : processors)
+        {
+            if(p.node == processor.node && p.group == processor.group)
+                affinity.Mask |= KAFFINITY(1) << p.number;
+        }
+        if(!SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr))
+            Warn("Unable to pin thread {} to NUMA node {}.", tIndex, processor.node);
+        #elif defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for(const Processor& p : processors)
+        {
+            if(p.node == processor.node)
+                CPU_SET(p.number, &set);
+        }
+        if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            Warn("Unable to pin thread {} to NUMA node {}.", tIndex, processor.node);
+        #endif
+    }
+
+    //apply priority to the calling thread
+    static void setThreadPriority(ThreadPriority priority)
+    {
+        #if defined(PBRT_IS_WINDOWS)
+        int windowsPriority = priority == ThreadPriority::Low ? THREAD_PRIORITY_BELOW_NORMAL :
+                              priority == ThreadPriority::High ? THREAD_PRIORITY_ABOVE_NORMAL : THREAD_PRIORITY_NORMAL;
+        if(!SetThreadPriority(GetCurrentThread(), windowsPriority))
+            Warn("Unable to set the priority of thread {}.", ThreadIndex);
+        #elif defined(__linux__)
+        //threads have their own nice value on linux, any decrease of it needs CAP_SYS_NICE or a large enough
+        //RLIMIT_NICE, so without them a thread can't go from Low back to Normal, nor to High at all
+        int nice = priority == ThreadPriority::Low ? 10 : priority == ThreadPriority::High ? -5 : 0;
+        if(setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), nice) != 0)
+            Warn("Unable to set the nice value of thread {} to {}, lowering it needs privileges.", ThreadIndex, nice);
+        #endif
+    }
+
+    ThreadPool::ThreadPool(int nThreads, ThreadPriority priority) : priority(priority)
+    {
+        launch(nThreads);
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        stop();
+    }
+
+    void ThreadPool::Resize(int nThreads)
+    {
+        stop();
+        launch(nThreads);
+    }
+
+    void ThreadPool::SetPriority(ThreadPriority priority)
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            this->priority = priority;
+        }
+        //wake the sleeping workers to apply it
+        sleepCondition.notify_all();
+    }
+
+    void ThreadPool::launch(int nThreads)
+    {
+        if(nThreads <= 0)
+            nThreads = NumSystemCores();
+        for(int i = 0; i < nThreads; i++)
+            workQueues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue));
+        //except for current execution thread
+        for(int i = 1; i < nThreads; i++)
+            threads.push_back(std::thread(&ThreadPool::workerThreadFunc, this, i, (int)statsRequests));
+    }
+
+    void ThreadPool::stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            shutdownThreads = true;
+        }
+        sleepCondition.notify_all();
+        for(std::thread& thread : threads)
+            thread.join();
+        Assert(nQueuedTasks == 0);
+        threads.clear();
+        workQueues.clear();
+        shutdownThreads = false;
+    }
+
+    void ThreadPool::workerThreadFunc(int tIndex, int reportedStats)
     {
         ThreadIndex = tIndex;
-        std::unique_lock<std::mutex> lock(workListMutex);
+        CurrentPool = this;
+        //pin before the thread touches any memory, so its first touches are on its node
+        pinThread(tIndex);
+        ThreadPriority appliedPriority = ThreadPriority::Normal;
         while(!shutdownThreads)
         {
-            if(!workList)
+            if(priority != appliedPriority)
             {
-                //sleep until there are more tasks to run
-                workListCondition.wait(lock);
+                appliedPriority = priority;
+                setThreadPriority(appliedPriority);
             }
-            else
+            if(statsRequests != reportedStats)
             {
-                //get work form worklist and run loop iterations
-                ParallelForLoop& loop = *workList;
-                //run a chunk of loop iterations
-                //find the set of loop iterations to run next
-                int64_t indexStart = loop.nextIndex;
-                int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
-                //update loop to reflect iterations this thread will run
-                loop.nextIndex = indexEnd;
-                if(loop.nextIndex == loop.maxIndex)
-                    workList = loop.next;
-                loop.activeWorkers++;
-                //run loop indices in [indexStart, indexEnd]
-                lock.unlock();
-                for(int index = indexStart; index < indexEnd; index ++)
+                reportedStats = statsRequests;
+                ReportThreadStats();
                 {
-                    if(loop.function1D)
-                        loop.function1D(index);
-                    //handle other types of loops
-                    else if(loop.function2D)
-                        loop.function2D(Point2i(index % loop.xSum, index / loop.xSum));
+                    std::lock_guard<std::mutex> lock(sleepMutex);
+                    nStatsReports++;
                 }
-                lock.lock();
-                //update loop to reflect completion of iterations
-                loop.activeWorkers--;
-                
-                if(loop.Finished())
-                    workListCondition.notify_all();
+                statsCondition.notify_all();
+            }
+            if(Task* task = findTask())
+            {
+                task->Run();
+                continue;
             }
+            //sleep until there are more tasks to run
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            nSleepingWorkers++;
+            sleepCondition.wait(lock, [&]()
+            {
+                return nQueuedTasks > 0 || shutdownThreads || priority != appliedPriority || statsRequests != reportedStats;
+            });
+            nSleepingWorkers--;
         }
         //report thread statistics at work thread exit
         ReportThreadStats();
     }
 
+    void ThreadPool::ReportWorkerStats()
+    {
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        nStatsReports = 0;
+        statsRequests++;
+        sleepCondition.notify_all();
+        statsCondition.wait(lock, [&]() { return nStatsReports == (int)threads.size(); });
+    }
+
+    void ThreadPool::push(Task* task)
+    {
+        int self = CurrentPool == this ? ThreadIndex : 0;
+        workQueues[self]->Push(task);
+        nQueuedTasks++;
+        //a worker going to sleep counts itself before it checks nQueuedTasks, so it either sees the task or is woken
+        if(nSleepingWorkers > 0)
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            sleepCondition.notify_one();
+        }
+    }
+
+    Task* ThreadPool::findTask()
+    {
+        int nQueues = workQueues.size();
+        int self = CurrentPool == this ? ThreadIndex : 0;
+        Task* task = workQueues[self]->Pop();
+        //start with the next queue, so thieves spread over the victims
+        for(int i = 1; i < nQueues && !task; i++)
+        {
+            task = workQueues[(self + i) % nQueues]->Steal();
+            if(task)
+                ++nStolenTasks;
+        }
+        if(task)
+            nQueuedTasks--;
+        return task;
+    }
+
+    //the pool of the calling thread
+    static ThreadPool* callerPool()
+    {
+        return CurrentPool ? CurrentPool : DefaultThreadPool();
+    }
+
+    TaskGroup::TaskGroup(ThreadPool* pool) : pool(pool ? pool : callerPool()) { }
+
+    void TaskGroup::Run(std::function<void()> task)
+    {
+        //run immediately if the pool has no workers
+        if(pool->Size() == 1)
+        {
+            task();
+            return;
+        }
+        pending.fetch_add(1, std::memory_order_relaxed);
+        pool->push(new Task(std::move(task), this));
+    }
+
+    void TaskGroup::Wait()
+    {
+        int spins = 0;
+        while(pending.load(std::memory_order_acquire) > 0)
+        {
+            //help out with queued tasks, the ones of this group may still be in a queue
+            if(Task* task = pool->findTask())
+            {
+                task->Run();
+                spins = 0;
+            }
+            else if(++spins < WaitSpins)
+                std::this_thread::yield();
+            else
+            {
+                //the remaining tasks run on other threads, sleep until the last one finishes
+                std::unique_lock<std::mutex> lock(mutex);
+                finished.wait(lock, [&]() { return pending.load(std::memory_order_acquire) == 0; });
+            }
+        }
+        //the last task may still hold the lock to notify
+        std::lock_guard<std::mutex> lock(mutex);
+    }
+
+    //run the loop in the current thread, together with the threads that steal its tasks
+    static void runLoop(ParallelForLoop& loop, ThreadPool* pool)
+    {
+        //one task for every other thread that may help, each runs chunks until the loop runs out of them
+        int64_t nChunks = loop.chunkSize == AdaptiveChunkSize ? loop.maxIndex :
+                          (loop.maxIndex + loop.chunkSize - 1) / loop.chunkSize;
+        int nHelpers = (int)std::min<int64_t>(nChunks, pool->Size()) - 1;
+        loop.nThreads = std::max(nHelpers, 0) + 1;
+        TaskGroup group(pool);
+        for(int i = 0; i < nHelpers; i++)
+            group.Run([&loop]() { loop.Run(); });
+        loop.Run();
+        group.Wait();
+    }
+
     void ParallelFor(const std::function<void(int)>& func, int count, int chunkSize)
     {
         //run iteartions immediately if not using multi-threads or count is small
-        if(PbrtOptions.nThreads == 1 || count < chunkSize)
+        ThreadPool* pool = callerPool();
+        if(pool->Size() == 1 || count < chunkSize)
         {
             for(int i = 0; i < count; i++)
                 func(i);
             return;
         }
-        //launch work threads if needed
-        if(threads.size() == 0)
-        {
-            ThreadIndex = 0;
-            //except for current execution thread
-            for(int i = 0; i < NumSystemCores() - 1; i++)
-                threads.push_back(std::thread(workerThreadFunc, i + 1));
-        }
-        //create and enqueue ParallerForLoop for this loop
         ParallelForLoop loop(func, count, chunkSize, CurrentProfilerState());
-        workListMutex.lock();
-        loop.next = workList;
-        workList = &loop;
-        workListMutex.unlock();
-        //notify worker threads of work to be done
-        std::unique_lock<std::mutex> lock(workListMutex);
-        workListCondition.notify_all();
-        //help out with parallel loop iterations in current thread
-        while(!loop.Finished())
-        {
-            //run a chunk of loop iterations
-            //find the set of loop iterations to run next
-            int64_t indexStart = loop.nextIndex;
-            int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
-            //update loop to reflect iterations this thread will run
-            loop.nextIndex = indexEnd;
-            if(loop.nextIndex == loop.maxIndex)
-                workList = loop.next;
-            loop.activeWorkers++;
-            //run loop indices in [indexStart, indexEnd]
-            lock.unlock();
-            for(int index = indexStart; index < indexEnd; index ++)
-            {
-                if(loop.function1D)
-                    loop.function1D(index);
-                //handle other types of loops
-                else if(loop.function2D)
-                    loop.function2D(Point2i(index % loop.xSum, index / loop.xSum));
-            }
-            lock.lock();
-            //update loop to reflect completion of iterations
-            loop.activeWorkers--;
-        }
+        runLoop(loop, pool);
     }
 
-    void ParallelFor2D(std::function<void(Point2i)>& func, const Point2i& count)
+    void ParallelFor2D(const std::function<void(Point2i)>& func, const Point2i& count)
     {
         //run iteartions immediately if not using multi-threads or count is small
-        if(PbrtOptions.nThreads == 1 || count.x * count.y <= 1)
+        ThreadPool* pool = callerPool();
+        if(pool->Size() == 1 || count.x * count.y <= 1)
         {
             for(int y = 0; y < count.y; y++)
             {
@@ -160,71 +545,57 @@ namespace pbrt
             }
             return;
         }
-        //launch work threads if needed
-        if(threads.size() == 0)
-        {
-            ThreadIndex = 0;
-            //except for current execution thread
-            for(int i = 0; i < NumSystemCores() - 1; i++)
-                threads.push_back(std::thread(workerThreadFunc, i + 1));
-        }
-        //create and enqueue ParallerForLoop for this loop
         ParallelForLoop loop(func, count, CurrentProfilerState());
+        runLoop(loop, pool);
+    }
+
+    void ParallelInit()
+    {
+        ParallelCleanup();
+        ThreadIndex = 0;
+        //only the workers are pinned, the calling thread keeps its affinity
+        if(PbrtOptions.pinThreads)
         {
-            std::lock_guard<std::mutex> lock(workListMutex);
-            loop.next = workList;
-            workList = &loop;
-        }
-        //notify worker threads of work to be done
-        std::unique_lock<std::mutex> lock(workListMutex);
-        workListCondition.notify_all();
-        //help out with parallel loop iterations in current thread
-        while(!loop.Finished())
-        {
-            //run a chunk of loop iterations
-            //find the set of loop iterations to run next
-            int64_t indexStart = loop.nextIndex;
-            int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
-            //update loop to reflect iterations this thread will run
-            loop.nextIndex = indexEnd;
-            if(loop.nextIndex == loop.maxIndex)
-                workList = loop.next;
-            loop.activeWorkers++;
-            //run loop indices in [indexStart, indexEnd]
-            lock.unlock();
-            for(int index = indexStart; index < indexEnd; index ++)
-            {
-                if(loop.function1D)
-                    loop.function1D(index);
-                //handle other types of loops
-                else if(loop.function2D)
-                    loop.function2D(Point2i(index % loop.xSum, index / loop.xSum));
-            }
-            lock.lock();
-            //update loop to reflect completion of iterations
-            loop.activeWorkers--;
+            processors = systemProcessors();
+            if(processors.empty())
+                Warn("Unable to find the processors to pin threads to.");
         }
+        defaultPool.reset(new ThreadPool(PbrtOptions.nThreads));
+    }
+
+    void ParallelCleanup()
+    {
+        defaultPool.reset();
+        processors.clear();
+    }
+
+    void MergeWorkerThreadStats()
+    {
+        if(defaultPool)
+            defaultPool->ReportWorkerStats();
+    }
+
+    ThreadPool* DefaultThreadPool()
+    {
+        if(!defaultPool)
+            ParallelInit();
+        return defaultPool.get();
     }
 
     int MaxThreadIndex()
     {
-        if(PbrtOptions.nThreads != 1)
-        {
-            //launch worker threads if needed
-            if(threads.size() == 0)
-            {
-                ThreadIndex = 0;
-                //except for current execution thread
-                for(int i = 0; i < NumSystemCores() - 1; i++)
-                    threads.push_back(std::thread(workerThreadFunc, i + 1));
-            }
-        }
-        return 1 + threads.size();
+        return callerPool()->Size();
     }
 
-    int NumSystemCores() 
+    int NumSystemCores()
     {
+        #if defined(__linux__)
+        //only the cores of the affinity mask, so a cpuset of the cgroup is not oversubscribed
+        cpu_set_t allowed;
+        if(sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+            return std::max(1, CPU_COUNT(&allowed));
+        #endif
         return std::max(1u, std::thread::hardware_concurrency());
     }
 
-}
\ No newline at end of file
+}
@@ -1,6 +1,11 @@
 #pragma once
 #include"core/pbrt.h"
+#include"core/geometry/geometry.h"
 #include<functional>
+#include<atomic>
+#include<thread>
+#include<mutex>
+#include<condition_variable>
 
 namespace pbrt
 {
@@ -39,12 +44,114 @@ namespace pbrt
     };
 
 
+    struct Task;
+    class WorkQueue;
+
+    //scheduling priority of the worker threads of a pool
+    enum class ThreadPriority
+    {
+        Low,
+        Normal,
+        High
+    };
+
+    //worker threads with a work-stealing deque each, the thread that runs a loop or waits on a task group
+    //of the pool takes part in it as thread 0
+    class ThreadPool
+    {
+    public:
+        //nThreads counts the calling thread, so nThreads - 1 workers are started, 0 for a thread per core
+        explicit ThreadPool(int nThreads = 0, ThreadPriority priority = ThreadPriority::Normal);
+        ~ThreadPool();
+        //stop the workers and start the ones of nThreads, must not be called while tasks run on the pool
+        void Resize(int nThreads);
+        //the workers apply the priority the next time they look for a task, on linux it is a nice value and
+        //unprivileged processes can only raise that, so High and going back from Low to Normal need CAP_SYS_NICE,
+        //the workers keep their priority and warn if they can't change it
+        void SetPriority(ThreadPriority priority);
+        //count of threads running the tasks of the pool, including the calling one
+        int Size() const { return 1 + threads.size(); }
+        //run ReportThreadStats() on every worker and return once all of them did, the pool must be idle
+        void ReportWorkerStats();
+    private:
+        friend class TaskGroup;
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        void launch(int nThreads);
+        void stop();
+        //reportedStats is the count of ReportWorkerStats() calls before the worker started
+        void workerThreadFunc(int tIndex, int reportedStats);
+        //queue task on the deque of the calling thread
+        void push(Task* task);
+        //take a task from the deque of the calling thread, or steal one from the others
+        Task* findTask();
+
+        //worked threads
+        std::vector<std::thread> threads;
+        std::atomic<bool> shutdownThreads{false};
+        std::atomic<ThreadPriority> priority;
+        //a queue for every thread, workQueues[ThreadIndex], 0 is shared by all the threads outside of the pool
+        std::vector<std::unique_ptr<WorkQueue>> workQueues;
+        //count of queued tasks nobody took yet, idle workers sleep while it is 0
+        std::atomic<int> nQueuedTasks{0};
+        std::atomic<int> nSleepingWorkers{0};
+        //only locked to sleep and to wake sleeping workers
+        std::mutex sleepMutex;
+        std::condition_variable sleepCondition;
+        //count of ReportWorkerStats() calls, and of the workers that reported for the last one
+        std::atomic<int> statsRequests{0};
+        int nStatsReports = 0;
+        std::condition_variable statsCondition;
+    };
+
+    //a set of tasks run by the threads of a pool, every thread queues the tasks it spawns in its own deque
+    //and idle threads steal from the deques of the others
+    class TaskGroup
+    {
+    public:
+        //nullptr for the pool of the calling thread, or the default pool for threads outside of any pool
+        explicit TaskGroup(ThreadPool* pool = nullptr);
+        //wait for the tasks still running
+        ~TaskGroup() { Wait(); }
+        //spawn task to run on any thread, it may spawn and wait on task groups itself
+        void Run(std::function<void()> task);
+        //return once all the tasks of the group finished, the current thread runs queued tasks meanwhile
+        void Wait();
+    private:
+        friend struct Task;
+        TaskGroup(const TaskGroup&) = delete;
+        TaskGroup& operator=(const TaskGroup&) = delete;
+        ThreadPool* pool;
+        //count of spawned tasks that didn't finish
+        std::atomic<int> pending{0};
+        //Wait() sleeps on finished once it can't help, the last task notifies it
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+
+    //chunkSize of ParallelFor that lets the loop size its chunks, they start as a large share of the iterations
+    //and shrink toward the end of the loop, but never below the count of iterations that take about AdaptiveChunkTime
+    //as timed by the loop itself
+    constexpr int AdaptiveChunkSize = 0;
+    constexpr double AdaptiveChunkTime = 50e-6;
+
     //parallel for all main loop
     //function for perform, count is the required loop, chunkSize is the count of single loop
     void ParallelFor(const std::function<void(int)>& function, int count, int chunkSize = 1);
-    //parallel for 2D like image
-    void ParallelFor2D(std::function<void(Point2i)>& function, const Point2i& count);
-    //return max thread index
+    //parallel for 2D like image, with adaptive chunks
+    void ParallelFor2D(const std::function<void(Point2i)>& function, const Point2i& count);
+    //create the default pool with PbrtOptions.nThreads threads, loops of threads outside of any pool run on it
+    void ParallelInit();
+    //stop and join the threads of the default pool, it is created again by the next parallel loop
+    void ParallelCleanup();
+    //gather the statistics of the workers of the default pool, so PrintStats() includes them
+    void MergeWorkerThreadStats();
+    //return the default pool, creating it if needed, so it can be resized or given another priority
+    ThreadPool* DefaultThreadPool();
+    //index of the calling thread in its pool, below MaxThreadIndex(), 0 for threads outside of any pool
+    extern thread_local int ThreadIndex;
+    //return max thread index, the count of threads of the pool of the calling thread
     int MaxThreadIndex();
     //return the processor count of the system
     int NumSystemCores();
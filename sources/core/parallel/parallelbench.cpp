@@ -0,0 +1,62 @@
+#include"parallel.h"
+#include<algorithm>
+#include<chrono>
+#include<cstdio>
+#include<cstdlib>
+#include<memory>
+
+using namespace pbrt;
+
+//overhead of ParallelFor per chunk, the iterations only add to a counter so claiming the chunks is most of the work,
+//every chunk size is run with 1 thread and then doubled thread counts up to the processor count,
+//or up to the count given as the first argument, the rows of 1 thread run the loop without chunks and show the cost
+//of the iterations alone
+
+int main(int argc, char* argv[])
+{
+    int maxThreads = argc > 1 ? std::max(1, atoi(argv[1])) : NumSystemCores();
+    const int count = 1 << 22;
+    const int chunkSizes[] = { 1, 4, 16, 64, 256, 1024 };
+    printf("%8s %10s %12s %14s\n", "threads", "chunk", "ms", "ns per chunk");
+    for(int nThreads = 1; ; nThreads = std::min(2 * nThreads, maxThreads))
+    {
+        PbrtOptions.nThreads = nThreads;
+        ParallelInit();
+        for(int chunkSize : chunkSizes)
+        {
+            //per thread counters, padded so the iterations never share a cache line
+            struct alignas(64) Counter
+            {
+                int64_t value = 0;
+            };
+            std::unique_ptr<Counter[]> counters(new Counter[MaxThreadIndex()]);
+            auto function = [&](int i)
+            {
+                counters[ThreadIndex].value += i;
+            };
+            //warm the workers up once, then time the best of a few runs
+            ParallelFor(function, count, chunkSize);
+            double bestTime = 1e30;
+            for(int run = 0; run < 5; run++)
+            {
+                auto start = std::chrono::steady_clock::now();
+                ParallelFor(function, count, chunkSize);
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                bestTime = std::min(bestTime, elapsed.count());
+            }
+            int64_t sum = 0;
+            for(int i = 0; i < MaxThreadIndex(); i++)
+                sum += counters[i].value;
+            if(sum != 6 * ((int64_t)count * (count - 1) / 2))
+            {
+                printf("wrong sum with %d threads and chunk size %d\n", nThreads, chunkSize);
+                return 1;
+            }
+            printf("%8d %10d %12.3f %14.2f\n", nThreads, chunkSize, bestTime * 1e3, bestTime * 1e9 / (count / chunkSize));
+        }
+        ParallelCleanup();
+        if(nThreads == maxThreads)
+            break;
+    }
+    return 0;
+}
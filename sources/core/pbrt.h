@@ -17,6 +17,14 @@ namespace pbrt
 	//platform
 #define PBRT_IS_WINDOWS
 
+//SIMD instruction sets, used by wide bounding box tests
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#define PBRT_HAVE_SSE
+#endif
+#if defined(__AVX__)
+#define PBRT_HAVE_AVX
+#endif
+
 //cache line for cache-aligned allocate memory
 #ifndef PBRT_L1_CACHE_LINE_SIZE
 #define PBRT_L1_CACHE_LINE_SIZE 64
@@ -98,6 +106,8 @@ namespace pbrt
 		int nThreads = 0;
 		bool quickRender = false;
 		bool quiet = false, verbose = false;
+		//pin the worker threads to the cores of a NUMA node each, and place the memory they use on their node
+		bool pinThreads = false;
 		std::string imageFile;
 	};
 
@@ -0,0 +1,174 @@
+#include"primitive.h"
+#include"core/interaction/interaction.h"
+#include"core/shape/shape.h"
+
+namespace pbrt
+{
+    Bounds3f Primitive::MotionBound(Float time0, Float time1) const
+    {
+        return WorldBound();
+    }
+
+    Bounds3f Primitive::ClippedWorldBound(const Bounds3f& clip) const
+    {
+        Bounds3f bounds = WorldBound();
+        for(int i = 0; i < 3; i++)
+        {
+            bounds.pMin[i] = std::max(bounds.pMin[i], clip.pMin[i]);
+            bounds.pMax[i] = std::min(bounds.pMax[i], clip.pMax[i]);
+        }
+        return bounds;
+    }
+
+    bool Primitive::IntersectOccluder(const Ray& ray, const Primitive** occluder) const
+    {
+        if(!IntersectP(ray))
+            return false;
+        *occluder = this;
+        return true;
+    }
+
+    const Shape* Primitive::GetShape() const
+    {
+        return nullptr;
+    }
+
+    void Primitive::IntersectPacket(const Ray* const rays[], int nRays, SurfaceInteraction* surfaceInteractions, bool* hits) const
+    {
+        for(int i = 0; i < nRays; i++)
+            hits[i] = Intersect(*rays[i], &surfaceInteractions[i]);
+    }
+
+    void Primitive::IntersectPacketP(const Ray* const rays[], int nRays, bool* occluded) const
+    {
+        for(int i = 0; i < nRays; i++)
+            occluded[i] = IntersectP(*rays[i]);
+    }
+
+    GeometricPrimitive::GeometricPrimitive(const std::shared_ptr<Shape>& shape, const std::shared_ptr<Material>& material,
+                                           const std::shared_ptr<AreaLight>& areaLight, const MediumInterface& mediumInterface)
+    : shape(shape), material(material), areaLight(areaLight), mediumInterface(mediumInterface)
+    {
+    }
+
+    Bounds3f GeometricPrimitive::WorldBound() const
+    {
+        return shape->WorldBound();
+    }
+
+    Bounds3f GeometricPrimitive::ClippedWorldBound(const Bounds3f& clip) const
+    {
+        return shape->ClippedWorldBound(clip);
+    }
+
+    bool GeometricPrimitive::Intersect(const Ray& ray, SurfaceInteraction* surfaceInteraction) const
+    {
+        Float tHit;
+        if(!shape->Intersect(ray, &tHit, surfaceInteraction, true))
+            return false;
+        ray.tMax = tHit;
+        return true;
+    }
+
+    bool GeometricPrimitive::IntersectP(const Ray& ray) const
+    {
+        return shape->IntersectP(ray);
+    }
+
+    const Shape* GeometricPrimitive::GetShape() const
+    {
+        return shape.get();
+    }
+
+    const AreaLight* GeometricPrimitive::GetAreaLight() const
+    {
+        return areaLight.get();
+    }
+
+    const Material* GeometricPrimitive::GetMaterial() const
+    {
+        return material.get();
+    }
+
+    const AreaLight* Aggregate::GetAreaLight() const
+    {
+        Fatal("Aggregate::GetAreaLight() method called; should have gone to GeometricPrimitive");
+        return nullptr;
+    }
+
+    const Material* Aggregate::GetMaterial() const
+    {
+        Fatal("Aggregate::GetMaterial() method called; should have gone to GeometricPrimitive");
+        return nullptr;
+    }
+
+    TransformedPrimitive::TransformedPrimitive(const std::shared_ptr<Primitive>& primitive, const Transform* PrimitiveToWorld,
+                                               const Transform* WorldToPrimitive)
+    : primitive(primitive), PrimitiveToWorld(PrimitiveToWorld), WorldToPrimitive(WorldToPrimitive)
+    {
+        worldBound = (*PrimitiveToWorld)(primitive->WorldBound());
+    }
+
+    TransformedPrimitive::TransformedPrimitive(const std::shared_ptr<Primitive>& primitive, const AnimatedTransform& PrimitiveToWorld)
+    : primitive(primitive), animatedPrimitiveToWorld(new AnimatedTransform(PrimitiveToWorld))
+    {
+        worldBound = animatedPrimitiveToWorld->MotionBounds(primitive->WorldBound());
+    }
+
+    Bounds3f TransformedPrimitive::WorldBound() const
+    {
+        return worldBound;
+    }
+
+    Bounds3f TransformedPrimitive::MotionBound(Float time0, Float time1) const
+    {
+        if(!animatedPrimitiveToWorld)
+            return worldBound;
+        return animatedPrimitiveToWorld->MotionBounds(primitive->WorldBound(), time0, time1);
+    }
+
+    bool TransformedPrimitive::Intersect(const Ray& ray, SurfaceInteraction* surfaceInteraction) const
+    {
+        //compute ray after transformation by PrimitiveToWorld
+        Transform interpolatedPrimitiveToWorld, interpolatedWorldToPrimitive;
+        const Transform* toWorld = PrimitiveToWorld, *toPrimitive = WorldToPrimitive;
+        if(animatedPrimitiveToWorld)
+        {
+            animatedPrimitiveToWorld->Interpolate(ray.time, &interpolatedPrimitiveToWorld);
+            interpolatedWorldToPrimitive = Inverse(interpolatedPrimitiveToWorld);
+            toWorld = &interpolatedPrimitiveToWorld;
+            toPrimitive = &interpolatedWorldToPrimitive;
+        }
+        Ray primitiveRay = (*toPrimitive)(ray);
+        if(!primitive->Intersect(primitiveRay, surfaceInteraction))
+            return false;
+        ray.tMax = primitiveRay.tMax;
+        //transform instance's intersection data to world space
+        if(!toWorld->IsIdentity())
+            *surfaceInteraction = (*toWorld)(*surfaceInteraction);
+        return true;
+    }
+
+    bool TransformedPrimitive::IntersectP(const Ray& ray) const
+    {
+        if(animatedPrimitiveToWorld)
+        {
+            Transform interpolatedPrimitiveToWorld;
+            animatedPrimitiveToWorld->Interpolate(ray.time, &interpolatedPrimitiveToWorld);
+            return primitive->IntersectP(Inverse(interpolatedPrimitiveToWorld)(ray));
+        }
+        return primitive->IntersectP((*WorldToPrimitive)(ray));
+    }
+
+    const AreaLight* TransformedPrimitive::GetAreaLight() const
+    {
+        Fatal("TransformedPrimitive::GetAreaLight() method called; should have gone to GeometricPrimitive");
+        return nullptr;
+    }
+
+    const Material* TransformedPrimitive::GetMaterial() const
+    {
+        Fatal("TransformedPrimitive::GetMaterial() method called; should have gone to GeometricPrimitive");
+        return nullptr;
+    }
+}
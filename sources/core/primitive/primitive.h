@@ -0,0 +1,96 @@
+#pragma once
+#include"core/pbrt.h"
+#include"core/geometry/geometry.h"
+#include"core/transform/transform.h"
+#include"core/interaction/interaction.h"
+
+namespace pbrt
+{
+    //the bridge between the geometry processing and shading subsystems
+    class Primitive
+    {
+    public:
+        virtual ~Primitive() { }
+        //bounding box of the primitive in world space
+        virtual Bounds3f WorldBound() const = 0;
+        //bounding box of the primitive during [time0, time1], motion BVH builds bound each time segment with it
+        //the default is WorldBound, which covers the whole shutter interval
+        virtual Bounds3f MotionBound(Float time0, Float time1) const;
+        //bound of the part of the primitive inside clip, spatial split BVH builds use it to tighten split references
+        //the default just intersects WorldBound with clip
+        virtual Bounds3f ClippedWorldBound(const Bounds3f& clip) const;
+        //intersect with ray, update ray.tMax and fill in the information of the intersection point
+        virtual bool Intersect(const Ray& ray, SurfaceInteraction* surfaceInteraction) const = 0;
+        //intersect with ray, just return the bool
+        virtual bool IntersectP(const Ray& ray) const = 0;
+        //intersect with a shadow ray and store the primitive that blocks it in occluder
+        //the occluder must be tested with world space rays, the default reports the primitive itself
+        virtual bool IntersectOccluder(const Ray& ray, const Primitive** occluder) const;
+        //intersect with a packet of at most MaxRayPacketSize rays, hits[i] tells whether rays[i] hits
+        //the default implementation traces the rays one by one
+        virtual void IntersectPacket(const Ray* const rays[], int nRays, SurfaceInteraction* surfaceInteractions, bool* hits) const;
+        virtual void IntersectPacketP(const Ray* const rays[], int nRays, bool* occluded) const;
+        //the shape of a primitive that wraps a single shape, accelerators use it to intersect triangles inline
+        //return nullptr for anything else
+        virtual const Shape* GetShape() const;
+        //return nullptr if the primitive is not emissive
+        virtual const AreaLight* GetAreaLight() const = 0;
+        virtual const Material* GetMaterial() const = 0;
+    };
+
+    //a single shape with the material and area light it is shaded with
+    class GeometricPrimitive : public Primitive
+    {
+    public:
+        GeometricPrimitive(const std::shared_ptr<Shape>& shape, const std::shared_ptr<Material>& material,
+                           const std::shared_ptr<AreaLight>& areaLight, const MediumInterface& mediumInterface);
+        Bounds3f WorldBound() const override;
+        //clipped by the shape itself, so triangles are clipped as polygons instead of by their boxes
+        Bounds3f ClippedWorldBound(const Bounds3f& clip) const override;
+        bool Intersect(const Ray& ray, SurfaceInteraction* surfaceInteraction) const override;
+        bool IntersectP(const Ray& ray) const override;
+        const Shape* GetShape() const override;
+        const AreaLight* GetAreaLight() const override;
+        const Material* GetMaterial() const override;
+    private:
+        std::shared_ptr<Shape> shape;
+        std::shared_ptr<Material> material;
+        std::shared_ptr<AreaLight> areaLight;
+        MediumInterface mediumInterface;
+    };
+
+    //a primitive that holds other primitives, e.g. acceleration structures
+    class Aggregate : public Primitive
+    {
+    public:
+        //an aggregate never be emissive or shaded, the hit primitive should be asked instead
+        const AreaLight* GetAreaLight() const override;
+        const Material* GetMaterial() const override;
+    };
+
+    //an instance of a shared primitive, usually the aggregate of an object, placed by its own transform
+    //rays are transformed into the space of the primitive, so the primitive is only built once for all instances
+    class TransformedPrimitive : public Primitive
+    {
+    public:
+        //static instance, the transforms are owned by the transform cache and shared between instances
+        TransformedPrimitive(const std::shared_ptr<Primitive>& primitive, const Transform* PrimitiveToWorld,
+                             const Transform* WorldToPrimitive);
+        //animated instance, the transform is interpolated at the time of the ray
+        TransformedPrimitive(const std::shared_ptr<Primitive>& primitive, const AnimatedTransform& PrimitiveToWorld);
+        Bounds3f WorldBound() const override;
+        Bounds3f MotionBound(Float time0, Float time1) const override;
+        bool Intersect(const Ray& ray, SurfaceInteraction* surfaceInteraction) const override;
+        bool IntersectP(const Ray& ray) const override;
+        //the hit primitive should be asked instead
+        const AreaLight* GetAreaLight() const override;
+        const Material* GetMaterial() const override;
+    private:
+        std::shared_ptr<Primitive> primitive;
+        const Transform* PrimitiveToWorld = nullptr;
+        const Transform* WorldToPrimitive = nullptr;
+        //only animated instances pay for the interpolation data
+        std::unique_ptr<AnimatedTransform> animatedPrimitiveToWorld;
+        Bounds3f worldBound;
+    };
+}
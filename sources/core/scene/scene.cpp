@@ -1,14 +1,57 @@
 #include"scene.h"
+#include"core/statistics/stats.h"
+#include<atomic>
 
 namespace pbrt
 {
+    STAT_COUNTER("Scene/Shadow rays", nShadowRays);
+    STAT_COUNTER("Scene/Occluder cache hits", nOccluderCacheHits);
+
+    //the last primitive that occluded a shadow ray on this thread
+    //consecutive shadow rays of a tile are often blocked by the same object
+    struct OccluderCache
+    {
+        uint64_t sceneId = 0;
+        const Primitive* occluder = nullptr;
+    };
+
+    static thread_local OccluderCache occluderCache;
+    static std::atomic<uint64_t> nextSceneId{1};
+
     Scene::Scene(std::shared_ptr<Primitive> aggregate, 
         const std::vector<std::shared_ptr<Light>>& lights)
-        : lights(lights), aggregate(aggregate)
+        : lights(lights), aggregate(aggregate), id(nextSceneId++)
         {
             worldBound = aggregate->WorldBound();
             //light initialize
             for(const std::shared_ptr<Light>& light : lights)
                 light->Preprocess(*this);
         }
-}
\ No newline at end of file
+
+    void Scene::AggregateChanged()
+    {
+        worldBound = aggregate->WorldBound();
+        //lights like distant and infinite ones are sized by the bound of the scene
+        for(const std::shared_ptr<Light>& light : lights)
+            light->Preprocess(*this);
+        //the caches of all threads only match the old id
+        id = nextSceneId++;
+    }
+
+    bool Scene::IntersectP(const Ray& ray) const
+    {
+        ++nShadowRays;
+        OccluderCache& cache = occluderCache;
+        if(cache.sceneId == id && cache.occluder->IntersectP(ray))
+        {
+            ++nOccluderCacheHits;
+            return true;
+        }
+        const Primitive* occluder;
+        if(!aggregate->IntersectOccluder(ray, &occluder))
+            return false;
+        cache.sceneId = id;
+        cache.occluder = occluder;
+        return true;
+    }
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include"core/pbrt.h"
+#include"core/primitive/primitive.h"
 
 namespace pbrt
 {
@@ -17,8 +18,18 @@ namespace pbrt
         //intersect with ray, and return the information about the frist intersection point
         bool Intersect(const Ray& ray, SurfaceInteraction* pSurfaceInter) const 
         { return aggregate->Intersect(ray, pSurfaceInter); }
-        //intersect with ray, just return the bool
-        bool IntersectP(const Ray& ray) const { return aggregate->IntersectP(ray);}
+        //intersect with a shadow ray, just return the bool
+        //the primitive that occluded the last shadow ray of the thread is tested before the aggregate
+        bool IntersectP(const Ray& ray) const;
+        //intersect with a packet of 4, 8 or 16 coherent rays, such as camera rays of a pixel
+        void IntersectPacket(const Ray* const rays[], int nRays, SurfaceInteraction* surfaceInteractions, bool* hits) const
+        { aggregate->IntersectPacket(rays, nRays, surfaceInteractions, hits); }
+        //intersect with a packet of shadow rays, just return whether each one is occluded
+        void IntersectPacketP(const Ray* const rays[], int nRays, bool* occluded) const
+        { aggregate->IntersectPacketP(rays, nRays, occluded); }
+        //call after primitives were inserted into or removed from the aggregate in place,
+        //update the bounding box, preprocess the lights again and drop the occluders cached for the scene, which may be removed
+        void AggregateChanged();
 
         //public data
         std::vector<std::shared_ptr<Light>> lights;
@@ -27,5 +38,7 @@ namespace pbrt
         std::shared_ptr<Primitive> aggregate;
         //bounding box
         Bound3f worldBound;
+        //unique over the run, so a thread never tests an occluder cached for another scene
+        uint64_t id;
     };
 }
@@ -21,6 +21,17 @@ namespace pbrt
 		return ObjectToWorld->operator()(ObjectBound());
 	}
 
+	Bounds3f Shape::ClippedWorldBound(const Bounds3f& clip) const
+	{
+		Bounds3f bound = WorldBound();
+		for (uint32_t i = 0; i < 3; i++)
+		{
+			bound.pMin[i] = std::max(bound.pMin[i], clip.pMin[i]);
+			bound.pMax[i] = std::min(bound.pMax[i], clip.pMax[i]);
+		}
+		return bound;
+	}
+
 	bool Shape::IntersectP(const Ray& ray, bool testAlphaTexture) const
 	{
 		Float tHit = ray.tMax;
@@ -21,6 +21,8 @@ namespace pbrt
 
 		virtual Bounds3f ObjectBound() const = 0;
 		virtual Bounds3f WorldBound() const;
+		//world space bound of the part of the shape inside clip, used by spatial split BVH builds
+		virtual Bounds3f ClippedWorldBound(const Bounds3f& clip) const;
 		virtual bool Intersect(const Ray& ray, Float* tHit, SurfaceInteraction* surfaceInteraction,
 							   bool testAlphaTexture) const = 0;
 		virtual bool IntersectP(const Ray& ray, bool testAlphaTexture = true) const;
@@ -1,10 +1,13 @@
 #include"stats.h"
 #include<mutex>
+#include<atomic>
+#include<cinttypes>
 
 namespace pbrt
 {
     std::vector<std::function<void(StatsAccumulator&)>>* StatRegisterer::funcs;
     static StatsAccumulator statsAccumulator;
+    static std::atomic<int> statsClearCount{0};
 
     void StatRegisterer::CallCallbacks(StatsAccumulator& accum)
     {
@@ -20,6 +23,153 @@ namespace pbrt
         StatRegisterer::CallCallbacks(statsAccumulator);
     }
 
+    //split "category/title" of a statistic
+    static void GetCategoryAndTitle(const std::string& name, std::string* category, std::string* title)
+    {
+        size_t slash = name.find('/');
+        if(slash == std::string::npos)
+            *title = name;
+        else
+        {
+            *category = name.substr(0, slash);
+            *title = name.substr(slash + 1);
+        }
+    }
+
+    void StatsAccumulator::Print(FILE* file) const
+    {
+        fprintf(file, "Statistics:\n");
+        std::map<std::string, std::vector<std::string>> lines;
+        char buffer[256];
+        auto addLine = [&](const std::string& name, auto format)
+        {
+            std::string category, title;
+            GetCategoryAndTitle(name, &category, &title);
+            format(title.c_str());
+            lines[category].push_back(buffer);
+        };
+        for(const auto& counter : counters)
+        {
+            if(counter.second == 0)
+                continue;
+            addLine(counter.first, [&](const char* title)
+            {
+                snprintf(buffer, sizeof(buffer), "%-42s               %12" PRIu64, title, (uint64_t)counter.second);
+            });
+        }
+        for(const auto& counter : memoryCounters)
+        {
+            if(counter.second == 0)
+                continue;
+            addLine(counter.first, [&](const char* title)
+            {
+                double kb = (double)counter.second / 1024.;
+                if(kb < 1024.)
+                    snprintf(buffer, sizeof(buffer), "%-42s                  %9.2f kB", title, kb);
+                else if(kb < 1024. * 1024.)
+                    snprintf(buffer, sizeof(buffer), "%-42s                  %9.2f MiB", title, kb / 1024.);
+                else
+                    snprintf(buffer, sizeof(buffer), "%-42s                  %9.2f GiB", title, kb / (1024. * 1024.));
+            });
+        }
+        for(const auto& percentage : percentages)
+        {
+            if(percentage.second.second == 0)
+                continue;
+            int64_t numerator = percentage.second.first, denominator = percentage.second.second;
+            addLine(percentage.first, [&](const char* title)
+            {
+                snprintf(buffer, sizeof(buffer), "%-42s%12" PRIu64 " / %12" PRIu64 " (%.2f%%)", title, (uint64_t)numerator,
+                         (uint64_t)denominator, (double)numerator / (double)denominator * 100.);
+            });
+        }
+        for(const auto& ratio : ratios)
+        {
+            if(ratio.second.second == 0)
+                continue;
+            int64_t numerator = ratio.second.first, denominator = ratio.second.second;
+            addLine(ratio.first, [&](const char* title)
+            {
+                snprintf(buffer, sizeof(buffer), "%-42s%12" PRIu64 " / %12" PRIu64 " (%.2fx)", title, (uint64_t)numerator,
+                         (uint64_t)denominator, (double)numerator / (double)denominator);
+            });
+        }
+        for(const auto& distribution : intDistributions)
+        {
+            const StatIntDistribution& d = distribution.second;
+            if(d.count == 0)
+                continue;
+            addLine(distribution.first, [&](const char* title)
+            {
+                snprintf(buffer, sizeof(buffer), "%-42s                      %.3f avg [range %" PRId64 " - %" PRId64 "]", title,
+                         (double)d.sum / (double)d.count, d.min, d.max);
+            });
+            //one line for every non-empty bucket of the histogram
+            std::string category, title;
+            GetCategoryAndTitle(distribution.first, &category, &title);
+            for(int i = 0; i < StatIntDistribution::NumBuckets; i++)
+            {
+                if(d.buckets[i] == 0)
+                    continue;
+                int64_t low = i == 0 ? 0 : (int64_t(1) << (i - 1));
+                int64_t high = i == 0 ? 0 : (int64_t(1) << i) - 1;
+                if(i == StatIntDistribution::NumBuckets - 1)
+                    snprintf(buffer, sizeof(buffer), "    %" PRId64 "+", low);
+                else if(low == high)
+                    snprintf(buffer, sizeof(buffer), "    %" PRId64, low);
+                else
+                    snprintf(buffer, sizeof(buffer), "    %" PRId64 " - %" PRId64, low, high);
+                std::string range = buffer;
+                snprintf(buffer, sizeof(buffer), "%-42s%12" PRIu64 " (%.2f%%)", range.c_str(), (uint64_t)d.buckets[i],
+                         (double)d.buckets[i] / (double)d.count * 100.);
+                lines[category].push_back(buffer);
+            }
+        }
+        for(const auto& distribution : floatDistributions)
+        {
+            const StatFloatDistribution& d = distribution.second;
+            if(d.count == 0)
+                continue;
+            addLine(distribution.first, [&](const char* title)
+            {
+                snprintf(buffer, sizeof(buffer), "%-42s                      %.3f avg [range %.3f - %.3f]", title,
+                         d.sum / (double)d.count, d.min, d.max);
+            });
+        }
+        for(const auto& category : lines)
+        {
+            fprintf(file, "  %s\n", category.first.c_str());
+            for(const std::string& line : category.second)
+                fprintf(file, "    %s\n", line.c_str());
+        }
+    }
+
+    void StatsAccumulator::Clear()
+    {
+        counters.clear();
+        memoryCounters.clear();
+        percentages.clear();
+        ratios.clear();
+        intDistributions.clear();
+        floatDistributions.clear();
+    }
+
+    void PrintStats(FILE* dest)
+    {
+        statsAccumulator.Print(dest);
+    }
+
+    void ClearStats()
+    {
+        statsAccumulator.Clear();
+        statsClearCount++;
+    }
+
+    int StatsClearCount()
+    {
+        return statsClearCount;
+    }
+
     void InitProfiler()
     {
         
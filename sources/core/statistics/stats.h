@@ -2,16 +2,93 @@
 #include"core/pbrt.h"
 #include<map>
 #include<functional>
+#include<cstdio>
 
 namespace pbrt
 {
+    //integer values reported one by one, with their average, range and a histogram of power of 2 buckets
+    struct StatIntDistribution
+    {
+        //bucket 0 counts the value 0, bucket i counts values in [2^(i - 1), 2^i)
+        static constexpr int NumBuckets = 32;
+        void Add(int64_t value)
+        {
+            count++;
+            sum += value;
+            min = std::min(min, value);
+            max = std::max(max, value);
+            int bucket = 0;
+            while(bucket < NumBuckets - 1 && value >= (int64_t(1) << bucket))
+                bucket++;
+            buckets[bucket]++;
+        }
+        void Merge(const StatIntDistribution& other)
+        {
+            count += other.count;
+            sum += other.sum;
+            min = std::min(min, other.min);
+            max = std::max(max, other.max);
+            for(int i = 0; i < NumBuckets; i++)
+                buckets[i] += other.buckets[i];
+        }
+        int64_t count = 0, sum = 0;
+        int64_t min = std::numeric_limits<int64_t>::max(), max = std::numeric_limits<int64_t>::lowest();
+        int64_t buckets[NumBuckets] = {};
+    };
+
+    //floating point values reported one by one, with their average and range
+    struct StatFloatDistribution
+    {
+        void Add(double value)
+        {
+            count++;
+            sum += value;
+            min = std::min(min, value);
+            max = std::max(max, value);
+        }
+        void Merge(const StatFloatDistribution& other)
+        {
+            count += other.count;
+            sum += other.sum;
+            min = std::min(min, other.min);
+            max = std::max(max, other.max);
+        }
+        int64_t count = 0;
+        double sum = 0;
+        double min = std::numeric_limits<double>::max(), max = std::numeric_limits<double>::lowest();
+    };
+
     //statistics counters
     class StatsAccumulator
     {
     public:
         void ReportCounter(const std::string& name, int64_t value) { counters[name] += value; }    
+        void ReportMemoryCounter(const std::string& name, int64_t value) { memoryCounters[name] += value; }
+        void ReportPercentage(const std::string& name, int64_t numerator, int64_t denominator)
+        {
+            percentages[name].first += numerator;
+            percentages[name].second += denominator;
+        }
+        void ReportRatio(const std::string& name, int64_t numerator, int64_t denominator)
+        {
+            ratios[name].first += numerator;
+            ratios[name].second += denominator;
+        }
+        void ReportIntDistribution(const std::string& name, const StatIntDistribution& distribution)
+        { intDistributions[name].Merge(distribution); }
+        void ReportFloatDistribution(const std::string& name, const StatFloatDistribution& distribution)
+        { floatDistributions[name].Merge(distribution); }
+        //print all statistics grouped by the category before the '/' of their names
+        void Print(FILE* file) const;
+        void Clear();
     private:
         std::map<std::string, int64_t> counters;
+        //in bytes
+        std::map<std::string, int64_t> memoryCounters;
+        std::map<std::string, std::pair<int64_t, int64_t>> percentages;
+        std::map<std::string, std::pair<int64_t, int64_t>> ratios;
+        std::map<std::string, StatIntDistribution> intDistributions;
+        std::map<std::string, StatFloatDistribution> floatDistributions;
     };
 
     class StatRegisterer
@@ -39,7 +116,62 @@ namespace pbrt
     }                                                                  \
     static StatRegisterer STATS_REG##variable(STATS_FUNC##variable)
 
+    //counters of allocated bytes
+    #define STAT_MEMORY_COUNTER(title, variable)                       \
+    static thread_local int64_t variable;                              \
+    static void STATS_FUNC##variable(StatsAccumulator& accumulartor)   \
+    {                                                                  \
+        accumulartor.ReportMemoryCounter(title, variable);             \
+        variable = 0;                                                  \
+    }                                                                  \
+    static StatRegisterer STATS_REG##variable(STATS_FUNC##variable)
+
+    //numerator / denominator, printed as a percentage
+    #define STAT_PERCENT(title, numeratorVariable, denominatorVariable)                     \
+    static thread_local int64_t numeratorVariable, denominatorVariable;                    \
+    static void STATS_FUNC##numeratorVariable(StatsAccumulator& accumulator)               \
+    {                                                                                      \
+        accumulator.ReportPercentage(title, numeratorVariable, denominatorVariable);        \
+        numeratorVariable = denominatorVariable = 0;                                       \
+    }                                                                                      \
+    static StatRegisterer STATS_REG##numeratorVariable(STATS_FUNC##numeratorVariable)
+
+    //numerator / denominator, printed as a ratio
+    #define STAT_RATIO(title, numeratorVariable, denominatorVariable)                       \
+    static thread_local int64_t numeratorVariable, denominatorVariable;                    \
+    static void STATS_FUNC##numeratorVariable(StatsAccumulator& accumulator)               \
+    {                                                                                      \
+        accumulator.ReportRatio(title, numeratorVariable, denominatorVariable);             \
+        numeratorVariable = denominatorVariable = 0;                                       \
+    }                                                                                      \
+    static StatRegisterer STATS_REG##numeratorVariable(STATS_FUNC##numeratorVariable)
+
+    //distribution of integer values passed to variable.Add()
+    #define STAT_INT_DISTRIBUTION(title, variable)                     \
+    static thread_local StatIntDistribution variable;                  \
+    static void STATS_FUNC##variable(StatsAccumulator& accumulator)    \
+    {                                                                  \
+        accumulator.ReportIntDistribution(title, variable);            \
+        variable = StatIntDistribution();                              \
+    }                                                                  \
+    static StatRegisterer STATS_REG##variable(STATS_FUNC##variable)
+
+    //distribution of floating point values passed to variable.Add()
+    #define STAT_FLOAT_DISTRIBUTION(title, variable)                   \
+    static thread_local StatFloatDistribution variable;                \
+    static void STATS_FUNC##variable(StatsAccumulator& accumulator)    \
+    {                                                                  \
+        accumulator.ReportFloatDistribution(title, variable);          \
+        variable = StatFloatDistribution();                            \
+    }                                                                  \
+    static StatRegisterer STATS_REG##variable(STATS_FUNC##variable)
+
     void ReportThreadStats();
+    //print the statistics gathered by ReportThreadStats
+    void PrintStats(FILE* dest);
+    void ClearStats();
+    //count of ClearStats() calls, objects that report their current state can tell if their last report was cleared
+    int StatsClearCount();
 
     //profiler
     //an enumerate specify the phase of execution
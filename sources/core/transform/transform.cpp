@@ -1098,17 +1098,65 @@ namespace pbrt
 		return bounds;
 	}
 
+	Point3f AnimatedTransform::operator()(Float time, const Point3f& point) const
+	{
+		if(!actuallyAnimated || time <= startTime)
+			return startTransform->operator()(point);
+		if(time >= endTime)
+			return endTransform->operator()(point);
+		Transform transform;
+		Interpolate(time, &transform);
+		return transform(point);
+	}
+
+	Vector3f AnimatedTransform::operator()(Float time, const Vector3f& vector) const
+	{
+		if(!actuallyAnimated || time <= startTime)
+			return startTransform->operator()(vector);
+		if(time >= endTime)
+			return endTransform->operator()(vector);
+		Transform transform;
+		Interpolate(time, &transform);
+		return transform(vector);
+	}
+
+	Bounds3f AnimatedTransform::MotionBounds(const Bounds3f& bound, Float time0, Float time1) const
+	{
+		if(!actuallyAnimated)
+			return startTransform->operator()(bound);
+		time0 = Clamp(time0, startTime, endTime);
+		time1 = Clamp(time1, startTime, endTime);
+		Transform transform0, transform1;
+		Interpolate(time0, &transform0);
+		Interpolate(time1, &transform1);
+		//points move linearly without rotation
+		if(!hasRotation)
+			return Union(transform0(bound), transform1(bound));
+		Bounds3f bounds;
+		for(uint32_t i = 0; i < 8; i++)
+			bounds = Union(bounds, BoundPointMotion(bound.Corner(i), time0, time1));
+		return bounds;
+	}
+
 	Bounds3f AnimatedTransform::BoundPointMotion(const Point3f& point) const
 	{
-		Bounds3f bound(startTransform->operator()(point), endTransform->operator()(point));
+		return BoundPointMotion(point, startTime, endTime);
+	}
+
+	Bounds3f AnimatedTransform::BoundPointMotion(const Point3f& point, Float time0, Float time1) const
+	{
+		Bounds3f bound(this->operator()(time0, point), this->operator()(time1, point));
 		Float theta = std::acos(Clamp(Dot(rotateStart, rotateEnd), -1.f, 1.f));
+		//search the zeros in the part of the motion during [time0, time1]
+		Float u0 = (time0 - startTime) / (endTime - startTime);
+		Float u1 = (time1 - startTime) / (endTime - startTime);
 		for(uint32_t i = 0; i < 3; i++)
 		{
 			//find any motion derivative zeros for the component
 			Float zeros[4];
 			uint32_t nZeros = 0;
 			IntervalFindZeros(c1[i].Evaluate(point), c2[i].Evaluate(point), c3[i].Evaluate(point),
-							  c4[i].Evaluate(point), c5[i].Evaluate(point), theta, Interval(0.f, 1.f),
+							  c4[i].Evaluate(point), c5[i].Evaluate(point), theta, Interval(u0, u1),
 							  zeros, &nZeros);
 			//expand bounding box for any motion derivative zeros found
 			for(uint32_t j = 0; j < nZeros; j++)
@@ -158,11 +158,9 @@ namespace pbrt
 
 		Ray operator()(const Ray& ray) const
 		{
-			Vector3f oError;
-			Point3f o = this->operator()(ray.o, &oError);
+			Point3f o = this->operator()(ray.o);
 			Vector3f d = this->operator()(ray.d);
-			//offset ray origin to edge of error bounds and compute tMax
-			return Ray(o, d, tMax, ray.time, ray.medium);
+			return Ray(o, d, ray.tMax, ray.time, ray.medium);
 		}
 
 		Bounds3f operator()(const Bounds3f& bound) const
@@ -223,7 +221,10 @@ namespace pbrt
 		void Interpolate(Float time, Transform* transform) const;
 		//get the maximum bounding box of the motion
 		Bounds3f MotionBounds(const Bounds3f& bound) const;
+		//get the bounding box of the motion during [time0, time1], the transform is held outside of its own times
+		Bounds3f MotionBounds(const Bounds3f& bound, Float time0, Float time1) const;
 		Bounds3f BoundPointMotion(const Point3f& point) const;
+		Bounds3f BoundPointMotion(const Point3f& point, Float time0, Float time1) const;
 
 	public:
 		Ray operator()(const Ray& ray) const;
@@ -5,10 +5,17 @@ namespace pbrt
 
     Spectrum WhittedIntegrator::Li(const RayDifferential& ray, const Scene& scene, Sampler& sampler, MemoryArena& arena, uint32_t depth) const
     {
-        Spectrum L(0.f);
-        //find closest ray intersection or return background radiance
+        //find closest ray intersection
         SurfaceInteraction isect;
-        if (!scene.Intersect(ray, &isect))
+        bool hit = scene.Intersect(ray, &isect);
+        return LiFromHit(ray, hit, isect, scene, sampler, arena, depth);
+    }
+
+    Spectrum WhittedIntegrator::LiFromHit(const RayDifferential& ray, bool hit, SurfaceInteraction& isect, const Scene& scene, Sampler& sampler, MemoryArena& arena, uint32_t depth) const
+    {
+        Spectrum L(0.f);
+        //return background radiance if the ray escaped
+        if (!hit)
         {
             for (const auto& light : scene.lights)
                 L += light->Le(ray);
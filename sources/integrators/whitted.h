@@ -10,6 +10,7 @@ namespace pbrt
         WhittedIntegrator(std::shared_ptr<const Camera> camera, std::shared_ptr<Sampler> sampler, uint32_t maxDepth = 5)
             : SamplerIntegrator(camera, sampler), maxDepth(maxDepth) {} 
         Spectrum Li(const RayDifferential& ray, const Scene& scene, Sampler& sampler, MemoryArena& arena, uint32_t depth) const override;
+        Spectrum LiFromHit(const RayDifferential& ray, bool hit, SurfaceInteraction& isect, const Scene& scene, Sampler& sampler, MemoryArena& arena, uint32_t depth) const override;
     private:
         const uint32_t maxDepth;
     };
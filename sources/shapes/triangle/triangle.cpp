@@ -43,6 +43,53 @@ namespace pbrt
 		return Union(Bounds3f(p0, p1), p2);
 	}
 
+	Bounds3f Triangle::ClippedWorldBound(const Bounds3f& clip) const
+	{
+		//clip the triangle polygon against the six planes of clip, every plane adds one vertex at most
+		Point3f polygon[2][9];
+		uint32_t nVertices = 3;
+		for (uint32_t i = 0; i < 3; i++)
+			polygon[0][i] = mesh->position[vertices[i]];
+		uint32_t current = 0;
+		for (uint32_t axis = 0; axis < 3; axis++)
+		{
+			for (uint32_t side = 0; side < 2; side++)
+			{
+				//signed distance to the plane, positive inside clip
+				auto distance = [&](const Point3f& p)
+				{
+					return side == 0 ? p[axis] - clip.pMin[axis] : clip.pMax[axis] - p[axis];
+				};
+				const Point3f* in = polygon[current];
+				Point3f* out = polygon[current ^ 1];
+				uint32_t nOut = 0;
+				for (uint32_t i = 0; i < nVertices; i++)
+				{
+					const Point3f& p0 = in[i];
+					const Point3f& p1 = in[(i + 1) % nVertices];
+					Float d0 = distance(p0), d1 = distance(p1);
+					if (d0 >= 0)
+						out[nOut++] = p0;
+					if ((d0 < 0 && d1 > 0) || (d0 > 0 && d1 < 0))
+					{
+						Point3f p = p0 + (p1 - p0) * (d0 / (d0 - d1));
+						//keep the new vertex exactly on the plane
+						p[axis] = side == 0 ? clip.pMin[axis] : clip.pMax[axis];
+						out[nOut++] = p;
+					}
+				}
+				nVertices = nOut;
+				current ^= 1;
+				if (nVertices == 0)
+					return Bounds3f();
+			}
+		}
+		Bounds3f bound(polygon[current][0]);
+		for (uint32_t i = 1; i < nVertices; i++)
+			bound = Union(bound, polygon[current][i]);
+		return bound;
+	}
+
 	bool Triangle::Intersect(const Ray& ray, Float* tHit, SurfaceInteraction* surfaceInteraction,
 		bool testAlphaTexture) const
 	{
@@ -51,59 +98,11 @@ namespace pbrt
 		const Point3f& p1 = mesh->position[vertices[1]];
 		const Point3f& p2 = mesh->position[vertices[2]];
 		//perform ray-triangle intersection test
-		//transform triangle vertices to ray coordinate space
-		//translate vertices based on ray origin
-		Point3f p0_transform = p0 - Vector3f(ray.o);
-		Point3f p1_transform = p1 - Vector3f(ray.o);
-		Point3f p2_transform = p2 - Vector3f(ray.o);
-		//permute components of triangle vertices and ray direction
-		uint32_t kz = MaxDimension(Abs(ray.d));
-		uint32_t kx = kz + 1;
-		if (kx == 3)
-			kx = 0;
-		uint32_t ky = kx + 1;
-		if (ky == 3)
-			ky = 0;
-		Vector3f d = Permute(ray.d, kx, ky, kz);
-		p0_transform = Permute(p0_transform, kx, ky, kz);
-		p1_transform = Permute(p1_transform, kx, ky, kz);
-		p2_transform = Permute(p2_transform, kx, ky, kz);
-		//apply shear transformation to translated vertex positions
-		Float sx = -d.x / d.z;
-		Float sy = -d.y / d.z;
-		Float sz = 1.f / d.z;
-		p0_transform.x += sx * p0_transform.z;
-		p0_transform.y += sy * p0_transform.z;
-		p0_transform.z *= sz;
-		p1_transform.x += sx * p1_transform.z;
-		p1_transform.y += sy * p1_transform.z;
-		p1_transform.z *= sz;
-		p2_transform.x += sx * p2_transform.z;
-		p2_transform.y += sy * p2_transform.z;
-		p2_transform.z *= sz;
-		//compute edge function coefficients e0, e1, and e2
-		Float e0 = p1_transform.x * p2_transform.y - p1_transform.y * p2_transform.x;
-		Float e1 = p2_transform.x * p0_transform.y - p2_transform.y * p0_transform.x;
-		Float e2 = p0_transform.x * p1_transform.y - p0_transform.y * p1_transform.x;
-		//fall back to double-precision test at triangle edges
-
-		//perform triangle edge and determinant tests
-		if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0))
-			return false;
-		Float det = e0 + e1 + e2;
-		if (det == 0)
+		Float t;
+		Float b[3];
+		if (!IntersectTriangle(ray, ray.tMax, p0, p1, p2, &t, b))
 			return false;
-		//compute scaled hit distance to triangle and test against ray range
-		Float tScaled = e0 * p0_transform.z + e1 * p1_transform.z + e2 * p2_transform.z;
-		if ((det < 0 && (tScaled >= 0 || tScaled < ray.tMax * det)) ||
-			(det > 0 && (tScaled <= 0 || tScaled > ray.tMax * det)))
-			return false;
-		//compute barycentric coordinates and t value for triangle intersection
-		Float invDet = 1.f / det;
-		Float b0 = e0 * invDet;
-		Float b1 = e1 * invDet;
-		Float b2 = e2 * invDet;
-		Float t = tScaled * invDet;
+		Float b0 = b[0], b1 = b[1], b2 = b[2];
 		//ensure that computed triangle t is conservatively greater than zero
 
 		//compute triangle partial derivatives
@@ -190,62 +189,13 @@ namespace pbrt
 		const Point3f& p1 = mesh->position[vertices[1]];
 		const Point3f& p2 = mesh->position[vertices[2]];
 		//perform ray-triangle intersection test
-		//transform triangle vertices to ray coordinate space
-		//translate vertices based on ray origin
-		Point3f p0_transform = p0 - Vector3f(ray.o);
-		Point3f p1_transform = p1 - Vector3f(ray.o);
-		Point3f p2_transform = p2 - Vector3f(ray.o);
-		//permute components of triangle vertices and ray direction
-		uint32_t kz = MaxDimension(Abs(ray.d));
-		uint32_t kx = kz + 1;
-		if (kx == 3)
-			kx = 0;
-		uint32_t ky = kx + 1;
-		if (ky == 3)
-			ky = 0;
-		Vector3f d = Permute(ray.d, kx, ky, kz);
-		p0_transform = Permute(p0_transform, kx, ky, kz);
-		p1_transform = Permute(p1_transform, kx, ky, kz);
-		p2_transform = Permute(p2_transform, kx, ky, kz);
-		//apply shear transformation to translated vertex positions
-		Float sx = -d.x / d.z;
-		Float sy = -d.y / d.z;
-		Float sz = 1.f / d.z;
-		p0_transform.x += sx * p0_transform.z;
-		p0_transform.y += sy * p0_transform.z;
-		p0_transform.z *= sz;
-		p1_transform.x += sx * p1_transform.z;
-		p1_transform.y += sy * p1_transform.z;
-		p1_transform.z *= sz;
-		p2_transform.x += sx * p2_transform.z;
-		p2_transform.y += sy * p2_transform.z;
-		p2_transform.z *= sz;
-		//compute edge function coefficients e0, e1, and e2
-		Float e0 = p1_transform.x * p2_transform.y - p1_transform.y * p2_transform.x;
-		Float e1 = p2_transform.x * p0_transform.y - p2_transform.y * p0_transform.x;
-		Float e2 = p0_transform.x * p1_transform.y - p0_transform.y * p1_transform.x;
-		//fall back to double-precision test at triangle edges
-
-		//perform triangle edge and determinant tests
-		if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0))
-			return false;
-		Float det = e0 + e1 + e2;
-		if (det == 0)
-			return false;
-		//compute scaled hit distance to triangle and test against ray range
-		Float tScaled = e0 * p0_transform.z + e1 * p1_transform.z + e2 * p2_transform.z;
-		if ((det < 0 && (tScaled >= 0 || tScaled < ray.tMax * det)) ||
-			(det > 0 && (tScaled <= 0 || tScaled > ray.tMax * det)))
-			return false;
-		//compute barycentric coordinates and t value for triangle intersection
-		Float invDet = 1.f / det;
-		Float b0 = e0 * invDet;
-		Float b1 = e1 * invDet;
-		Float b2 = e2 * invDet;
-		Float t = tScaled * invDet;
-		//ensure that computed triangle t is conservatively greater than zero
+		Float t;
+		return IntersectTriangle(ray, ray.tMax, p0, p1, p2, &t);
+	}
 
-		return true;
+	TriangleVertices Triangle::GetVertices() const
+	{
+		return { mesh->position[vertices[0]], mesh->position[vertices[1]], mesh->position[vertices[2]] };
 	}
 
 	Float Triangle::Area() const
@@ -27,6 +27,76 @@ namespace pbrt
 			const std::shared_ptr<Texture<Float>>& alphaMask);
 	};
 
+	//world space vertices of a triangle, accelerators keep copies next to each other to test leaves without the mesh
+	struct TriangleVertices
+	{
+		Point3f p0, p1, p2;
+	};
+
+	//watertight ray-triangle test against [0, tMax], return the hit distance in tHit and the barycentric coordinates in b
+	//inline so that accelerators can run it over a leaf without virtual calls
+	inline bool IntersectTriangle(const Ray& ray, Float tMax, const Point3f& p0, const Point3f& p1, const Point3f& p2,
+		Float* tHit, Float b[3] = nullptr)
+	{
+		//transform triangle vertices to ray coordinate space
+		//translate vertices based on ray origin
+		Point3f p0_transform = p0 - Vector3f(ray.o);
+		Point3f p1_transform = p1 - Vector3f(ray.o);
+		Point3f p2_transform = p2 - Vector3f(ray.o);
+		//permute components of triangle vertices and ray direction
+		uint32_t kz = MaxDimension(Abs(ray.d));
+		uint32_t kx = kz + 1;
+		if (kx == 3)
+			kx = 0;
+		uint32_t ky = kx + 1;
+		if (ky == 3)
+			ky = 0;
+		Vector3f d = Permute(ray.d, kx, ky, kz);
+		p0_transform = Permute(p0_transform, kx, ky, kz);
+		p1_transform = Permute(p1_transform, kx, ky, kz);
+		p2_transform = Permute(p2_transform, kx, ky, kz);
+		//apply shear transformation to translated vertex positions
+		Float sx = -d.x / d.z;
+		Float sy = -d.y / d.z;
+		Float sz = 1.f / d.z;
+		p0_transform.x += sx * p0_transform.z;
+		p0_transform.y += sy * p0_transform.z;
+		p0_transform.z *= sz;
+		p1_transform.x += sx * p1_transform.z;
+		p1_transform.y += sy * p1_transform.z;
+		p1_transform.z *= sz;
+		p2_transform.x += sx * p2_transform.z;
+		p2_transform.y += sy * p2_transform.z;
+		p2_transform.z *= sz;
+		//compute edge function coefficients e0, e1, and e2
+		Float e0 = p1_transform.x * p2_transform.y - p1_transform.y * p2_transform.x;
+		Float e1 = p2_transform.x * p0_transform.y - p2_transform.y * p0_transform.x;
+		Float e2 = p0_transform.x * p1_transform.y - p0_transform.y * p1_transform.x;
+		//fall back to double-precision test at triangle edges
+
+		//perform triangle edge and determinant tests
+		if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0))
+			return false;
+		Float det = e0 + e1 + e2;
+		if (det == 0)
+			return false;
+		//compute scaled hit distance to triangle and test against ray range
+		Float tScaled = e0 * p0_transform.z + e1 * p1_transform.z + e2 * p2_transform.z;
+		if ((det < 0 && (tScaled >= 0 || tScaled < tMax * det)) ||
+			(det > 0 && (tScaled <= 0 || tScaled > tMax * det)))
+			return false;
+		//compute barycentric coordinates and t value for triangle intersection
+		Float invDet = 1.f / det;
+		if (b)
+		{
+			b[0] = e0 * invDet;
+			b[1] = e1 * invDet;
+			b[2] = e2 * invDet;
+		}
+		*tHit = tScaled * invDet;
+		return true;
+	}
+
 	class Triangle : public Shape
 	{
 	public:
@@ -39,10 +109,14 @@ namespace pbrt
 
 		Bounds3f ObjectBound() const override;
 		Bounds3f WorldBound() const override;
+		Bounds3f ClippedWorldBound(const Bounds3f& clip) const override;
 		bool Intersect(const Ray& ray, Float* tHit, SurfaceInteraction* surfaceInteraction,
 			bool testAlphaTexture) const override;
 		bool IntersectP(const Ray& ray, bool testAlphaTexture) const override;
 		Float Area() const override;
+		TriangleVertices GetVertices() const;
+		//triangles with alpha masks need a texture lookup for every hit
+		bool HasAlphaMask() const { return mesh->alphaMask != nullptr; }
 	private:
 		std::shared_ptr<TriangleMesh> mesh;
 		const uint32_t* vertices;